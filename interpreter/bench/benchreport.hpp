@@ -0,0 +1,53 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// The bench programs print one csv line per benchmark, so the results of
+// two commits can be compared with a script or a spreadsheet:
+//
+//   benchmark,unit,runs,mean,stddev,min,max
+//
+// Every benchmark is run once to warm up and then runs times; the
+// statistics are over the timed runs. Lower is better for every unit.
+
+inline void print_bench_header(std::ostream& out = std::cout) {
+    out << "benchmark,unit,runs,mean,stddev,min,max" << std::endl;
+}
+
+// Times body runs times. Each run's time in seconds is multiplied by
+// scale to give the number reported, so a run of n operations reported
+// in ns/op has a scale of 1e9 / n.
+template<typename function>
+void run_bench(const std::string& name, const std::string& unit, double scale,
+               int runs, function body, std::ostream& out = std::cout) {
+    body();
+
+    std::vector<double> results;
+    for(int i = 0; i < runs; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        body();
+        auto stop = std::chrono::steady_clock::now();
+        results.push_back(std::chrono::duration<double>(stop - start).count() * scale);
+    }
+
+    double mean = 0;
+    for(double r : results) {
+        mean += r;
+    }
+    mean /= results.size();
+
+    double variance = 0;
+    for(double r : results) {
+        variance += (r - mean) * (r - mean);
+    }
+    variance = results.size() > 1 ? variance / (results.size() - 1) : 0;
+
+    out << name << "," << unit << "," << runs << "," << mean << "," << std::sqrt(variance)
+        << "," << *std::min_element(results.begin(), results.end())
+        << "," << *std::max_element(results.begin(), results.end()) << std::endl;
+}
@@ -0,0 +1,62 @@
+#include <chrono>
+#include <iostream>
+#include <sstream>
+
+#include "../deviser.hpp"
+
+using std::cout;
+using std::endl;
+
+// Looks names up from a scope nested a few levels inside a module, the
+// way a call in a module function's let* body does, with the module
+// importing builtins and another module exporting count symbols.
+static void bench_lookups(size_t count, long lookups) {
+    shared_ptr<lexicalscope> top(new lexicalscope);
+    top->add_import(make_builtins_module(top));
+
+    shared_ptr<module> exporter(new module(read("(lookupbench exports)"), top));
+    vector< shared_ptr<symbol> > names;
+    for(size_t i = 0; i < count; ++i) {
+        std::stringstream name;
+        name << "exported-" << i;
+        exporter->defun_and_export(name.str(), make_number(i));
+        names.push_back(intern(name.str()));
+    }
+
+    shared_ptr<module> user(new module(read("(lookupbench user)"), top));
+    user->add_import(lisp_cast<module>(top->get_imports()[0]));
+    user->add_import(exporter);
+
+    shared_ptr<lexicalscope> scope = user->get_bindings();
+    for(int depth = 0; depth < 4; ++depth) {
+        scope.reset(new lexicalscope(scope));
+    }
+
+    shared_ptr<symbol> car = intern("car");
+    for(int pass = 0; pass < 2; ++pass) {
+        auto start = std::chrono::steady_clock::now();
+        size_t found = 0;
+        for(long i = 0; i < lookups; ++i) {
+            const shared_ptr<symbol>& name = pass == 0 ? car : names[i % count];
+            if(!is_a<nil>(scope->getfun(name))) {
+                ++found;
+            }
+        }
+        auto stop = std::chrono::steady_clock::now();
+        double seconds = std::chrono::duration<double>(stop - start).count();
+
+        cout << "lookups, " << count << " imported: " << (pass == 0 ? "car" : "exported")
+             << " " << lookups / seconds / 1e6 << " M/s (" << found << " found)" << endl;
+    }
+}
+
+int main(int argc, char** argv) {
+    long lookups = argc > 1 ? std::stol(argv[1]) : 2000000;
+
+    size_t counts[] = { 10, 100, 1000 };
+    for(size_t count : counts) {
+        bench_lookups(count, lookups);
+    }
+
+    return 0;
+}
@@ -0,0 +1,131 @@
+#include <cstring>
+#include <iostream>
+#include <streambuf>
+
+#include <glob.h>
+
+#include "../deviser.hpp"
+#include "../vm.hpp"
+#include "benchreport.hpp"
+
+using std::cout;
+using std::endl;
+
+// Whole lisp programs: each module in bench/dvs exports run, which is
+// called once per timed run. Reported in ms per run. Run from the
+// interpreter directory, like deviser, so the module paths resolve.
+//
+// Loading modules and the programs themselves print to cout, so cout is
+// discarded and the results go to the real stdout.
+
+static vector<string> glob_files(const string& pattern) {
+    vector<string> ret;
+    glob_t found;
+    if(glob(pattern.c_str(), 0, nullptr, &found) == 0) {
+        for(size_t i = 0; i < found.gl_pathc; ++i) {
+            ret.push_back(found.gl_pathv[i]);
+        }
+    }
+    globfree(&found);
+    return ret;
+}
+
+static shared_ptr<lexicalscope> make_bench_scope() {
+    shared_ptr<lexicalscope> scope(new lexicalscope);
+    scope->add_import(make_builtins_module(scope));
+
+    shared_ptr<moduleindex> index(new moduleindex(scope));
+    const char* patterns[] = { "../kernel-modules/*.dvs", "../compiler/*.dvs", "bench/dvs/*.dvs" };
+    for(const char* pattern : patterns) {
+        for(const string& filename : glob_files(pattern)) {
+            index->add_file(filename);
+        }
+    }
+    set_module_index(index);
+
+    return scope;
+}
+
+static void bench_program(shared_ptr<lexicalscope> scope, const string& name, int runs,
+                          ostream& results) {
+    shared_ptr<module> mod = scope->find_module(read("(bench-" + name + ")"));
+    shared_ptr<lispfunc> run = mod ? lisp_cast<lispfunc>(mod->get_bindings()->getfun(intern("run"))) : nullptr;
+    if(!run) {
+        std::cerr << name << ": no bench-" << name << " module exporting run" << endl;
+        return;
+    }
+
+    run_bench(name, "ms/run", 1e3, runs, [&]() {
+        if(get_eval_mode() == vm_mode) {
+            vm_apply(run, nullptr, nullptr);
+        } else {
+            eval(make_pooled<cons>(run, make_nil()), run->closure);
+        }
+    }, results);
+}
+
+// Expands every function in the testsuite module, the way loading it
+// does, starting from an empty expansion cache each time.
+static void bench_expand_testsuite(shared_ptr<lexicalscope> scope, int runs, ostream& results) {
+    shared_ptr<module> testsuite = scope->find_module(read("(testsuite)"));
+    shared_ptr<sourcebuffer> source = sourcebuffer::open_file("../kernel-modules/testsuite.dvs");
+    if(!testsuite || !source) {
+        std::cerr << "expand-testsuite: couldn't load ../kernel-modules/testsuite.dvs" << endl;
+        return;
+    }
+
+    vector< shared_ptr<lispobj> > bodies;
+    shared_ptr<cons> form = lisp_cast<cons>(reader(source, "testsuite.dvs").read());
+    for(shared_ptr<cons> c = form; c; c = lisp_cast<cons>(c->cdr())) {
+        shared_ptr<cons> def = lisp_cast<cons>(c->car());
+        if(def && eq(def->car(), intern("defun"))) {
+            shared_ptr<cons> rest = lisp_cast<cons>(def->cdr());
+            shared_ptr<cons> args = rest ? lisp_cast<cons>(rest->cdr()) : nullptr;
+            if(args) {
+                bodies.push_back(args->cdr());
+            }
+        }
+    }
+
+    run_bench("expand-testsuite", "ms/run", 1e3, runs, [&]() {
+        invalidate_macro_expansions();
+        for(auto& body : bodies) {
+            expand_function_body(body, testsuite->get_bindings());
+        }
+    }, results);
+}
+
+// drops everything written to it
+class nullbuffer : public std::streambuf {
+protected:
+    virtual int_type overflow(int_type c) {
+        return traits_type::not_eof(c);
+    }
+};
+
+int main(int argc, char** argv) {
+    int runs = 10;
+    for(int i = 1; i < argc; ++i) {
+        if(strcmp(argv[i], "-s") == 0) {
+            set_eval_mode(stepper_mode);
+        } else {
+            runs = std::max(1, std::stoi(argv[i]));
+        }
+    }
+
+    nullbuffer discarded;
+    std::ostream results(cout.rdbuf());
+    cout.rdbuf(&discarded);
+
+    shared_ptr<lexicalscope> scope = make_bench_scope();
+
+    print_bench_header(results);
+    const char* programs[] = { "fib", "tak", "append", "cond", "assemble" };
+    for(const char* program : programs) {
+        bench_program(scope, program, runs, results);
+    }
+    bench_expand_testsuite(scope, runs, results);
+
+    cout.rdbuf(results.rdbuf());
+    return 0;
+}
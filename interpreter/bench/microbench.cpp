@@ -0,0 +1,145 @@
+#include <iostream>
+#include <sstream>
+
+#include "../deviser.hpp"
+#include "../vm.hpp"
+#include "benchreport.hpp"
+
+using std::cout;
+using std::endl;
+
+// Small pieces of the interpreter, timed from C++. Each one is reported
+// in ns per operation.
+
+static shared_ptr<lexicalscope> make_bench_scope() {
+    shared_ptr<lexicalscope> scope(new lexicalscope);
+    scope->add_import(make_builtins_module(scope));
+    return scope;
+}
+
+// module-like code, about size bytes of it
+static string generate_source(size_t size) {
+    std::stringstream out;
+    for(int i = 0; size_t(out.tellp()) < size; ++i) {
+        out << "; function number " << i << "\n"
+            << "(defun generated-" << i << " (a b &rest more)\n"
+            << "  (let* ((x (+ a " << i * 7 << "))\n"
+            << "         (y (cons \"string \\\"" << i << "\\\" here\" more)))\n"
+            << "    (cond ((eq a b) (list x y 12345))\n"
+            << "          (t (generated-" << i << " (- a 1) b)))))\n\n";
+    }
+    return out.str();
+}
+
+static void bench_reader(int runs) {
+    shared_ptr<sourcebuffer> source(new sourcebuffer(generate_source(1 << 20)));
+    size_t forms = reader(source, "microbench").readall().size();
+
+    run_bench("reader", "ns/form", 1e9 / forms, runs, [&]() {
+        reader r(source, "microbench");
+        r.readall();
+    });
+}
+
+static void bench_eval_arithmetic(int runs, evalmode mode, const string& name) {
+    shared_ptr<lexicalscope> scope = make_bench_scope();
+    shared_ptr<lispobj> form = read("(+ (* 3 4) (- 10 (/ 8 2)) (* (+ 1 2) (- 7 5)))");
+    const int evals = 20000;
+
+    set_eval_mode(mode);
+    run_bench(name, "ns/eval", 1e9 / evals, runs, [&]() {
+        for(int i = 0; i < evals; ++i) {
+            eval(form, scope);
+        }
+    });
+    set_eval_mode(vm_mode);
+}
+
+// a list of length numbers, each of which is nested depth lists deep
+static shared_ptr<lispobj> make_deep_list(int length, int depth) {
+    vector< shared_ptr<lispobj> > elements;
+    for(int i = 0; i < length; ++i) {
+        shared_ptr<lispobj> element = make_number(i);
+        for(int d = 0; d < depth; ++d) {
+            element = make_pooled<cons>(element, make_nil());
+        }
+        elements.push_back(element);
+    }
+    return make_list(elements.begin(), elements.end());
+}
+
+static void bench_equal(int runs) {
+    shared_ptr<lispobj> left = make_deep_list(1000, 20);
+    shared_ptr<lispobj> right = make_deep_list(1000, 20);
+    const int compares = 100;
+
+    run_bench("equal-deep-lists", "ns/equal", 1e9 / compares, runs, [&]() {
+        for(int i = 0; i < compares; ++i) {
+            if(!equal(left, right)) {
+                cout << "equal-deep-lists: lists differ" << endl;
+            }
+        }
+    });
+}
+
+// from a let* body four scopes inside a module that imports builtins
+// and a module exporting 100 functions, like bench/lookupbench.cpp
+static void bench_lookup(int runs) {
+    shared_ptr<lexicalscope> top = make_bench_scope();
+    shared_ptr<module> exporter(new module(read("(microbench exports)"), top));
+    vector< shared_ptr<symbol> > names;
+    for(int i = 0; i < 100; ++i) {
+        std::stringstream name;
+        name << "exported-" << i;
+        exporter->defun_and_export(name.str(), make_number(i));
+        names.push_back(intern(name.str()));
+    }
+    names.push_back(intern("car"));
+
+    shared_ptr<module> user(new module(read("(microbench user)"), top));
+    user->add_import(lisp_cast<module>(top->get_imports()[0]));
+    user->add_import(exporter);
+    shared_ptr<lexicalscope> scope = user->get_bindings();
+    for(int depth = 0; depth < 4; ++depth) {
+        scope.reset(new lexicalscope(scope));
+    }
+
+    const int lookups = 200000;
+    run_bench("scope-lookup", "ns/lookup", 1e9 / lookups, runs, [&]() {
+        for(int i = 0; i < lookups; ++i) {
+            scope->getfun(names[i % names.size()]);
+        }
+    });
+}
+
+static void bench_bitvector(int runs) {
+    bitvector bits(32);
+    const int instructions = 100000;
+
+    // the field writes the assembler does for one instruction
+    run_bench("bitvector-ops", "ns/instruction", 1e9 / instructions, runs, [&]() {
+        for(int i = 0; i < instructions; ++i) {
+            bits.set_bit_range(28, 32, i & 15);
+            bits.set_bit(25, 1);
+            bits.set_bit(20, i & 1);
+            bits.set_bit_range(16, 20, (i >> 4) & 15);
+            bits.set_bit_range(12, 16, (i >> 8) & 15);
+            bits.set_bit_range(0, 12, i & 4095);
+            bits.get_bit(i & 31);
+        }
+    });
+}
+
+int main(int argc, char** argv) {
+    int runs = argc > 1 ? std::max(1, std::stoi(argv[1])) : 10;
+
+    print_bench_header();
+    bench_reader(runs);
+    bench_eval_arithmetic(runs, vm_mode, "eval-arithmetic-vm");
+    bench_eval_arithmetic(runs, stepper_mode, "eval-arithmetic-stepper");
+    bench_equal(runs);
+    bench_lookup(runs);
+    bench_bitvector(runs);
+
+    return 0;
+}
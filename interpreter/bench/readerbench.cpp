@@ -0,0 +1,84 @@
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include <unistd.h>
+
+#include "../deviser.hpp"
+
+using std::cout;
+using std::endl;
+
+// Writes roughly size bytes of module-like code: nested defuns with
+// symbols, numbers, strings and comments.
+static void generate_source(const string& filename, size_t size) {
+    std::ofstream out(filename);
+    size_t written = 0;
+
+    for(int i = 0; written < size; ++i) {
+        std::stringstream ss;
+        ss << "; function number " << i << "\n"
+           << "(defun generated-" << i << " (a b &rest more)\n"
+           << "  (let* ((x (+ a " << i * 7 << "))\n"
+           << "         (y (cons \"string \\\"" << i << "\\\" here\" more)))\n"
+           << "    (cond ((eq a b) (list x y 12345))\n"
+           << "          (t (generated-" << i << " (- a 1) b)))))\n\n";
+        out << ss.str();
+        written += ss.str().size();
+    }
+}
+
+int main(int argc, char** argv) {
+    size_t megabytes = argc > 1 ? std::stoul(argv[1]) : 16;
+    int rounds = argc > 2 ? std::stoi(argv[2]) : 5;
+
+    char filename[] = "/tmp/readerbenchXXXXXX";
+    int fd = mkstemp(filename);
+    if(fd < 0) {
+        cout << "couldn't make a temporary file" << endl;
+        return 1;
+    }
+    close(fd);
+    generate_source(filename, megabytes << 20);
+
+    for(int indexed = 0; indexed < 2; ++indexed) {
+        double best = 0;
+        size_t bytes = 0;
+        size_t forms = 0;
+
+        for(int i = 0; i < rounds; ++i) {
+            auto start = std::chrono::steady_clock::now();
+            shared_ptr<sourcebuffer> buf = sourcebuffer::open_file(filename);
+            reader r(buf, filename);
+            vector< shared_ptr<lispobj> > objs = indexed ? r.readall_indexed() : r.readall();
+            auto stop = std::chrono::steady_clock::now();
+
+            bytes = buf->size();
+            forms = objs.size();
+            double seconds = std::chrono::duration<double>(stop - start).count();
+            double rate = bytes / seconds / (1 << 20);
+            if(rate > best) {
+                best = rate;
+            }
+        }
+
+        cout << (indexed ? "reader-indexed: " : "reader: ") << bytes << " bytes, "
+             << forms << " forms, " << best << " MB/s (best of " << rounds << ")" << endl;
+    }
+
+    // the scan on its own, without building any objects
+    shared_ptr<sourcebuffer> buf = sourcebuffer::open_file(filename);
+    vector<tokenstart> tokens;
+    auto start = std::chrono::steady_clock::now();
+    scan_structure(buf->begin(), buf->end(), 1, 1, tokens);
+    auto stop = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(stop - start).count();
+    cout << "scan_structure: " << tokens.size() << " tokens, "
+         << buf->size() / seconds / (1 << 20) << " MB/s" << endl;
+
+    unlink(filename);
+
+    return 0;
+}
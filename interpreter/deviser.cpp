@@ -1,51 +1,178 @@
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
 #include <cmath>
+#include <cstring>
 #include <istream>
 #include <iostream>
+#include <limits>
+#include <mutex>
 #include <sstream>
 #include <stack>
 #include <typeinfo>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "deviser.hpp"
+#include "modulecache.hpp"
+#include "profiler.hpp"
+#include "vm.hpp"
 
 using std::cout;
 using std::endl;
-using std::dynamic_pointer_cast;
 using std::make_shared;
 using std::min;
+using std::static_pointer_cast;
 using std::stringstream;
 
-lispobj::lispobj() {}
-lispobj::~lispobj() {}
+static runtimestats runtime_stats = runtimestats();
+static std::atomic<size_t> allocations_by_type[lisp_type_count];
+
+lispobj::lispobj(int type) :
+    typetag(type),
+    haslocation(false)
+{
+    allocations_by_type[type].fetch_add(1, std::memory_order_relaxed);
+}
+
+const char* lisp_type_tag_name(int type) {
+    static const char* names[lisp_type_count] = {
+        "invalid", "nil", "cons", "symbol", "number", "function", "cfunc",
+        "module", "string", "input-port", "bitvector", "macro", "foreign"
+    };
+    return type >= 0 && type < lisp_type_count ? names[type] : "unknown";
+}
+
+runtimestats get_runtime_stats() {
+    runtimestats stats = runtime_stats;
+    for(int i = 0; i < lisp_type_count; ++i) {
+        stats.allocations[i] = allocations_by_type[i].load(std::memory_order_relaxed);
+    }
+    return stats;
+}
+
+static void note_lookup(size_t& lookups, size_t& scopes, size_t& longest, size_t walked) {
+    ++lookups;
+    scopes += walked;
+    if(walked > longest) {
+        longest = walked;
+    }
+}
+
+static void forget_source_location(const lispobj* obj);
+
+lispobj::~lispobj() {
+    if(haslocation) {
+        forget_source_location(this);
+    }
+}
+
+nil::nil() :
+    lispobj(NIL_TYPE)
+{}
 
-nil::nil() {}
+const shared_ptr<nil>& make_nil() {
+    static const shared_ptr<nil> the_nil(new nil());
+    return the_nil;
+}
 
 void nil::print(ostream& out) {
     out << "'()";
 }
 
-symbol::symbol(string sn) {
-    symname = sn;
+symbol::symbol(const string& sn, int id) :
+    lispobj(SYMBOL_TYPE),
+    symname(sn),
+    symid(id),
+    keyword(!sn.empty() && sn[0] == ':')
+{
+
 }
 
-string symbol::name() const {
+const string& symbol::name() const {
     return symname;
 }
 
+int symbol::id() const {
+    return symid;
+}
+
+bool symbol::is_keyword() const {
+    return keyword;
+}
+
 void symbol::print(ostream& out) {
     out << symname;
 }
 
-cons::cons(shared_ptr<lispobj> a, shared_ptr<lispobj> d) {
+// Module files are read on several threads, so the table is locked.
+class symboltable {
+public:
+    std::mutex lock;
+    std::unordered_map<string, shared_ptr<symbol> > byname;
+    vector< shared_ptr<symbol> > byid;
+};
+
+static symboltable& get_symbol_table() {
+    // function local so that interning works during static initialization
+    static symboltable table;
+    return table;
+}
+
+shared_ptr<symbol> intern(const string& name) {
+    symboltable& table = get_symbol_table();
+    std::lock_guard<std::mutex> lock(table.lock);
+    auto it = table.byname.find(name);
+    if(it != table.byname.end()) {
+        return it->second;
+    }
+
+    shared_ptr<symbol> sym(new symbol(name, table.byid.size()));
+    table.byname[name] = sym;
+    table.byid.push_back(sym);
+    return sym;
+}
+
+shared_ptr<symbol> symbol_by_id(int id) {
+    symboltable& table = get_symbol_table();
+    std::lock_guard<std::mutex> lock(table.lock);
+    return table.byid.at(id);
+}
+
+const shared_ptr<symbol> nil_symbol = intern("nil");
+const shared_ptr<symbol> t_symbol = intern("t");
+const shared_ptr<symbol> rest_symbol = intern("&rest");
+const shared_ptr<symbol> if_symbol = intern("if");
+const shared_ptr<symbol> lambda_symbol = intern("lambda");
+const shared_ptr<symbol> macro_symbol = intern("macro");
+const shared_ptr<symbol> module_symbol = intern("module");
+const shared_ptr<symbol> import_symbol = intern("import");
+const shared_ptr<symbol> export_symbol = intern("export");
+const shared_ptr<symbol> init_symbol = intern("init");
+const shared_ptr<symbol> begin_symbol = intern("begin");
+const shared_ptr<symbol> defun_symbol = intern("defun");
+const shared_ptr<symbol> defmacro_symbol = intern("defmacro");
+const shared_ptr<symbol> quote_symbol = intern("quote");
+const shared_ptr<symbol> let_star_symbol = intern("let*");
+const shared_ptr<symbol> macro_expand_1_symbol = intern("macro-expand-1");
+
+cons::cons(shared_ptr<lispobj> a, shared_ptr<lispobj> d) :
+    lispobj(CONS_TYPE)
+{
     first = a;
     second = d;
 }
 
-shared_ptr<lispobj> cons::car() const {
+const shared_ptr<lispobj>& cons::car() const {
     return first;
 }
 
-shared_ptr<lispobj> cons::cdr() const {
+const shared_ptr<lispobj>& cons::cdr() const {
     return second;
 }
 
@@ -60,15 +187,15 @@ void cons::set_cdr(shared_ptr<lispobj> d) {
 void cons::print(ostream& out) {
     out << '(';
     car()->print(out);
-    shared_ptr<cons> c;
-    shared_ptr<lispobj> obj = cdr();
-    while((c = dynamic_pointer_cast<cons>(obj))) {
+    lispobj* obj = cdr().get();
+    while(obj->type() == CONS_TYPE) {
+        cons* c = static_cast<cons*>(obj);
         out << ' ';
         c->car()->print(out);
-        obj = c->cdr();
+        obj = c->cdr().get();
     }
 
-    if(dynamic_pointer_cast<nil>(obj)) {
+    if(obj->type() == NIL_TYPE) {
         out << ')';
     } else {
         out << " . ";
@@ -77,10 +204,29 @@ void cons::print(ostream& out) {
     }
 }
 
-number::number(int n) {
+number::number(int n) :
+    lispobj(NUMBER_TYPE)
+{
     num = n;
 }
 
+static vector< shared_ptr<number> > make_small_numbers() {
+    vector< shared_ptr<number> > numbers;
+    numbers.reserve(small_number_max - small_number_min);
+    for(int i = small_number_min; i < small_number_max; ++i) {
+        numbers.push_back(make_pooled<number>(i));
+    }
+    return numbers;
+}
+
+shared_ptr<number> make_number(int num) {
+    static const vector< shared_ptr<number> > small_numbers = make_small_numbers();
+    if(num >= small_number_min && num < small_number_max) {
+        return small_numbers[num - small_number_min];
+    }
+    return make_pooled<number>(num);
+}
+
 int number::value() const {
     return num;
 }
@@ -89,27 +235,158 @@ void number::print(ostream& out) {
     out << value();
 }
 
-lispstring::lispstring(const string& str) :
-    contents(str)
+stringpiece::stringpiece(shared_ptr<const string> t, size_t o, size_t l) :
+    text(t),
+    offset(o),
+    length(l)
+{
+
+}
+
+stringpiece::stringpiece(shared_ptr<stringpiece> l, shared_ptr<stringpiece> r) :
+    offset(0),
+    length(l->length + r->length),
+    left(l),
+    right(r)
+{
+
+}
+
+stringpiece::~stringpiece() {
+    if(!left) {
+        return;
+    }
+
+    // a string built by appending is a long chain of joins, which would
+    // overflow the stack if it were freed recursively
+    vector< shared_ptr<stringpiece> > pending;
+    pending.push_back(std::move(left));
+    pending.push_back(std::move(right));
+    while(!pending.empty()) {
+        shared_ptr<stringpiece> piece = std::move(pending.back());
+        pending.pop_back();
+        if(piece && piece->left && piece.use_count() == 1) {
+            pending.push_back(std::move(piece->left));
+            pending.push_back(std::move(piece->right));
+        }
+    }
+}
+
+// appends and substrings shorter than this are copied instead of
+// sharing pieces, so strings built a character at a time don't become a
+// piece per character
+const size_t min_join_length = 64;
+
+static shared_ptr<stringpiece> make_run(string text) {
+    size_t length = text.size();
+    return make_shared<stringpiece>(make_shared<const string>(std::move(text)), 0, length);
+}
+
+// appends piece's characters to out, left to right
+static void copy_piece(const stringpiece* piece, string& out) {
+    vector<const stringpiece*> pending(1, piece);
+    while(!pending.empty()) {
+        const stringpiece* p = pending.back();
+        pending.pop_back();
+        if(p->text) {
+            out.append(*p->text, p->offset, p->length);
+        } else {
+            pending.push_back(p->right.get());
+            pending.push_back(p->left.get());
+        }
+    }
+}
+
+lispstring::lispstring(string str) :
+    lispobj(STRING_TYPE),
+    text(std::move(str))
 {
 
 }
 
+lispstring::lispstring(shared_ptr<const string> text, size_t offset, size_t length) :
+    lispobj(STRING_TYPE),
+    pieces(make_shared<stringpiece>(text, offset, length))
+{
+
+}
+
+const shared_ptr<stringpiece>& lispstring::share() const {
+    if(!pieces) {
+        pieces = make_run(std::move(text));
+        text.clear();
+    }
+    return pieces;
+}
+
 void lispstring::append(shared_ptr<lispstring> lstr) {
-    contents.append(lstr->contents);
+    size_t added = lstr->size();
+    if(added == 0) {
+        return;
+    }
+
+    if(size() + added < min_join_length) {
+        if(pieces) {
+            flatten();
+        }
+        if(lstr->pieces) {
+            copy_piece(lstr->pieces.get(), text);
+        } else {
+            text.append(lstr->text);
+        }
+    } else if(size() == 0) {
+        pieces = lstr->share();
+    } else {
+        pieces = make_shared<stringpiece>(share(), lstr->share());
+    }
+}
+
+size_t lispstring::size() const {
+    return pieces ? pieces->length : text.size();
+}
+
+void lispstring::flatten() const {
+    string flat;
+    flat.reserve(pieces->length);
+    copy_piece(pieces.get(), flat);
+    text = std::move(flat);
+    pieces.reset();
 }
 
 const string& lispstring::get_contents() const {
-    return contents;
+    if(pieces) {
+        if(pieces->text && pieces->offset == 0 && pieces->length == pieces->text->size()) {
+            return *pieces->text;
+        }
+        flatten();
+    }
+    return text;
+}
+
+shared_ptr<lispstring> lispstring::substring(size_t start, size_t end) const {
+    if(start > end || end > size()) {
+        throw string("ERROR substring: range is outside the string");
+    }
+    if(pieces && !pieces->text) {
+        flatten();
+    }
+
+    if(end - start < min_join_length) {
+        const char* chars = pieces ? pieces->text->data() + pieces->offset : text.data();
+        return make_shared<lispstring>(string(chars + start, chars + end));
+    }
+    const shared_ptr<stringpiece>& run = share();
+    return make_shared<lispstring>(run->text, run->offset + start, end - start);
 }
 
 void lispstring::print(ostream& out) {
-    out << contents;
+    out << get_contents();
 }
 
 void lispstring::repr(ostream& out) {
+    const string& text = get_contents();
     out << "\"";
-    for(auto it = contents.begin(); it != contents.end(); ++it) {
+    for(auto it = text.begin(); it != text.end(); ++it) {
         switch(*it) {
         case '"':
             out << "\\\"";
@@ -134,6 +411,7 @@ void lispstring::repr(ostream& out) {
 lispfunc::lispfunc(shared_ptr<lispobj> _args,
                    shared_ptr<lexicalscope> _closure,
                    shared_ptr<lispobj> _code) :
+    lispobj(FUNC_TYPE),
     args(_args),
     closure(_closure),
     code(_code)
@@ -142,6 +420,7 @@ lispfunc::lispfunc(shared_ptr<lispobj> _args,
 }
 
 bitvector::bitvector(int size) :
+    lispobj(BITVECTOR_TYPE),
     size(size),
     contents(ceil((float) size / 8)) {
 
@@ -214,8 +493,21 @@ void bitvector::print(ostream& out) {
 }
 
 void lispfunc::print(ostream& out) {
-    make_shared<cons>(make_shared<symbol>("lambda"),
-                      make_shared<cons>(args, code))->print(out);
+    make_pooled<cons>(lambda_symbol,
+                      make_pooled<cons>(args, code))->print(out);
+}
+
+void lispfunc::traverse(gcvisitor& visitor) {
+    visitor.visit(args);
+    visitor.visit(closure);
+    visitor.visit(code);
+    visitor.visit(expandedcode);
+}
+
+void lispfunc::clear_references() {
+    closure.reset();
+    expandedcode.reset();
+    compiledcode.reset();
 }
 
 shared_ptr<lispobj> lispfunc::get_expanded_code() {
@@ -226,9 +518,27 @@ shared_ptr<lispobj> lispfunc::get_expanded_code() {
     return expandedcode;
 }
 
+shared_ptr<bytecode> lispfunc::get_compiled_code() {
+    if(!compiledcode) {
+        compiledcode = compile_function(args, get_expanded_code());
+        compiledcode->name = name;
+    }
+
+    return compiledcode;
+}
+
+void lispfunc::set_expanded_code(shared_ptr<lispobj> expanded) {
+    expandedcode = expanded;
+}
+
+void lispfunc::set_compiled_code(shared_ptr<bytecode> compiled) {
+    compiledcode = compiled;
+}
+
 macro::macro(shared_ptr<lispobj> _args,
              shared_ptr<lexicalscope> _closure,
              shared_ptr<lispobj> _code) :
+    lispobj(MACRO_TYPE),
     args(_args),
     closure(_closure),
     code(_code)
@@ -237,11 +547,45 @@ macro::macro(shared_ptr<lispobj> _args,
 }
 
 void macro::print(ostream& out) {
-    make_shared<cons>(make_shared<symbol>("macro"),
-                      make_shared<cons>(args, code))->print(out);
+    make_pooled<cons>(macro_symbol,
+                      make_pooled<cons>(args, code))->print(out);
+}
+
+void macro::traverse(gcvisitor& visitor) {
+    visitor.visit(args);
+    visitor.visit(closure);
+    visitor.visit(code);
+    visitor.visit(expandedcode);
+}
+
+void macro::clear_references() {
+    closure.reset();
+    expandedcode.reset();
+    compiledcode.reset();
+}
+
+shared_ptr<lispobj> macro::get_expanded_code() {
+    if(!expandedcode) {
+        expandedcode = expand_function_body(code, closure);
+    }
+
+    return expandedcode;
+}
+
+void macro::set_expanded_code(shared_ptr<lispobj> expanded) {
+    expandedcode = expanded;
+}
+
+shared_ptr<bytecode> macro::get_compiled_code() {
+    if(!compiledcode) {
+        compiledcode = compile_body(get_expanded_code());
+    }
+
+    return compiledcode;
 }
 
-cfunc::cfunc(std::function<shared_ptr<lispobj>(vector<shared_ptr<lispobj> >)> f) :
+cfunc::cfunc(cfunctype f) :
+    lispobj(CFUNC_TYPE),
     func(f)
 {
 
@@ -252,30 +596,156 @@ void cfunc::print(ostream& out) {
 }
 
 fileinputport::fileinputport(string fname) :
+    lispobj(FILEINPUTPORT_TYPE),
     filename(fname),
-    instream(filename)
+    fd(open(filename.c_str(), O_RDONLY)),
+    buffer(port_buffer_size),
+    start(0),
+    end(0)
 {
 
 }
 
+fileinputport::~fileinputport() {
+    if(fd >= 0) {
+        close(fd);
+    }
+}
+
+bool fileinputport::fill() {
+    start = 0;
+    end = 0;
+    if(fd < 0) {
+        return false;
+    }
+
+    ssize_t count;
+    while((count = ::read(fd, buffer.data(), buffer.size())) < 0 && errno == EINTR) {
+    }
+    if(count < 0) {
+        throw "ERROR reading " + filename + ": " + strerror(errno);
+    }
+
+    end = count;
+    return count > 0;
+}
+
 shared_ptr<lispobj> fileinputport::read() {
-    char buf[256];
-    instream.read(buf, 256);
-    if(instream) {
-        return make_shared<lispstring>(buf);
-    } else {
-        return make_shared<lispstring>("");
+    return read_bytes(256);
+}
+
+size_t fileinputport::read_direct(char* out, size_t count) {
+    size_t got = 0;
+    while(got < count) {
+        ssize_t n = ::read(fd, out + got, count - got);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n < 0) {
+            throw "ERROR reading " + filename + ": " + strerror(errno);
+        }
+        if(n == 0) {
+            break;
+        }
+        got += n;
+    }
+    return got;
+}
+
+size_t fileinputport::unread_file_size() {
+    if(fd < 0) {
+        return 0;
+    }
+
+    struct stat info;
+    off_t position = lseek(fd, 0, SEEK_CUR);
+    if(position < 0 || fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+        return unknown_file_size;
+    }
+    return info.st_size > position ? info.st_size - position : 0;
+}
+
+shared_ptr<lispobj> fileinputport::read_bytes(size_t count) {
+    size_t buffered = std::min(count, end - start);
+    string ret(buffer.data() + start, buffered);
+    start += buffered;
+
+    // big reads of a file go straight into the string, which is never
+    // made bigger than what's left of the file
+    size_t rest = count - buffered;
+    if(rest >= port_buffer_size) {
+        size_t unread = unread_file_size();
+        if(unread != unknown_file_size) {
+            size_t direct = std::min(rest, unread);
+            ret.resize(buffered + direct);
+            ret.resize(buffered + read_direct(&ret[buffered], direct));
+        }
+    }
+
+    // a pipe, or a file that grew, is read a buffer at a time
+    while(ret.size() < count && fill()) {
+        size_t n = std::min(count - ret.size(), end - start);
+        ret.append(buffer.data() + start, n);
+        start += n;
+    }
+
+    if(ret.size() < count) {
+        ret.shrink_to_fit();
+    }
+    return make_shared<lispstring>(std::move(ret));
+}
+
+shared_ptr<lispobj> fileinputport::read_line() {
+    string line;
+    bool found = false;
+    while(start < end || fill()) {
+        found = true;
+        const char* begin = buffer.data() + start;
+        const char* newline = static_cast<const char*>(memchr(begin, '\n', end - start));
+        if(newline) {
+            line.append(begin, newline);
+            start += newline - begin + 1;
+            return make_shared<lispstring>(std::move(line));
+        }
+        line.append(begin, end - start);
+        start = end;
+    }
+
+    // the last line may have no newline
+    if(found) {
+        return make_shared<lispstring>(std::move(line));
     }
+    return make_nil();
+}
+
+shared_ptr<lispobj> fileinputport::read_all() {
+    string ret(buffer.data() + start, end - start);
+    start = end;
+
+    size_t buffered = ret.size();
+    size_t unread = unread_file_size();
+    if(unread != unknown_file_size && unread > 0) {
+        ret.resize(buffered + unread);
+        ret.resize(buffered + read_direct(&ret[buffered], unread));
+        if(ret.size() < buffered + unread) {
+            ret.shrink_to_fit();
+        }
+    }
+
+    // not a regular file (a pipe, say), or it grew since
+    while(fill()) {
+        ret.append(buffer.data() + start, end - start);
+        start = end;
+    }
+
+    return make_shared<lispstring>(std::move(ret));
 }
 
 shared_ptr<lispobj> fileinputport::readchar() {
-    char buf;
-    instream.get(buf);
-    if(instream) {
-        return make_shared<lispstring>(string(&buf, 1));
-    } else {
+    if(start == end && !fill()) {
         return make_shared<lispstring>("");
     }
+    return make_shared<lispstring>(string(1, buffer[start++]));
 }
 
 void fileinputport::print(ostream& out) {
@@ -284,6 +754,7 @@ void fileinputport::print(ostream& out) {
 
 
 module::module(shared_ptr<lispobj> _name, shared_ptr<lexicalscope> enc_scope) :
+    lispobj(MODULE_TYPE),
     name(_name),
     module_scope(new lexicalscope(enc_scope)),
     inited(false)
@@ -291,68 +762,68 @@ module::module(shared_ptr<lispobj> _name, shared_ptr<lexicalscope> enc_scope) :
     module_scope->set_ismodulescope(true);
 }
 
-string get_command_name(shared_ptr<lispobj> command) {
-    shared_ptr<cons> c;
-    if(!(c = dynamic_pointer_cast<cons>(command))) {
-        return "";
-    }
+static const shared_ptr<symbol> undefine_symbol = intern("undefine");
+static const shared_ptr<symbol> unexport_symbol = intern("unexport");
+static const shared_ptr<symbol> unimport_symbol = intern("unimport");
+static const shared_ptr<symbol> dump_symbol = intern("dump");
 
-    shared_ptr<symbol> sym;
-    if(!(sym = dynamic_pointer_cast<symbol>(c->car()))) {
-        return "";
+shared_ptr<symbol> get_command_name(shared_ptr<lispobj> command) {
+    shared_ptr<cons> c;
+    if(!(c = lisp_cast<cons>(command))) {
+        return nullptr;
     }
 
-    return sym->name();
+    return lisp_cast<symbol>(c->car());
 }
 
 shared_ptr<lispobj> module::eval(shared_ptr<lispobj> command) {
-    string command_name = get_command_name(command);
+    shared_ptr<symbol> command_name = get_command_name(command);
 
-    if(command_name == "defun" || command_name == "defmacro") {
+    if(command_name == defun_symbol || command_name == defmacro_symbol) {
         defines.push_back(command);
         return ::eval(command, module_scope);
-    } else if(command_name == "undefine") {
+    } else if(command_name == undefine_symbol) {
 
-    } else if(command_name == "export") {
-        shared_ptr<cons> command_cons = dynamic_pointer_cast<cons>(command);
+    } else if(command_name == export_symbol) {
+        shared_ptr<cons> command_cons = lisp_cast<cons>(command);
         shared_ptr<lispobj> exportdecl = command_cons->cdr();
 
-        shared_ptr<cons> c = dynamic_pointer_cast<cons>(exportdecl);
+        shared_ptr<cons> c = lisp_cast<cons>(exportdecl);
         if(!c) {
             cout << "nothing to export" << endl;
-            return make_shared<nil>();
+            return make_nil();
         }
 
         while(c) {
-            shared_ptr<symbol> exportname = dynamic_pointer_cast<symbol>(c->car());
+            shared_ptr<symbol> exportname = lisp_cast<symbol>(c->car());
             if(!exportname) {
                 cout << "non-symbol in export list" << endl;
-                return make_shared<nil>();
+                return make_nil();
             }
 
             add_export(exportname);
 
-            c = dynamic_pointer_cast<cons>(c->cdr());
+            c = lisp_cast<cons>(c->cdr());
         }
         return command_cons->cdr();
-    } else if(command_name == "unexport") {
+    } else if(command_name == unexport_symbol) {
 
-    } else if(command_name == "import") {
-        shared_ptr<cons> command_cons = dynamic_pointer_cast<cons>(command);
+    } else if(command_name == import_symbol) {
+        shared_ptr<cons> command_cons = lisp_cast<cons>(command);
         shared_ptr<lispobj> importdecl = command_cons->cdr();
 
-        shared_ptr<cons> c = dynamic_pointer_cast<cons>(importdecl);
+        shared_ptr<cons> c = lisp_cast<cons>(importdecl);
         if(!c) {
-            return make_shared<nil>();
+            return make_nil();
         }
 
-        if(!dynamic_pointer_cast<nil>(c->cdr())) {
+        if(!is_a<nil>(c->cdr())) {
             cout << "too many arguments to import" << endl;
-            return make_shared<nil>();
+            return make_nil();
         }
 
         shared_ptr<module> module_for_import(module_scope->find_module(c->car()));
-        if(module_for_import) {
+        if(module_for_import && module_for_import->init()) {
             add_import(module_for_import);
             return c->car();
         } else {
@@ -360,19 +831,19 @@ shared_ptr<lispobj> module::eval(shared_ptr<lispobj> command) {
             c->car()->print();
             cout << endl;
         }
-    } else if(command_name == "unimport") {
+    } else if(command_name == unimport_symbol) {
 
-    } else if(command_name == "init") {
-        shared_ptr<cons> command_cons = dynamic_pointer_cast<cons>(command);
+    } else if(command_name == init_symbol) {
+        shared_ptr<cons> command_cons = lisp_cast<cons>(command);
         initblocks.push_back(command_cons->cdr());
-    } else if(command_name == "dump") {
+    } else if(command_name == dump_symbol) {
         cout << "(module ";
         name->print();
 
         if(imports.size() > 0) {
             cout << endl;
             cout << "  ";
-            make_shared<cons>(make_shared<symbol>("import"),
+            make_pooled<cons>(import_symbol,
                               make_reverse_list(imports.rbegin(),
                                                 imports.rend()))->print();
         }
@@ -380,7 +851,7 @@ shared_ptr<lispobj> module::eval(shared_ptr<lispobj> command) {
         if(exports.size() > 0) {
             cout << endl;
             cout << "  ";
-            make_shared<cons>(make_shared<symbol>("export"),
+            make_pooled<cons>(export_symbol,
                               make_reverse_list(exports.rbegin(),
                                                 exports.rend()))->print();
         }
@@ -394,7 +865,7 @@ shared_ptr<lispobj> module::eval(shared_ptr<lispobj> command) {
         for(auto initblock : initblocks) {
             cout << endl;
             cout << "  ";
-            make_shared<cons>(make_shared<symbol>("init"), initblock)->print();
+            make_pooled<cons>(init_symbol, initblock)->print();
         }
 
         cout << ")" << endl;
@@ -402,7 +873,7 @@ shared_ptr<lispobj> module::eval(shared_ptr<lispobj> command) {
         return ::eval(command, module_scope);
     }
 
-    return make_shared<nil>();
+    return make_nil();
 }
 
 void module::add_import(shared_ptr<module> mod) {
@@ -411,26 +882,29 @@ void module::add_import(shared_ptr<module> mod) {
 }
 
 void module::add_export(shared_ptr<symbol> sym) {
-    exports.push_back(sym);
+    if(exportids.insert(sym->id()).second) {
+        exports.push_back(sym);
+        invalidate_import_tables();
+    }
 }
 
-void module::defval(string name, shared_ptr<lispobj> value) {
+void module::defval(shared_ptr<symbol> name, shared_ptr<lispobj> value) {
     module_scope->defval(name, value);
 }
 
-void module::defun(string name, shared_ptr<lispobj> value) {
+void module::defun(shared_ptr<symbol> name, shared_ptr<lispobj> value) {
     module_scope->defun(name, value);
 }
 
 void module::defval_and_export(string symname, shared_ptr<lispobj> value) {
-    shared_ptr<symbol> name(new symbol(symname));
-    defval(symname, value);
+    shared_ptr<symbol> name = intern(symname);
+    defval(name, value);
     add_export(name);
 }
 
 void module::defun_and_export(string symname, shared_ptr<lispobj> value) {
-    shared_ptr<symbol> name(new symbol(symname));
-    defun(symname, value);
+    shared_ptr<symbol> name = intern(symname);
+    defun(name, value);
     add_export(name);
 }
 
@@ -455,23 +929,29 @@ bool module::init() {
         return true;;
     }
 
+    // set early, so modules importing each other don't recurse forever
+    inited = true;
+
+    // the imports are already in module_scope; they just need initializing
     for(auto imp : imports) {
-        shared_ptr<module> mod = nullptr; //env->get_module_by_prefix(imp);
-        mod->init();
-        module_scope->add_import(mod);
+        shared_ptr<module> mod = module_scope->find_module(imp);
+        if(!mod || !mod->init()) {
+            inited = false;
+            return false;
+        }
     }
 
     // it would be good if this could go on the stack of the currently running eval
     // but that's ~*~hard~*~, and this is easy
     for(auto initblock : initblocks) {
         shared_ptr<lexicalscope> initscope(new lexicalscope(module_scope));
-        if(::eval(make_shared<cons>(make_shared<symbol>("begin"), initblock),
+        if(::eval(make_pooled<cons>(begin_symbol, initblock),
                   initscope) == nullptr) {
+            inited = false;
             return false;
         }
     }
 
-    inited = true;
     return true;
 }
 
@@ -483,6 +963,10 @@ const vector< shared_ptr<symbol> >& module::get_exports() const {
     return exports;
 }
 
+bool module::exports_symbol(const shared_ptr<symbol>& sym) const {
+    return exportids.count(sym->id()) != 0;
+}
+
 const vector< shared_ptr<lispobj> >& module::get_initblocks() const {
     return initblocks;
 }
@@ -513,127 +997,157 @@ void module::print(ostream& out) {
     out << ")";
 }
 
-template<class type>
-foreignobject<type>::foreignobject(type* obj) :
+void module::traverse(gcvisitor& visitor) {
+    visitor.visit(module_scope);
+}
+
+void module::clear_references() {
+    module_scope.reset();
+}
+
+template<class wrapped>
+foreignobject<wrapped>::foreignobject(wrapped* obj) :
+    lispobj(FOREIGN_TYPE),
     object(obj)
 {
 
 }
 
-template<class type>
-type* foreignobject<type>::get() {
+template<class wrapped>
+wrapped* foreignobject<wrapped>::get() {
     return object.get();
 }
 
-syntaxlocation::syntaxlocation(string name, int linenum, int charnum) {
-    this->name = name;
-    this->linenum = linenum;
-    this->charnum = charnum;
-}
+// The reader can run on several threads, so the tables are locked.
+static std::mutex source_mutex;
+static vector<string> source_names;
+static std::unordered_map<string, uint16_t> source_name_ids;
+static std::unordered_map<const lispobj*, sourcelocation> source_locations;
 
-syntax::syntax(shared_ptr<syntaxlocation> loc, shared_ptr<syntax> par) :
-    location(loc),
-    parent(par)
-{
+uint16_t intern_source_name(const string& name) {
+    std::lock_guard<std::mutex> lock(source_mutex);
+    auto it = source_name_ids.find(name);
+    if(it != source_name_ids.end()) {
+        return it->second;
+    }
+
+    if(source_names.size() > UINT16_MAX) {
+        // share the last id rather than fail; only the name is wrong
+        return UINT16_MAX;
+    }
+    uint16_t id = source_names.size();
+    source_names.push_back(name);
+    source_name_ids[name] = id;
+    return id;
 }
 
-syntax::~syntax() {
+sourcelocation::sourcelocation() :
+    fileid(0),
+    col(0),
+    linenum(0)
+{
 }
 
-shared_ptr<syntaxlocation> syntax::get_location() {
-    return location;
+sourcelocation::sourcelocation(uint16_t file, int line, int column) :
+    fileid(file),
+    col(std::min(column, int(UINT16_MAX))),
+    linenum(line)
+{
 }
 
-shared_ptr<syntax> syntax::get_parent() {
-    return parent;
+string sourcelocation::filename() const {
+    std::lock_guard<std::mutex> lock(source_mutex);
+    return source_names[fileid];
 }
 
-void syntax::set_parent(shared_ptr<syntax> p) {
-    parent = p;
+int sourcelocation::line() const {
+    return linenum;
 }
 
-syntaxnil::syntaxnil(shared_ptr<syntaxlocation> loc, shared_ptr<syntax> par) :
-    syntax(loc, par)
-{
+int sourcelocation::column() const {
+    return col;
 }
 
-syntaxsymbol::syntaxsymbol(string sn, shared_ptr<syntaxlocation> loc, shared_ptr<syntax> par) :
-    syntax(loc, par),
-    symbol(sn)
-{
+void set_source_location(lispobj* obj, sourcelocation location) {
+    std::lock_guard<std::mutex> lock(source_mutex);
+    source_locations[obj] = location;
+    obj->haslocation = true;
 }
 
-syntaxcons::syntaxcons(shared_ptr<lispobj> a,
-                       shared_ptr<lispobj> d,
-                       shared_ptr<syntaxlocation> loc,
-                       shared_ptr<syntax> par) :
-    syntax(loc, par),
-    cons(a, d)
-{
+bool get_source_location(const lispobj* obj, sourcelocation& location) {
+    std::lock_guard<std::mutex> lock(source_mutex);
+    auto it = source_locations.find(obj);
+    if(it == source_locations.end()) {
+        return false;
+    }
+    location = it->second;
+    return true;
 }
 
-syntaxnumber::syntaxnumber(int num, shared_ptr<syntaxlocation> loc, shared_ptr<syntax> par) :
-    syntax(loc, par),
-    number(num)
-{
+size_t source_location_count() {
+    std::lock_guard<std::mutex> lock(source_mutex);
+    return source_locations.size();
 }
 
-syntaxstring::syntaxstring(const string& str, shared_ptr<syntaxlocation> loc, shared_ptr<syntax> par) :
-    syntax(loc, par),
-    lispstring(str)
-{
+static void forget_source_location(const lispobj* obj) {
+    std::lock_guard<std::mutex> lock(source_mutex);
+    source_locations.erase(obj);
 }
 
-bool eq(shared_ptr<lispobj> left, shared_ptr<lispobj> right) {
+bool eq(const shared_ptr<lispobj>& left, const shared_ptr<lispobj>& right) {
+    // symbols are interned, so this also covers symbols
     if(left == right) return true;
+    if(!left || !right) return false;
 
-    if(dynamic_pointer_cast<symbol>(left) &&
-       dynamic_pointer_cast<symbol>(right)) {
-        shared_ptr<symbol> ls(dynamic_pointer_cast<symbol>(left));
-        shared_ptr<symbol> rs(dynamic_pointer_cast<symbol>(right));
-        return ls->name() == rs->name();
-    } else if(dynamic_pointer_cast<nil>(left) &&
-              dynamic_pointer_cast<nil>(right)) {
-        return true;
-    } else {
-        return false;
-    }
+    return left->type() == NIL_TYPE && right->type() == NIL_TYPE;
 }
 
-bool eqv(shared_ptr<lispobj> left, shared_ptr<lispobj> right) {
+bool eqv(const shared_ptr<lispobj>& left, const shared_ptr<lispobj>& right) {
     if(eq(left, right)) return true;
+    if(!left || !right) return false;
 
-    if(dynamic_pointer_cast<number>(left) &&
-       dynamic_pointer_cast<number>(right)) {
-        shared_ptr<number> ln(dynamic_pointer_cast<number>(left));
-        shared_ptr<number> rn(dynamic_pointer_cast<number>(right));
-        return ln->value() == rn->value();
-    } else {
-        return false;
-    };
+    return left->type() == NUMBER_TYPE && right->type() == NUMBER_TYPE &&
+        static_cast<number*>(left.get())->value() == static_cast<number*>(right.get())->value();
 }
 
-bool equal(shared_ptr<lispobj> left, shared_ptr<lispobj> right) {
-    if(eqv(left, right)) return true;
-
-    if(dynamic_pointer_cast<cons>(left) &&
-       dynamic_pointer_cast<cons>(right)) {
-        shared_ptr<cons> lc(dynamic_pointer_cast<cons>(left));
-        shared_ptr<cons> rc(dynamic_pointer_cast<cons>(right));
-        return equal(lc->car(), rc->car()) && equal(lc->cdr(), rc->cdr());
-    } else if(dynamic_pointer_cast<lispstring>(left) &&
-              dynamic_pointer_cast<lispstring>(right)) {
-        shared_ptr<lispstring> left_string(dynamic_pointer_cast<lispstring>(left));
-        shared_ptr<lispstring> right_string(dynamic_pointer_cast<lispstring>(right));
-        return left_string->get_contents() == right_string->get_contents();
-    } else if(dynamic_pointer_cast<bitvector>(left) &&
-              dynamic_pointer_cast<bitvector>(right)) {
-        shared_ptr<bitvector> left_bv = dynamic_pointer_cast<bitvector>(left);
-        shared_ptr<bitvector> right_bv = dynamic_pointer_cast<bitvector>(right);
-        return left_bv->get_contents() == right_bv->get_contents();
-    } else {
-        return false;
-    };
+// Compares along the cdrs in a loop, so long lists do not recurse deeply.
+static bool equal_objects(lispobj* left, lispobj* right) {
+    while(left != right) {
+        if(!left || !right || left->type() != right->type()) {
+            return false;
+        }
+
+        switch(left->type()) {
+        case NIL_TYPE:
+            return true;
+        case NUMBER_TYPE:
+            return static_cast<number*>(left)->value() == static_cast<number*>(right)->value();
+        case STRING_TYPE:
+            return static_cast<lispstring*>(left)->get_contents() ==
+                static_cast<lispstring*>(right)->get_contents();
+        case BITVECTOR_TYPE:
+            return static_cast<bitvector*>(left)->get_contents() ==
+                static_cast<bitvector*>(right)->get_contents();
+        case CONS_TYPE: {
+            cons* left_cons = static_cast<cons*>(left);
+            cons* right_cons = static_cast<cons*>(right);
+            if(!equal_objects(left_cons->car().get(), right_cons->car().get())) {
+                return false;
+            }
+            left = left_cons->cdr().get();
+            right = right_cons->cdr().get();
+            break;
+        }
+        default:
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool equal(const shared_ptr<lispobj>& left, const shared_ptr<lispobj>& right) {
+    return equal_objects(left.get(), right.get());
 }
 
 void printall(vector< shared_ptr<lispobj> > objs) {
@@ -643,97 +1157,186 @@ void printall(vector< shared_ptr<lispobj> > objs) {
     }
 }
 
-reader::reader(shared_ptr<std::istream> in, string name) :
-    input(in),
-    streamname(name),
-    linenum(1),
-    colnum(1)
+sourcebuffer::sourcebuffer() :
+    mapping(nullptr),
+    mappedsize(0)
 {
 }
 
-shared_ptr<lispobj> reader::read(shared_ptr<syntax> parent) {
-    // remove leading whitespace
+sourcebuffer::sourcebuffer(string contents) :
+    contents(std::move(contents)),
+    mapping(nullptr),
+    mappedsize(0)
+{
+}
 
-    bool iscomment = false;
+sourcebuffer::~sourcebuffer() {
+    if(mapping) {
+        munmap(mapping, mappedsize);
+    }
+}
 
-    do {
-        iscomment = false;
+shared_ptr<sourcebuffer> sourcebuffer::open_file(const string& filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0) {
+        return nullptr;
+    }
 
-        while(isspace(peek_char())) {
-            get_char();
+    shared_ptr<sourcebuffer> ret(new sourcebuffer());
+    struct stat info;
+    if(fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        void* mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(mapped != MAP_FAILED) {
+            madvise(mapped, info.st_size, MADV_SEQUENTIAL);
+            ret->mapping = mapped;
+            ret->mappedsize = info.st_size;
+            close(fd);
+            return ret;
         }
+    }
 
-        if(peek_char() == ';') {
-            iscomment = true;
+    // not mappable (a pipe, say), so copy it
+    char buf[65536];
+    ssize_t count;
+    while((count = ::read(fd, buf, sizeof(buf))) > 0) {
+        ret->contents.append(buf, count);
+    }
+    close(fd);
 
-            char c = get_char();
-            while(c != '\n') {
-                c = get_char();
-                cout.flush();
-            }
-        }
-    } while(iscomment);
+    return ret;
+}
 
-    int line = linenum;
-    int col = colnum;
+const char* sourcebuffer::begin() const {
+    return mapping ? static_cast<const char*>(mapping) : contents.data();
+}
 
-    if(peek_char() == ')' || peek_char() == std::char_traits<char>::eof()) {
-        return nullptr;
-    }
+const char* sourcebuffer::end() const {
+    return begin() + size();
+}
 
-    // figure out type of object
-    if(peek_char() == '(') { //list
-        get_char();
-        shared_ptr<lispobj> listtoreturn = make_shared<syntaxnil>(make_shared<syntaxlocation>(streamname, line, col), parent);
-        shared_ptr<cons> placeinlist(nullptr);
-
-        while(peek_char() != ')') {
-            while(isspace(peek_char())) {
-                get_char();
-            }
+size_t sourcebuffer::size() const {
+    return mapping ? mappedsize : contents.size();
+}
 
-            auto obj = read(dynamic_pointer_cast<syntax>(listtoreturn));
-            if(obj) {
-                if(dynamic_pointer_cast<nil>(listtoreturn)) {
-                    listtoreturn = make_shared<syntaxcons>(obj, listtoreturn, make_shared<syntaxlocation>(streamname, line, col), parent);
-                    shared_ptr<syntax> syntaxobj = dynamic_pointer_cast<syntax>(obj);
-                    syntaxobj->set_parent(dynamic_pointer_cast<syntax>(listtoreturn));
-                    placeinlist = dynamic_pointer_cast<cons>(listtoreturn);
-                } else {
-                    placeinlist->set_cdr(make_shared<syntaxcons>(obj, placeinlist->cdr(), make_shared<syntaxlocation>(streamname, line, col), parent));
-                    placeinlist = dynamic_pointer_cast<cons>(placeinlist->cdr());
-                }
-            }
-        }
+// isspace() depends on the locale and is undefined for negative chars
+static inline bool is_space(int c) {
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\f' || c == '\v';
+}
 
-        //update location of the nil to the end of the list
-        if(placeinlist) {
-            shared_ptr<syntax> syn = dynamic_pointer_cast<syntax>(placeinlist->cdr());
-            syn->get_location()->charnum = colnum;
-            syn->get_location()->linenum = linenum;
-        }
+static inline bool is_digit(int c) {
+    return c >= '0' && c <= '9';
+}
 
-        get_char();
-        return listtoreturn;
-    } else if(isdigit(peek_char())) { // number ('.' too, once we have non-integers)
-        string numstring;
+static inline bool ends_symbol(char c) {
+    return is_space(c) || c == '(' || c == ')' || c == ';';
+}
+
+reader::reader(shared_ptr<sourcebuffer> in, string name) :
+    input(in),
+    pos(in->begin()),
+    end(in->end()),
+    streamname(name),
+    streamid(intern_source_name(name)),
+    linenum(1),
+    colnum(1),
+    indexbase(nullptr),
+    nexttoken(0)
+{
+}
+
+void reader::skip_whitespace_and_comments() {
+    if(indexbase) {
+        if(pos < end && (is_space(*pos) || *pos == ';')) {
+            jump_to_next_token();
+        }
+        return;
+    }
+
+    while(pos < end) {
+        if(*pos == ';') {
+            while(pos < end && *pos != '\n') {
+                ++pos;
+            }
+        } else if(*pos == '\n') {
+            ++pos;
+            ++linenum;
+            colnum = 1;
+        } else if(is_space(*pos)) {
+            advance(1);
+        } else {
+            return;
+        }
+    }
+}
 
-        while(isdigit(peek_char())) {
-            numstring.push_back(get_char());
+shared_ptr<lispobj> reader::read() {
+    skip_whitespace_and_comments();
+
+    int line = linenum;
+    int col = colnum;
+
+    if(pos == end || *pos == ')') {
+        return nullptr;
+    }
+
+    // figure out type of object
+    if(*pos == '(') { //list
+        advance(1);
+        sourcelocation location(streamid, line, col);
+        shared_ptr<lispobj> listtoreturn = make_nil();
+        cons* placeinlist = nullptr;
+
+        while(true) {
+            auto obj = read();
+            if(!obj) {
+                break;
+            }
+
+            shared_ptr<cons> cell = make_pooled<cons>(obj, make_nil());
+            set_source_location(cell.get(), location);
+            if(placeinlist) {
+                placeinlist->set_cdr(cell);
+            } else {
+                listtoreturn = cell;
+            }
+            placeinlist = cell.get();
         }
 
-        size_t pos = 0;
-        int n = std::stoi(numstring, &pos);
-        return make_shared<syntaxnumber>(n, make_shared<syntaxlocation>(streamname, line, col), parent);
-    } else if(peek_char() == '"') {
-        get_char();
+        if(pos == end) {
+            syntax_error("list is never closed", line, col);
+        }
 
-        string contents;
+        advance(1);
+        return listtoreturn;
+    } else if(is_digit(*pos)) { // number ('.' too, once we have non-integers)
+        const char* start = pos;
+        int64_t n = 0;
+
+        while(pos < end && is_digit(*pos)) {
+            n = n * 10 + (*pos - '0');
+            if(n > std::numeric_limits<int>::max()) {
+                syntax_error("number is too large", line, col);
+            }
+            ++pos;
+        }
+
+        colnum += pos - start;
+        return make_number(static_cast<int>(n));
+    } else if(*pos == '"') {
+        advance(1);
 
-        while(peek_char() != '"') {
+        // strings without escapes are copied straight out of the buffer
+        const char* start = pos;
+        while(pos < end && *pos != '"' && *pos != '\\') {
+            get_char();
+        }
+
+        string contents(start, pos);
+
+        while(pos < end && *pos != '"') {
             char next = get_char();
 
-            if(next == '\\') {
+            if(next == '\\' && pos < end) {
                 char escapedchar = get_char();
 
                 if(escapedchar == 'n') {
@@ -745,41 +1348,97 @@ shared_ptr<lispobj> reader::read(shared_ptr<syntax> parent) {
                 contents.push_back(next);
             }
         }
-        get_char();
 
-        return make_shared<syntaxstring>(contents, make_shared<syntaxlocation>(streamname, line, col), parent);
+        if(pos == end) {
+            syntax_error("string is never closed", line, col);
+        }
+        advance(1);
+
+        shared_ptr<lispstring> str = make_shared<lispstring>(contents);
+        set_source_location(str.get(), sourcelocation(streamid, line, col));
+        return str;
     } else { //symbol
-        string sym_name;
-        char next = peek_char();
+        const char* start = pos;
 
-        while(!isspace(next) &&
-              next != '(' &&
-              next != ')' &&
-              next != ';' &&
-              next != std::char_traits<char>::eof()) {
-            sym_name.push_back(get_char());
-            next = peek_char();
+        while(pos < end && !ends_symbol(*pos)) {
+            ++pos;
         }
 
-        return make_shared<syntaxsymbol>(sym_name, make_shared<syntaxlocation>(streamname, line, col), parent);
+        colnum += pos - start;
+        return intern(string(start, pos));
     }
 }
 
 vector< shared_ptr<lispobj> > reader::readall() {
     vector< shared_ptr<lispobj> > ret;
 
-    while(input->good()) {
+    while(!at_end()) {
         shared_ptr<lispobj> lobj = read();
-        if(lobj) {
-            ret.push_back(lobj);
+        if(!lobj) {
+            syntax_error("unexpected )", linenum, colnum);
         }
+        ret.push_back(lobj);
     }
 
     return ret;
 }
 
+vector< shared_ptr<lispobj> > reader::readall_indexed() {
+    if(!scan_structure(pos, end, linenum, colnum, index)) {
+        return readall();
+    }
+
+    indexbase = pos;
+    nexttoken = 0;
+
+    vector< shared_ptr<lispobj> > ret;
+    try {
+        ret = readall();
+    } catch(...) {
+        indexbase = nullptr;
+        index.clear();
+        throw;
+    }
+
+    indexbase = nullptr;
+    index.clear();
+    return ret;
+}
+
+void reader::jump_to_next_token() {
+    size_t offset = pos - indexbase;
+    while(nexttoken < index.size() && index[nexttoken].offset <= offset) {
+        ++nexttoken;
+    }
+
+    if(nexttoken == index.size()) {
+        pos = end;
+        return;
+    }
+
+    const tokenstart& token = index[nexttoken++];
+    pos = indexbase + token.offset;
+    linenum = token.line;
+    colnum = token.column;
+}
+
+bool reader::enter_list() {
+    skip_whitespace_and_comments();
+    if(pos == end || *pos != '(') {
+        return false;
+    }
+
+    advance(1);
+    return true;
+}
+
+bool reader::at_end() {
+    skip_whitespace_and_comments();
+    return pos == end;
+}
+
 char reader::get_char() {
-    char ret = input->get();
+    char ret = *pos++;
     if(ret == '\n') {
         ++linenum;
         colnum = 1;
@@ -790,41 +1449,409 @@ char reader::get_char() {
     return ret;
 }
 
-char reader::peek_char() {
-    return input->peek();
+void reader::advance(size_t count) {
+    pos += count;
+    colnum += count;
+}
+
+void reader::syntax_error(const string& message, int line, int col) {
+    stringstream ss;
+    ss << "ERROR: " << streamname << " (" << line << ", " << col << "): " << message;
+    throw ss.str();
 }
 
 shared_ptr<lispobj> read(string str) {
-    shared_ptr<std::stringstream> sstream(new std::stringstream(str));
-    reader r(std::static_pointer_cast<std::istream>(sstream), "INPUT");
-    return r.read();
+    reader r(make_shared<sourcebuffer>(std::move(str)), "INPUT");
+    shared_ptr<lispobj> ret = r.read();
+    if(!ret && !r.at_end()) {
+        // a ')' with no list to close, which readall reports
+        r.readall();
+    }
+    return ret;
 }
 
 vector< shared_ptr<lispobj> > readall(string str) {
-    shared_ptr<std::stringstream> sstream(new std::stringstream(str));
-    reader r(std::static_pointer_cast<std::istream>(sstream), "INPUT");
+    reader r(make_shared<sourcebuffer>(std::move(str)), "INPUT");
 
     return r.readall();
 }
 
+void read_eval_print(const string& lispstr, shared_ptr<module> mod, ostream& out) {
+    try {
+        shared_ptr<lispobj> lobj = read(lispstr);
+        if(!lobj) {
+            return;
+        }
+        shared_ptr<lispobj> retlobj = mod->eval(lobj);
+        // eval has already printed the error if there is no result
+        if(retlobj) {
+            retlobj->print(out);
+        }
+        out << endl;
+    } catch(string& error) {
+        out << error << endl;
+    }
+}
+
 bool prefix_match(shared_ptr<lispobj> name, shared_ptr<lispobj> prefix) {
-    if(dynamic_pointer_cast<nil>(prefix) || eqv(name, prefix)) {
-        return true;
+    // down the lists in a loop; only the elements recurse
+    while(!is_a<nil>(prefix) && !eqv(name, prefix)) {
+        shared_ptr<cons> name_cons = lisp_cast<cons>(name);
+        shared_ptr<cons> prefix_cons = lisp_cast<cons>(prefix);
+
+        if(!name_cons || !prefix_cons ||
+           !prefix_match(name_cons->car(), prefix_cons->car())) {
+            return false;
+        }
+
+        name = name_cons->cdr();
+        prefix = prefix_cons->cdr();
     }
 
-    shared_ptr<cons> name_cons = dynamic_pointer_cast<cons>(name);
-    shared_ptr<cons> prefix_cons = dynamic_pointer_cast<cons>(prefix);
+    return true;
+}
 
-    if(name_cons && prefix_cons) {
-        return prefix_match(name_cons->car(), prefix_cons->car()) &&
-            prefix_match(name_cons->cdr(), prefix_cons->cdr());
+moduleindex::moduleindex(shared_ptr<lexicalscope> scope) :
+    scope(scope),
+    cache_hits(0),
+    loading_depth(0),
+    loading_time(0)
+{
+}
+
+bool moduleindex::add_file(const string& filename) {
+    shared_ptr<sourcebuffer> buf = sourcebuffer::open_file(filename);
+    if(!buf) {
+        return false;
     }
 
-    return false;
+    entry e;
+    try {
+        reader r(buf, filename);
+        if(!r.enter_list() || r.read() != module_symbol) {
+            return false;
+        }
+        e.name = r.read();
+    } catch(string&) {
+        // let the full read report it
+        return false;
+    }
+
+    if(!e.name) {
+        return false;
+    }
+
+    e.filename = filename;
+    e.loaded = false;
+    e.hashed = false;
+    e.hash = 0;
+    entries.push_back(e);
+    return true;
+}
+
+void moduleindex::set_cache_directory(const string& directory) {
+    cachedir = directory;
+}
+
+// The function or macro a defun or defmacro in a module form made, if it
+// is still the one bound to its name.
+static shared_ptr<lispobj> module_definition(shared_ptr<module> mod, shared_ptr<cons> decl) {
+    shared_ptr<cons> def = lisp_cast<cons>(decl->cdr());
+    shared_ptr<symbol> name = def ? lisp_cast<symbol>(def->car()) : nullptr;
+    shared_ptr<cons> rest = def ? lisp_cast<cons>(def->cdr()) : nullptr;
+    if(!name || !rest) {
+        return nullptr;
+    }
+
+    shared_ptr<lispobj> bound = mod->get_bindings()->getfun(name);
+    if(decl->car() == defun_symbol && is_a<lispfunc>(bound) &&
+       lisp_cast<lispfunc>(bound)->code == rest->cdr()) {
+        return bound;
+    }
+    if(decl->car() == defmacro_symbol && is_a<macro>(bound) &&
+       lisp_cast<macro>(bound)->code == rest->cdr()) {
+        return bound;
+    }
+    return nullptr;
+}
+
+static shared_ptr<module> module_for_form(shared_ptr<lispobj> form, shared_ptr<lexicalscope> scope) {
+    shared_ptr<cons> c = lisp_cast<cons>(form);
+    if(!c || c->car() != module_symbol || !is_a<cons>(c->cdr())) {
+        return nullptr;
+    }
+    return scope->find_module(lisp_cast<cons>(c->cdr())->car());
+}
+
+static shared_ptr<cons> copy_cell(shared_ptr<cons> from, shared_ptr<lispobj> car, shared_ptr<lispobj> cdr) {
+    shared_ptr<cons> cell = make_pooled<cons>(car, cdr);
+    sourcelocation location;
+    if(get_source_location(from.get(), location)) {
+        set_source_location(cell.get(), location);
+    }
+    return cell;
+}
+
+// A copy of a module form with each function and macro body replaced by
+// its expansion, for the module cache.
+static shared_ptr<lispobj> expand_module_form(shared_ptr<lispobj> form, shared_ptr<lexicalscope> scope) {
+    shared_ptr<module> mod = module_for_form(form, scope);
+    if(!mod) {
+        return form;
+    }
+
+    vector< shared_ptr<cons> > cells;
+    for(shared_ptr<cons> c = lisp_cast<cons>(form); c; c = lisp_cast<cons>(c->cdr())) {
+        cells.push_back(c);
+    }
+
+    shared_ptr<lispobj> ret = cells.back()->cdr();
+    for(auto it = cells.rbegin(); it != cells.rend(); ++it) {
+        shared_ptr<lispobj> decl = (*it)->car();
+        shared_ptr<cons> decl_cons = lisp_cast<cons>(decl);
+        shared_ptr<lispobj> definition = decl_cons ? module_definition(mod, decl_cons) : nullptr;
+        if(definition) {
+            shared_ptr<lispobj> expanded = is_a<lispfunc>(definition) ?
+                lisp_cast<lispfunc>(definition)->get_expanded_code() :
+                lisp_cast<macro>(definition)->get_expanded_code();
+            shared_ptr<cons> def = lisp_cast<cons>(decl_cons->cdr());
+            shared_ptr<cons> rest = lisp_cast<cons>(def->cdr());
+            decl = copy_cell(decl_cons, decl_cons->car(),
+                             copy_cell(def, def->car(),
+                                       copy_cell(rest, rest->car(), expanded)));
+        }
+        ret = copy_cell(*it, decl, ret);
+    }
+
+    return ret;
+}
+
+// Bodies read from the cache are already expanded.
+static void mark_module_expanded(shared_ptr<lispobj> form, shared_ptr<lexicalscope> scope) {
+    shared_ptr<module> mod = module_for_form(form, scope);
+    if(!mod) {
+        return;
+    }
+
+    for(shared_ptr<cons> c = lisp_cast<cons>(form); c; c = lisp_cast<cons>(c->cdr())) {
+        shared_ptr<cons> decl = lisp_cast<cons>(c->car());
+        shared_ptr<lispobj> definition = decl ? module_definition(mod, decl) : nullptr;
+        if(is_a<lispfunc>(definition)) {
+            shared_ptr<lispfunc> func = lisp_cast<lispfunc>(definition);
+            func->set_expanded_code(func->code);
+        } else if(is_a<macro>(definition)) {
+            shared_ptr<macro> mac = lisp_cast<macro>(definition);
+            mac->set_expanded_code(mac->code);
+        }
+    }
+}
+
+moduleindex::entry* moduleindex::find_entry(shared_ptr<lispobj> name) {
+    for(auto& e : entries) {
+        if(equal(e.name, name)) {
+            return &e;
+        }
+    }
+    return nullptr;
+}
+
+uint64_t moduleindex::source_hash(entry& e) {
+    if(!e.hashed) {
+        shared_ptr<sourcebuffer> buf = sourcebuffer::open_file(e.filename);
+        e.hash = buf ? hash_source(buf->begin(), buf->end()) : 0;
+        e.hashed = true;
+    }
+    return e.hash;
+}
+
+// Everything mod imports, directly or not, that was loaded from a file.
+void moduleindex::collect_dependencies(shared_ptr<module> mod, std::set<module*>& seen,
+                                       vector<moduledependency>& out) {
+    for(auto name : mod->get_imports()) {
+        shared_ptr<module> imported = mod->get_bindings()->find_module(name);
+        if(!imported || !seen.insert(imported.get()).second) {
+            continue;
+        }
+
+        entry* e = find_entry(imported->get_name());
+        if(e) {
+            moduledependency dependency;
+            dependency.name = imported->get_name();
+            dependency.hash = source_hash(*e);
+            out.push_back(dependency);
+        }
+        collect_dependencies(imported, seen, out);
+    }
+}
+
+bool moduleindex::read_cache(entry& e, vector< shared_ptr<lispobj> >& forms) {
+    cachedmodule cached;
+    if(!read_module_cache(module_cache_path(cachedir, source_hash(e)), e.filename, cached) ||
+       cached.sourcehash != source_hash(e)) {
+        return false;
+    }
+
+    for(auto& dependency : cached.dependencies) {
+        entry* imported = find_entry(dependency.name);
+        if(!imported || source_hash(*imported) != dependency.hash) {
+            return false;
+        }
+    }
+
+    forms = cached.forms;
+    return true;
+}
+
+void moduleindex::write_cache(entry& e, const vector< shared_ptr<lispobj> >& forms) {
+    cachedmodule cached;
+    cached.sourcehash = source_hash(e);
+
+    std::set<module*> seen;
+    try {
+        for(auto form : forms) {
+            shared_ptr<module> mod = module_for_form(form, scope);
+            if(mod) {
+                seen.insert(mod.get());
+                collect_dependencies(mod, seen, cached.dependencies);
+            }
+            cached.forms.push_back(expand_module_form(form, scope));
+        }
+    } catch(string&) {
+        // a body that fails to expand is left for the call to report
+        return;
+    }
+
+    write_module_cache(module_cache_path(cachedir, cached.sourcehash), cached);
+}
+
+// Times the outermost load; the modules it imports are loaded inside it.
+class loadingtimer {
+public:
+    loadingtimer(int& depth, double& total) :
+        depth(depth),
+        total(total),
+        start(std::chrono::steady_clock::now())
+    {
+        ++depth;
+    }
+
+    ~loadingtimer() {
+        if(--depth == 0) {
+            total += std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - start).count();
+        }
+    }
+
+private:
+    int& depth;
+    double& total;
+    std::chrono::steady_clock::time_point start;
+};
+
+shared_ptr<module> moduleindex::load(shared_ptr<lispobj> prefix) {
+    for(auto& e : entries) {
+        if(e.loaded || !prefix_match(e.name, prefix)) {
+            continue;
+        }
+
+        // marked first, so a module importing itself fails instead of looping
+        e.loaded = true;
+
+        try {
+            return load_entry(e, prefix);
+        } catch(string& error) {
+            // so importing it again, once the file is fixed, tries again
+            e.loaded = false;
+            cout << error << endl;
+            return nullptr;
+        }
+    }
+
+    return nullptr;
+}
+
+shared_ptr<module> moduleindex::load_entry(entry& e, shared_ptr<lispobj> prefix) {
+    shared_ptr<sourcebuffer> buf = sourcebuffer::open_file(e.filename);
+    if(!buf) {
+        cout << "Couldn't open " << e.filename << endl;
+        return nullptr;
+    }
+
+    loadingtimer timer(loading_depth, loading_time);
+
+    vector< shared_ptr<lispobj> > forms;
+    bool cached = !cachedir.empty() && read_cache(e, forms);
+    if(cached) {
+        ++cache_hits;
+        cout << "loading " << e.filename << " from cache" << endl;
+    } else {
+        cout << "loading " << e.filename << endl;
+        reader r(buf, e.filename);
+        forms = r.readall();
+    }
+
+    for(auto form : forms) {
+        eval(form, scope);
+    }
+
+    shared_ptr<module> mod = scope->find_module(prefix);
+    if(mod && !mod->init()) {
+        stringstream errormsg;
+        errormsg << "Module ";
+        prefix->print(errormsg);
+        errormsg << " init failed.";
+        throw errormsg.str();
+    }
+
+    if(cached) {
+        for(auto form : forms) {
+            mark_module_expanded(form, scope);
+        }
+    } else if(!cachedir.empty()) {
+        write_cache(e, forms);
+    }
+
+    return mod;
+}
+
+size_t moduleindex::loaded_count() const {
+    size_t ret = 0;
+    for(auto& e : entries) {
+        if(e.loaded) {
+            ++ret;
+        }
+    }
+    return ret;
+}
+
+size_t moduleindex::cached_count() const {
+    return cache_hits;
+}
+
+double moduleindex::load_milliseconds() const {
+    return loading_time;
+}
+
+static shared_ptr<moduleindex> module_index;
+
+void set_module_index(shared_ptr<moduleindex> index) {
+    module_index = index;
+}
+
+// scopes whose exportersversion is older rebuild their table; 0 is never
+// current
+static uint64_t import_tables_version = 1;
+
+uint64_t definition_epoch = 1;
+
+void invalidate_import_tables() {
+    ++import_tables_version;
+    ++definition_epoch;
 }
 
 lexicalscope::lexicalscope() :
     parent(nullptr),
+    exportersversion(0),
     ismodulescope(false)
 {
 
@@ -832,137 +1859,241 @@ lexicalscope::lexicalscope() :
 
 lexicalscope::lexicalscope(shared_ptr<lexicalscope> p) :
     parent(p),
+    exportersversion(0),
+    ismodulescope(false)
+{
+
+}
+
+lexicalscope::lexicalscope(shared_ptr<lexicalscope> p, shared_ptr<const slotlayout> layout) :
+    slotnames(layout),
+    slots(layout->size()),
+    parent(p),
+    exportersversion(0),
     ismodulescope(false)
 {
 
 }
 
+void lexicalscope::defval(const shared_ptr<symbol>& name, shared_ptr<lispobj> value) {
+    valbindings[name->id()] = value;
+}
+
+void lexicalscope::defun(const shared_ptr<symbol>& name, shared_ptr<lispobj> value) {
+    if(lisp_cast<macro>(value) || lisp_cast<macro>(getfun(name))) {
+        invalidate_macro_expansions();
+    }
+    funbindings[name->id()] = value;
+    ++definition_epoch;
+}
+
 void lexicalscope::defval(string name, shared_ptr<lispobj> value) {
-    valbindings[name] = value;
+    defval(intern(name), value);
 }
 
 void lexicalscope::defun(string name, shared_ptr<lispobj> value) {
-    funbindings[name] = value;
+    defun(intern(name), value);
 }
 
-void lexicalscope::undefval(string name) {
-    valbindings.erase(name);
+void lexicalscope::undefval(const shared_ptr<symbol>& name) {
+    valbindings.erase(name->id());
 }
 
-void lexicalscope::undefun(string name) {
-    funbindings.erase(name);
+void lexicalscope::undefun(const shared_ptr<symbol>& name) {
+    funbindings.erase(name->id());
+    ++definition_epoch;
 }
 
-void lexicalscope::setval(string name, shared_ptr<lispobj> value) {
+void lexicalscope::setval(const shared_ptr<symbol>& name, shared_ptr<lispobj> value) {
     // try to find a variable binding. if it already exists,
     // set it in the same lexicalscope that we found it
-    shared_ptr<lexicalscope> scope = shared_ptr<lexicalscope>(this);
+    lexicalscope* scope = this;
     while(scope != nullptr) {
-        auto iter = scope->valbindings.find(name);
+        if(scope->slotnames) {
+            for(size_t i = scope->slotnames->size(); i-- > 0; ) {
+                if((*scope->slotnames)[i] == name && scope->slots[i]) {
+                    scope->slots[i] = value;
+                    return;
+                }
+            }
+        }
+
+        auto iter = scope->valbindings.find(name->id());
         if(iter != scope->valbindings.end()) {
             iter->second = value;
             return;
         }
 
-        if(ismodulescope) {
-            scope = NULL;
+        if(scope->ismodulescope) {
+            scope = nullptr;
         } else {
-            scope = scope->parent;
+            scope = scope->parent.get();
         }
     }
 
     // it has not been set yet, so set it in the current frame
-    valbindings[name] = value;
+    valbindings[name->id()] = value;
 }
 
-void lexicalscope::setfun(string name, shared_ptr<lispobj> value) {
+void lexicalscope::setfun(const shared_ptr<symbol>& name, shared_ptr<lispobj> value) {
     // try to find a variable binding. if it already exists,
     // set it in the same lexicalscope that we found it
-    cout << "Setting fun " << name << endl;
-    shared_ptr<lexicalscope> scope = shared_ptr<lexicalscope>(this);
+    cout << "Setting fun " << name->name() << endl;
+    ++definition_epoch;
+    lexicalscope* scope = this;
     while(scope != nullptr) {
-        auto iter = scope->funbindings.find(name);
+        auto iter = scope->funbindings.find(name->id());
         if(iter != scope->funbindings.end()) {
             iter->second = value;
             return;
         }
-        scope = scope->parent;
+        scope = scope->parent.get();
     }
 
     // it has not been set yet, so set it in the current frame
-    funbindings[name] = value;
+    funbindings[name->id()] = value;
 }
 
 void lexicalscope::set_ismodulescope(bool ismodulescope) {
     this->ismodulescope = ismodulescope;
 }
 
-shared_ptr<lispobj> find_val_in_module(shared_ptr<module> mod, string name) {
-    for(shared_ptr<symbol> sym : mod->get_exports()) {
-        if(sym->name() == name) {
-            return mod->get_bindings()->getval(name);
-        }
+shared_ptr<lispobj> find_val_in_module(shared_ptr<module> mod, const shared_ptr<symbol>& name) {
+    if(mod->exports_symbol(name)) {
+        return mod->get_bindings()->getval(name);
     }
 
     return nullptr;
 }
 
-shared_ptr<lispobj> lexicalscope::getval(string name) {
-    auto it = valbindings.find(name);
-    if(it != valbindings.end()) {
-        return it->second;
-    } else {
-        for(shared_ptr<module> mod : imports) {
-            shared_ptr<lispobj> ret = find_val_in_module(mod, name);
+shared_ptr<lispobj> find_fun_in_module(shared_ptr<module> mod, const shared_ptr<symbol>& name) {
+    if(mod->exports_symbol(name)) {
+        return mod->get_bindings()->getfun(name);
+    }
 
-            if(ret) {
-                return ret;
-            }
-        }
+    return nullptr;
+}
 
-        if(parent && !ismodulescope) {
-            return parent->getval(name);
-        } else {
-            //XXX: should be undefined so eval loop can error
-            return make_shared<nil>();
+module* lexicalscope::find_exporter(const shared_ptr<symbol>& name) {
+    if(imports.empty()) {
+        return nullptr;
+    }
+
+    if(exportersversion != import_tables_version) {
+        exporters.clear();
+        for(const shared_ptr<module>& mod : imports) {
+            for(const shared_ptr<symbol>& sym : mod->get_exports()) {
+                // insert keeps the first module's entry
+                exporters.insert(std::make_pair(sym->id(), mod.get()));
+            }
         }
+        exportersversion = import_tables_version;
     }
+
+    auto it = exporters.find(name->id());
+    return it == exporters.end() ? nullptr : it->second;
 }
 
-shared_ptr<lispobj> find_fun_in_module(shared_ptr<module> mod, string name) {
-    for(shared_ptr<symbol> sym : mod->get_exports()) {
-        if(sym->name() == name) {
-            return mod->get_bindings()->getfun(name);
+shared_ptr<lispobj> lexicalscope::getval(const shared_ptr<symbol>& name) {
+    lexicalscope* scope = this;
+    size_t walked = 1;
+    while(true) {
+        if(scope->slotnames) {
+            // an empty slot is a let* variable that is not bound yet
+            const slotlayout& names = *scope->slotnames;
+            for(size_t i = names.size(); i-- > 0; ) {
+                if(names[i] == name && scope->slots[i]) {
+                    note_lookup(runtime_stats.val_lookups, runtime_stats.val_scopes,
+                                runtime_stats.longest_val_walk, walked);
+                    return scope->slots[i];
+                }
+            }
+        }
+
+        auto it = scope->valbindings.find(name->id());
+        if(it != scope->valbindings.end()) {
+            note_lookup(runtime_stats.val_lookups, runtime_stats.val_scopes,
+                        runtime_stats.longest_val_walk, walked);
+            return it->second;
+        }
+
+        module* exporter = scope->find_exporter(name);
+        if(exporter) {
+            note_lookup(runtime_stats.val_lookups, runtime_stats.val_scopes,
+                        runtime_stats.longest_val_walk, walked);
+            return exporter->get_bindings()->getval(name);
+        }
+
+        if(!scope->parent || scope->ismodulescope) {
+            note_lookup(runtime_stats.val_lookups, runtime_stats.val_scopes,
+                        runtime_stats.longest_val_walk, walked);
+            //XXX: should be undefined so eval loop can error
+            return make_nil();
         }
+        scope = scope->parent.get();
+        ++walked;
     }
+}
 
-    return nullptr;
+shared_ptr<lispobj> lexicalscope::getval(string name) {
+    return getval(intern(name));
 }
 
-shared_ptr<lispobj> lexicalscope::getfun(string name) {
-    auto it = funbindings.find(name);
-    if(it != funbindings.end()) {
-        return it->second;
-    } else {
-        for(shared_ptr<module> mod : imports) {
-            shared_ptr<lispobj> ret = find_fun_in_module(mod, name);
+const shared_ptr<lispobj>* lexicalscope::find_fun_binding(const shared_ptr<symbol>& name,
+                                                          size_t ownscopes,
+                                                          bool& cacheable) {
+    lexicalscope* scope = this;
+    size_t walked = 1;
+    while(true) {
+        // other calls of the same code reach a module scope through new
+        // scopes of their own, which only a defun can add bindings to. A
+        // scope the code closed over is shared with later calls, and
+        // another closure of the same code may have closed over a
+        // different one, so nothing found past one is cached.
+        bool global = (scope->ismodulescope || !scope->parent) && walked <= ownscopes + 1;
 
-            if(ret) {
-                return ret;
-            }
+        auto it = scope->funbindings.find(name->id());
+        if(it != scope->funbindings.end()) {
+            note_lookup(runtime_stats.fun_lookups, runtime_stats.fun_scopes,
+                        runtime_stats.longest_fun_walk, walked);
+            cacheable = global;
+            return &it->second;
         }
 
-        if(parent && !ismodulescope) {
-            return parent->getfun(name);
-        } else {
-            //XXX: should be undefined so eval loop can error
-            return make_shared<nil>();
+        module* exporter = scope->find_exporter(name);
+        if(exporter) {
+            note_lookup(runtime_stats.fun_lookups, runtime_stats.fun_scopes,
+                        runtime_stats.longest_fun_walk, walked);
+            const shared_ptr<lispobj>* ret = exporter->get_bindings()->find_fun_binding(name, 0, cacheable);
+            cacheable = cacheable && global;
+            return ret;
         }
+
+        if(!scope->parent || scope->ismodulescope) {
+            note_lookup(runtime_stats.fun_lookups, runtime_stats.fun_scopes,
+                        runtime_stats.longest_fun_walk, walked);
+            cacheable = false;
+            return nullptr;
+        }
+        scope = scope->parent.get();
+        ++walked;
     }
 }
 
+shared_ptr<lispobj> lexicalscope::getfun(const shared_ptr<symbol>& name) {
+    bool cacheable;
+    const shared_ptr<lispobj>* binding = find_fun_binding(name, 0, cacheable);
+    //XXX: should be undefined so eval loop can error
+    return binding ? *binding : make_nil();
+}
+
+shared_ptr<lispobj> lexicalscope::getfun(string name) {
+    return getfun(intern(name));
+}
+
 void lexicalscope::add_import(shared_ptr<module> mod) {
     imports.push_back(mod);
+    invalidate_import_tables();
 }
 
 const vector< shared_ptr<module> >& lexicalscope::get_imports() const {
@@ -970,28 +2101,69 @@ const vector< shared_ptr<module> >& lexicalscope::get_imports() const {
 }
 
 shared_ptr<module> lexicalscope::find_module(shared_ptr<lispobj> module_prefix) {
-    for(auto module : imports) {
-        if(prefix_match(module->get_name(), module_prefix)) {
-            return module;
+    for(lexicalscope* scope = this; scope; scope = scope->parent.get()) {
+        for(const shared_ptr<module>& mod : scope->imports) {
+            if(prefix_match(mod->get_name(), module_prefix)) {
+                return mod;
+            }
         }
     }
 
-    if(parent) {
-        return parent->find_module(module_prefix);
+    if(module_index) {
+        return module_index->load(module_prefix);
     }
 
     return nullptr;
 }
 
+void lexicalscope::traverse(gcvisitor& visitor) {
+    for(auto& slot : slots) {
+        visitor.visit(slot);
+    }
+    for(auto& binding : valbindings) {
+        visitor.visit(binding.second);
+    }
+    for(auto& binding : funbindings) {
+        visitor.visit(binding.second);
+    }
+    visitor.visit(parent);
+    for(auto& mod : imports) {
+        visitor.visit(mod);
+    }
+}
+
+void lexicalscope::clear_references() {
+    for(auto& slot : slots) {
+        slot.reset();
+    }
+    valbindings.clear();
+    funbindings.clear();
+    parent.reset();
+    imports.clear();
+    exporters.clear();
+    exportersversion = 0;
+    ++definition_epoch;
+}
+
 void lexicalscope::dump() {
+    if(slotnames) {
+        for(size_t i = 0; i < slotnames->size(); ++i) {
+            if(slots[i]) {
+                cout << (*slotnames)[i]->name() << ": ";
+                slots[i]->print();
+                cout << endl;
+            }
+        }
+    }
+
     for(auto it = valbindings.begin(); it != valbindings.end(); ++it) {
-        cout << it->first << ": ";
+        cout << symbol_by_id(it->first)->name() << ": ";
         it->second->print();
         cout<< endl;
     }
 
     for(auto it = funbindings.begin(); it != funbindings.end(); ++it) {
-        cout << "(function " << it->first << "): ";
+        cout << "(function " << symbol_by_id(it->first)->name() << "): ";
         it->second->print();
         cout<< endl;
     }
@@ -1002,18 +2174,140 @@ void lexicalscope::dump() {
     }
 }
 
+// A function and its evaluated arguments. The first few are kept in the
+// frame itself; longer calls move everything to overflow, which keeps its
+// capacity when the frame is reused.
+const size_t inline_args_size = 4;
+
+class argvector {
+public:
+    argvector() :
+        count(0)
+    {}
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    shared_ptr<lispobj>* data() { return count > inline_args_size ? overflow.data() : inline_args; }
+    const shared_ptr<lispobj>* data() const { return count > inline_args_size ? overflow.data() : inline_args; }
+    shared_ptr<lispobj>& operator[](size_t i) { return data()[i]; }
+    shared_ptr<lispobj>& front() { return data()[0]; }
+    shared_ptr<lispobj>* begin() { return data(); }
+    shared_ptr<lispobj>* end() { return data() + count; }
+    const shared_ptr<lispobj>* begin() const { return data(); }
+    const shared_ptr<lispobj>* end() const { return data() + count; }
+
+    void push_back(shared_ptr<lispobj> arg) {
+        if(count < inline_args_size) {
+            inline_args[count] = std::move(arg);
+        } else {
+            if(count == inline_args_size) {
+                for(auto& a : inline_args) {
+                    overflow.push_back(std::move(a));
+                }
+            }
+            overflow.push_back(std::move(arg));
+        }
+        ++count;
+    }
+
+    void clear() {
+        for(size_t i = 0; i < min(count, inline_args_size); ++i) {
+            inline_args[i].reset();
+        }
+        overflow.clear();
+        count = 0;
+    }
+
+private:
+    shared_ptr<lispobj> inline_args[inline_args_size];
+    vector<shared_ptr<lispobj> > overflow;
+    size_t count;
+};
+
 class stackframe {
 public:
-    stackframe(shared_ptr<lexicalscope> s, int m, shared_ptr<lispobj> c) :
-        scope(s),
-        mark(m),
-        code(c)
+    stackframe() :
+        mark(0)
     {}
 
     shared_ptr<lexicalscope> scope;
     int mark;
     shared_ptr<lispobj> code;
-    vector<shared_ptr<lispobj> > evaled_args;
+    // what code was when the frame was pushed, for source locations
+    shared_ptr<lispobj> form;
+    argvector evaled_args;
+    // the function whose body this frame runs, for the profiler; a body's
+    // last statement takes over the frame, so evaled_args loses it
+    shared_ptr<lispfunc> func;
+};
+
+static size_t max_stack_depth = 1000000;
+
+void set_max_stack_depth(size_t depth) {
+    max_stack_depth = depth;
+}
+
+size_t get_max_stack_depth() {
+    return max_stack_depth;
+}
+
+void throw_stack_depth_error() {
+    throw string("ERROR: stack depth limit of ") + std::to_string(max_stack_depth) + " exceeded";
+}
+
+// The stepper's stack. front() is the innermost frame and [1] is its
+// caller. Frames are stored contiguously and are not destroyed when they
+// are popped, so evaled_args keeps any overflow capacity and pushing a
+// frame in steady state does not allocate.
+class execstack {
+public:
+    execstack() :
+        depth(0)
+    {}
+
+    stackframe& front() { return frames[depth - 1]; }
+    stackframe& operator[](size_t i) { return frames[depth - 1 - i]; }
+    const stackframe& operator[](size_t i) const { return frames[depth - 1 - i]; }
+    size_t size() const { return depth; }
+    bool empty() const { return depth == 0; }
+
+    // scope is taken by value, it usually comes from the current front()
+    void push_front(shared_ptr<lexicalscope> scope, int mark, shared_ptr<lispobj> code) {
+        if(depth >= max_stack_depth) {
+            throw_stack_depth_error();
+        }
+        if(depth == frames.size()) {
+            frames.resize(depth == 0 ? 64 : depth * 2);
+        }
+
+        stackframe& frame = frames[depth++];
+        if(depth > runtime_stats.peak_stack_depth) {
+            runtime_stats.peak_stack_depth = depth;
+        }
+        frame.scope = std::move(scope);
+        frame.mark = mark;
+        frame.code = std::move(code);
+        frame.form = frame.code;
+    }
+
+    void pop_front() {
+        stackframe& frame = frames[--depth];
+        frame.scope.reset();
+        frame.code.reset();
+        frame.form.reset();
+        frame.evaled_args.clear();
+        frame.func.reset();
+    }
+
+    void clear() {
+        while(depth > 0) {
+            pop_front();
+        }
+    }
+
+private:
+    vector<stackframe> frames;
+    size_t depth;
 };
 
 const int evaluating = 0;
@@ -1022,132 +2316,161 @@ const int evaled = 2;
 const int evalspecial = 3;
 const int evalmacro = 4;
 
-void print_stack(const std::deque<stackframe> exec_stack) {
-    cout << "Stack size: " << exec_stack.size() << endl;
-
-    for(auto frame : exec_stack) {
-        cout << "frame " << frame.mark << endl;
-        cout << "  code: ";
-        frame.code->print();
-        cout << endl;
-        shared_ptr<syntax> code_syntax = dynamic_pointer_cast<syntax>(frame.code);
-        if(code_syntax) {
-            shared_ptr<syntaxlocation> loc = code_syntax->get_location();
-            cout << "  location: " << loc->name << " (" << loc->linenum << ", " << loc->charnum
-                 << ")" << endl;
+const char* stepper_mark_name(int mark) {
+    static const char* names[stepper_mark_count] = {
+        "evaluating", "applying", "evaled", "evalspecial", "evalmacro"
+    };
+    return mark >= 0 && mark < stepper_mark_count ? names[mark] : "unknown";
+}
+
+void print_stack(const execstack& exec_stack, ostream& out = cout) {
+    out << "Stack size: " << exec_stack.size() << endl;
+
+    for(size_t i = 0; i < exec_stack.size(); ++i) {
+        if(i == max_printed_frames / 2 && exec_stack.size() > max_printed_frames) {
+            size_t skipped = exec_stack.size() - max_printed_frames;
+            out << "... " << skipped << " frames not shown" << endl;
+            i += skipped;
+        }
+        const stackframe& frame = exec_stack[i];
+        out << "frame " << frame.mark << endl;
+        out << "  code: ";
+        frame.code->print(out);
+        out << endl;
+        sourcelocation loc;
+        if(get_source_location(frame.code.get(), loc) ||
+           get_source_location(frame.form.get(), loc)) {
+            out << "  location: " << loc.filename() << " (" << loc.line() << ", " << loc.column()
+                << ")" << endl;
         } else {
-            cout << "  no code location info" << endl;
+            out << "  no code location info" << endl;
         }
-        cout << "  args:" << endl;
-        for(auto arg: frame.evaled_args) {
-            cout << "    ";
-            arg->print();
-            cout << endl;
+        out << "  args:" << endl;
+        for(auto& arg : frame.evaled_args) {
+            out << "    ";
+            arg->print(out);
+            out << endl;
         }
     }
 }
 
-void apply_lispfunc(std::deque<stackframe>& exec_stack) {
-    auto evaled_args = exec_stack.front().evaled_args;
-    shared_ptr<lispfunc> func = dynamic_pointer_cast<lispfunc>(evaled_args.front());
-    //cout << "applying "; func->print(); cout << endl;
-    evaled_args.erase(evaled_args.begin());
-    shared_ptr<lexicalscope> scope(new lexicalscope(func->closure));
+shared_ptr<lexicalscope> bind_lispfunc_args(shared_ptr<lispfunc> func,
+                                            const shared_ptr<lispobj>* args,
+                                            const shared_ptr<lispobj>* args_end) {
+    shared_ptr<lexicalscope> scope = make_pooled<lexicalscope>(func->closure);
 
-    auto arg_value_iter = evaled_args.begin();
+    auto arg_value_iter = args;
     shared_ptr<lispobj> arg_names = func->args;
-    shared_ptr<cons> c = dynamic_pointer_cast<cons>(arg_names);
-    while(arg_value_iter != evaled_args.end() && c) {
-        shared_ptr<symbol> name = dynamic_pointer_cast<symbol>(c->car());
+    shared_ptr<cons> c = lisp_cast<cons>(arg_names);
+    // &rest may also be bound to an empty list
+    while(c && (arg_value_iter != args_end || c->car() == rest_symbol)) {
+        shared_ptr<symbol> name = lisp_cast<symbol>(c->car());
         if(name) {
-            if(name->name() == "&rest") {
+            if(name == rest_symbol) {
                 arg_names = c->cdr();
-                c = dynamic_pointer_cast<cons>(arg_names);
+                c = lisp_cast<cons>(arg_names);
                 if(c){
-                    name = dynamic_pointer_cast<symbol>(c->car());
+                    name = lisp_cast<symbol>(c->car());
                     if(name) {
-                        scope->defval(name->name(), make_list(arg_value_iter, evaled_args.end()));
-                        arg_value_iter = evaled_args.end();
+                        scope->defval(name, make_list(arg_value_iter, args_end));
+                        arg_value_iter = args_end;
                         arg_names = c->cdr();
-                        c = dynamic_pointer_cast<cons>(arg_names);
+                        c = lisp_cast<cons>(arg_names);
                         continue;
                     } else {
                         throw string("ERROR: arguments must be symbols");
                     }
                 } else {
-                    throw("ERROR: need an argument after &rest");
+                    throw string("ERROR: need an argument after &rest");
                 }
             } else {
-                scope->defval(name->name(), *arg_value_iter);
+                scope->defval(name, *arg_value_iter);
             }
         } else {
             throw string("ERROR: arguments must be symbols");
         }
         arg_names = c->cdr();
-        c = dynamic_pointer_cast<cons>(arg_names);
+        c = lisp_cast<cons>(arg_names);
         ++arg_value_iter;
     }
 
-    if(!dynamic_pointer_cast<nil>(arg_names) ||
-       arg_value_iter != evaled_args.end()) {
+    if(!is_a<nil>(arg_names) ||
+       arg_value_iter != args_end) {
         throw string("ERROR: function arity does not match call.");
     }
 
+    return scope;
+}
+
+void apply_lispfunc(execstack& exec_stack) {
+    auto& evaled_args = exec_stack.front().evaled_args;
+    shared_ptr<lispfunc> func = lisp_cast<lispfunc>(evaled_args.front());
+    //cout << "applying "; func->print(); cout << endl;
+
+    if(get_eval_mode() == vm_mode) {
+        exec_stack.front().mark = evaled;
+        exec_stack.front().code = vm_apply(func,
+                                           evaled_args.data() + 1,
+                                           evaled_args.data() + evaled_args.size());
+        exec_stack.front().evaled_args.clear();
+        return;
+    }
+
+    shared_ptr<lexicalscope> scope = bind_lispfunc_args(func,
+                                                        evaled_args.data() + 1,
+                                                        evaled_args.data() + evaled_args.size());
+
     exec_stack.front().mark = applying;
     exec_stack.front().scope = scope;
     exec_stack.front().code = func->get_expanded_code();
+    exec_stack.front().func = func;
 }
 
-void apply_macro(std::deque<stackframe>& exec_stack) {
-    auto evaled_args = exec_stack.front().evaled_args;
-    shared_ptr<macro> func = dynamic_pointer_cast<macro>(evaled_args.front());
-    //cout << "applying "; func->print(); cout << endl;
-
-    shared_ptr<lexicalscope> scope(new lexicalscope(func->closure));
+shared_ptr<lexicalscope> bind_macro_args(shared_ptr<macro> func, shared_ptr<lispobj> args) {
+    shared_ptr<lexicalscope> scope = make_pooled<lexicalscope>(func->closure);
 
-    shared_ptr<lispobj> args = exec_stack.front().code;
-    shared_ptr<cons> args_cons = dynamic_pointer_cast<cons>(args);
+    shared_ptr<cons> args_cons = lisp_cast<cons>(args);
     shared_ptr<lispobj> param_names = func->args;
-    shared_ptr<cons> param_cons = dynamic_pointer_cast<cons>(param_names);
+    shared_ptr<cons> param_cons = lisp_cast<cons>(param_names);
     while(args_cons && param_cons) {
-        shared_ptr<symbol> param_name = dynamic_pointer_cast<symbol>(param_cons->car());
+        shared_ptr<symbol> param_name = lisp_cast<symbol>(param_cons->car());
         if(param_name) {
-            if(param_name->name() == "&rest") {
+            if(param_name == rest_symbol) {
                 param_names = param_cons->cdr();
-                param_cons = dynamic_pointer_cast<cons>(param_names);
-                args = make_shared<cons>(args, make_shared<nil>());
-                args_cons = dynamic_pointer_cast<cons>(args);
+                param_cons = lisp_cast<cons>(param_names);
+                args = make_pooled<cons>(args, make_nil());
+                args_cons = lisp_cast<cons>(args);
                 continue;
             } else {
-                scope->defval(param_name->name(), args_cons->car());
+                scope->defval(param_name, args_cons->car());
             }
         } else {
             throw string("ERROR: parameter names must be symbols");
         }
         param_names = param_cons->cdr();
-        param_cons = dynamic_pointer_cast<cons>(param_names);
+        param_cons = lisp_cast<cons>(param_names);
         args = args_cons->cdr();
-        args_cons = dynamic_pointer_cast<cons>(args);
+        args_cons = lisp_cast<cons>(args);
     }
 
     // handle rest param == nil
     if(param_cons) {
-        shared_ptr<symbol> param_name = dynamic_pointer_cast<symbol>(param_cons->car());
-        if(param_name && param_name->name() == "&rest") {
+        shared_ptr<symbol> param_name = lisp_cast<symbol>(param_cons->car());
+        if(param_name && param_name == rest_symbol) {
             param_names = param_cons->cdr();
-            param_cons = dynamic_pointer_cast<cons>(param_names);
+            param_cons = lisp_cast<cons>(param_names);
             if(param_cons) {
-                param_name = dynamic_pointer_cast<symbol>(param_cons->car());
+                param_name = lisp_cast<symbol>(param_cons->car());
                 if(param_name) {
                     param_names = param_cons->cdr();
-                    scope->defval(param_name->name(), make_shared<nil>());
+                    scope->defval(param_name, make_nil());
                 }
             }
         }
     }
 
-    if(!dynamic_pointer_cast<nil>(param_names) ||
-       !dynamic_pointer_cast<nil>(args)) {
+    if(!is_a<nil>(param_names) ||
+       !is_a<nil>(args)) {
         stringstream ss;
         ss << "ERROR: macro arity does not match call." << endl;
         ss << "Remaining param_names: "; param_names->print(ss); ss << endl;
@@ -1155,44 +2478,57 @@ void apply_macro(std::deque<stackframe>& exec_stack) {
         throw ss.str();
     }
 
-    exec_stack.push_front(stackframe(scope, applying, func->code));
+    return scope;
+}
+
+// Runs a macro's body on unevaluated arguments and returns the expansion.
+shared_ptr<lispobj> call_macro(shared_ptr<macro> func, shared_ptr<lispobj> args) {
+    shared_ptr<lexicalscope> scope = bind_macro_args(func, args);
+
+    if(get_eval_mode() == vm_mode) {
+        return vm_run(func->get_compiled_code(), scope, 1);
+    } else {
+        return run_stepper(make_pooled<cons>(begin_symbol, func->code), scope);
+    }
+}
+
+void apply_macro(execstack& exec_stack) {
+    shared_ptr<macro> func = lisp_cast<macro>(exec_stack.front().evaled_args.front());
+    //cout << "applying "; func->print(); cout << endl;
+
+    shared_ptr<lexicalscope> scope = bind_macro_args(func, exec_stack.front().code);
+
+    if(get_eval_mode() == vm_mode) {
+        exec_stack.push_front(scope, evaled, vm_run(func->get_compiled_code(), scope, 1));
+    } else {
+        exec_stack.push_front(scope, applying, func->code);
+    }
 }
 
 bool is_special_form(shared_ptr<lispobj> form) {
-    shared_ptr<symbol> sym = dynamic_pointer_cast<symbol>(form);
+    shared_ptr<symbol> sym = lisp_cast<symbol>(form);
     if(sym) {
-        if(sym->name() == "if") {
-            return true;
-        } else if(sym->name() == "lambda") {
-            return true;
-        } else if(sym->name() == "module") {
-            return true;
-        } else if(sym->name() == "import") {
-            return true;
-        } else if(sym->name() == "begin") {
-            return true;
-        } else if(sym->name() == "defun") {
-            return true;
-        } else if(sym->name() == "defmacro") {
-            return true;
-        } else if(sym->name() == "quote") {
-            return true;
-        } else if(sym->name() == "let*") {
-            return true;
-        } else if(sym->name() == "macro-expand-1") {
-            return true;
-        }
+        return sym == if_symbol ||
+            sym == lambda_symbol ||
+            sym == module_symbol ||
+            sym == import_symbol ||
+            sym == begin_symbol ||
+            sym == defun_symbol ||
+            sym == defmacro_symbol ||
+            sym == quote_symbol ||
+            sym == let_star_symbol ||
+            sym == macro_expand_1_symbol;
     }
     return false;
 }
 
 int add_import_to_module(shared_ptr<module> mod, shared_ptr<lispobj> importdecl) {
-    shared_ptr<cons> c = dynamic_pointer_cast<cons>(importdecl);
+    shared_ptr<cons> c = lisp_cast<cons>(importdecl);
     if(!c) {
         return 1;
     }
 
-    if(!dynamic_pointer_cast<nil>(c->cdr())) {
+    if(!is_a<nil>(c->cdr())) {
         cout << "too many arguments to import" << endl;
         return 1;
     }
@@ -1210,14 +2546,14 @@ int add_import_to_module(shared_ptr<module> mod, shared_ptr<lispobj> importdecl)
 }
 
 int add_export_to_module(shared_ptr<module> mod, shared_ptr<lispobj> exportdecl) {
-    shared_ptr<cons> c = dynamic_pointer_cast<cons>(exportdecl);
+    shared_ptr<cons> c = lisp_cast<cons>(exportdecl);
     if(!c) {
         cout << "nothing to export" << endl;
         return 1;
     }
 
     while(c) {
-        shared_ptr<symbol> exportname = dynamic_pointer_cast<symbol>(c->car());
+        shared_ptr<symbol> exportname = lisp_cast<symbol>(c->car());
         if(!exportname) {
             cout << "non-symbol in export list" << endl;
             return 1;
@@ -1225,7 +2561,7 @@ int add_export_to_module(shared_ptr<module> mod, shared_ptr<lispobj> exportdecl)
 
         mod->add_export(exportname);
 
-        c = dynamic_pointer_cast<cons>(c->cdr());
+        c = lisp_cast<cons>(c->cdr());
     }
 
     return 0;
@@ -1233,18 +2569,18 @@ int add_export_to_module(shared_ptr<module> mod, shared_ptr<lispobj> exportdecl)
 
 int add_defun_to_module(shared_ptr<module> mod,
                         shared_ptr<lispobj> defundecl) {
-    shared_ptr<cons> c = dynamic_pointer_cast<cons>(defundecl);
+    shared_ptr<cons> c = lisp_cast<cons>(defundecl);
     if(!c) {
         return 1;
     }
 
-    shared_ptr<symbol> defname = dynamic_pointer_cast<symbol>(c->car());
+    shared_ptr<symbol> defname = lisp_cast<symbol>(c->car());
 
     if(!defname) {
         return 1;
     }
 
-    c = dynamic_pointer_cast<cons>(c->cdr());
+    c = lisp_cast<cons>(c->cdr());
 
     if(!c) {
         return 1;
@@ -1253,25 +2589,26 @@ int add_defun_to_module(shared_ptr<module> mod,
     shared_ptr<lispobj> arg_list = c->car();
     shared_ptr<lispobj> code = c->cdr();
     shared_ptr<lispfunc> lfunc(new lispfunc(arg_list, mod->get_bindings(), code));
-    mod->defun(defname->name(), lfunc);
+    lfunc->name = defname;
+    mod->defun(defname, lfunc);
 
     return 0;
 }
 
 int add_defmacro_to_module(shared_ptr<module> mod,
                            shared_ptr<lispobj> defundecl) {
-    shared_ptr<cons> c = dynamic_pointer_cast<cons>(defundecl);
+    shared_ptr<cons> c = lisp_cast<cons>(defundecl);
     if(!c) {
         return 1;
     }
 
-    shared_ptr<symbol> defname = dynamic_pointer_cast<symbol>(c->car());
+    shared_ptr<symbol> defname = lisp_cast<symbol>(c->car());
 
     if(!defname) {
         return 1;
     }
 
-    c = dynamic_pointer_cast<cons>(c->cdr());
+    c = lisp_cast<cons>(c->cdr());
 
     if(!c) {
         return 1;
@@ -1280,13 +2617,13 @@ int add_defmacro_to_module(shared_ptr<module> mod,
     shared_ptr<lispobj> arg_list = c->car();
     shared_ptr<lispobj> code = c->cdr();
     shared_ptr<macro> mac(new macro(arg_list, mod->get_bindings(), code));
-    mod->defun(defname->name(), mac);
+    mod->defun(defname, mac);
 
     return 0;
 }
 
-void eval_module_special_form(std::deque<stackframe>& exec_stack) {
-    shared_ptr<cons> c = dynamic_pointer_cast<cons>(exec_stack.front().code);
+void eval_module_special_form(execstack& exec_stack) {
+    shared_ptr<cons> c = lisp_cast<cons>(exec_stack.front().code);
     if(!c) {
         throw string("module does not have name");
     }
@@ -1295,9 +2632,9 @@ void eval_module_special_form(std::deque<stackframe>& exec_stack) {
     shared_ptr<module> m(new module(c->car(),
                                     exec_stack.front().scope));
 
-    c = dynamic_pointer_cast<cons>(c->cdr());
+    c = lisp_cast<cons>(c->cdr());
     while(c) {
-        shared_ptr<cons> decl = dynamic_pointer_cast<cons>(c->car());
+        shared_ptr<cons> decl = lisp_cast<cons>(c->car());
         if(!decl) {
             stringstream errormsg;
             errormsg << "invalid module declaration 1: ";
@@ -1307,7 +2644,7 @@ void eval_module_special_form(std::deque<stackframe>& exec_stack) {
         }
 
 
-        shared_ptr<symbol> s = dynamic_pointer_cast<symbol>(decl->car());
+        shared_ptr<symbol> s = lisp_cast<symbol>(decl->car());
         if(!s) {
             stringstream errormsg;
             errormsg << "invalid module declaration 2: ";
@@ -1316,7 +2653,7 @@ void eval_module_special_form(std::deque<stackframe>& exec_stack) {
             throw errormsg.str();
         }
 
-        if(s->name() == "import") {
+        if(s == import_symbol) {
             if(add_import_to_module(m, decl->cdr())) {
                 stringstream errormsg;
                 errormsg << "invalid import declaration: ";
@@ -1324,7 +2661,7 @@ void eval_module_special_form(std::deque<stackframe>& exec_stack) {
                 errormsg << endl;
                 throw errormsg.str();
             }
-        } else if(s->name() == "export") {
+        } else if(s == export_symbol) {
             if(add_export_to_module(m, decl->cdr())) {
                 stringstream errormsg;
                 errormsg << "invalid export declaration: ";
@@ -1332,7 +2669,7 @@ void eval_module_special_form(std::deque<stackframe>& exec_stack) {
                 errormsg << endl;
                 throw errormsg.str();
             }
-        } else if(s->name() == "defun") {
+        } else if(s == defun_symbol) {
             if(add_defun_to_module(m, decl->cdr())) {
                 stringstream errormsg;
                 errormsg << "invalid defun declaration: ";
@@ -1340,7 +2677,7 @@ void eval_module_special_form(std::deque<stackframe>& exec_stack) {
                 errormsg << endl;
                 throw errormsg.str();
             }
-        } else if(s->name() == "defmacro") {
+        } else if(s == defmacro_symbol) {
             if(add_defmacro_to_module(m, decl->cdr())) {
                 stringstream errormsg;
                 errormsg << "invalid defmacro declaration: ";
@@ -1348,11 +2685,11 @@ void eval_module_special_form(std::deque<stackframe>& exec_stack) {
                 errormsg << endl;
                 throw errormsg.str();
             }
-        } else if(s->name() == "init") {
+        } else if(s == init_symbol) {
             m->add_init(decl->cdr());
         }
 
-        c = dynamic_pointer_cast<cons>(c->cdr());
+        c = lisp_cast<cons>(c->cdr());
     }
 
     exec_stack.front().scope->add_import(m);
@@ -1361,10 +2698,10 @@ void eval_module_special_form(std::deque<stackframe>& exec_stack) {
     exec_stack.front().code = m;
 }
 
-void eval_if_special_form(std::deque<stackframe>& exec_stack) {
+void eval_if_special_form(execstack& exec_stack) {
     if(exec_stack.front().evaled_args.size() == 1) {
         shared_ptr<lispobj> lobj = exec_stack.front().code;
-        shared_ptr<cons> c = dynamic_pointer_cast<cons>(lobj);
+        shared_ptr<cons> c = lisp_cast<cons>(lobj);
         if(!c) {
             std::stringstream errormsg;
             lobj->print(errormsg);
@@ -1372,24 +2709,24 @@ void eval_if_special_form(std::deque<stackframe>& exec_stack) {
             throw errormsg.str();
         }
         exec_stack.front().code = c->cdr();
-        exec_stack.push_front(stackframe(exec_stack.front().scope,
-                                         evaluating,
-                                         c->car()));
+        exec_stack.push_front(exec_stack.front().scope,
+                              evaluating,
+                              c->car());
     } else if(exec_stack.front().evaled_args.size() == 2) {
-        shared_ptr<cons> c = dynamic_pointer_cast<cons>(exec_stack.front().code);
+        shared_ptr<cons> c = lisp_cast<cons>(exec_stack.front().code);
         if(!c) {
             throw string("if has no true branch");
         }
 
         if(!istrue(exec_stack.front().evaled_args[1])) {
-            shared_ptr<cons> c2 = dynamic_pointer_cast<cons>(c->cdr());
+            shared_ptr<cons> c2 = lisp_cast<cons>(c->cdr());
             if(c2) {
                 exec_stack.front().mark = evaluating;
                 exec_stack.front().code = c2->car();
                 exec_stack.front().evaled_args.clear();
             } else {
                 exec_stack.front().mark = evaled;
-                exec_stack.front().code = make_shared<nil>();
+                exec_stack.front().code = make_nil();
                 exec_stack.front().evaled_args.clear();
             }
         } else {
@@ -1400,14 +2737,13 @@ void eval_if_special_form(std::deque<stackframe>& exec_stack) {
     }
 }
 
-void eval_defun_special_form(std::deque<stackframe>& exec_stack) {
-    shared_ptr<lispobj> lobj = exec_stack.front().code;
-    shared_ptr<cons> c = dynamic_pointer_cast<cons>(lobj);
+shared_ptr<lispobj> eval_defun(shared_ptr<lispobj> lobj, shared_ptr<lexicalscope> scope) {
+    shared_ptr<cons> c = lisp_cast<cons>(lobj);
     if(!c) {
         throw string("define needs more arguments");
     }
 
-    shared_ptr<symbol> funcname = dynamic_pointer_cast<symbol>(c->car());
+    shared_ptr<symbol> funcname = lisp_cast<symbol>(c->car());
     if(!funcname) {
         std::stringstream errormsg;
         errormsg << "defun: first argument must be symbol, instead got: ";
@@ -1416,36 +2752,40 @@ void eval_defun_special_form(std::deque<stackframe>& exec_stack) {
         throw errormsg.str();
     }
 
-    shared_ptr<cons> c2 = dynamic_pointer_cast<cons>(c->cdr());
+    shared_ptr<cons> c2 = lisp_cast<cons>(c->cdr());
     if(!c2) {
         throw string("defun: not enough arguments");
     }
 
-    if(typeid(*(c2->car())) != typeid(cons) &&
-       typeid(*(c2->car())) != typeid(nil)) {
+    if(!lisp_cast<cons>(c2->car()) &&
+       !is_a<nil>(c2->car())) {
         throw string("defun: second argument not list");
     }
 
-    if(typeid(*(c2->cdr())) != typeid(nil)) {
+    if(is_a<nil>(c2->cdr())) {
         cout << "defun: " << funcname->name() << " has no function body" << endl;
     }
 
-    shared_ptr<lispfunc> lfunc(new lispfunc(c2->car(), exec_stack.front().scope, c2->cdr()));
+    shared_ptr<lispfunc> lfunc(new lispfunc(c2->car(), scope, c2->cdr()));
+    lfunc->name = funcname;
+
+    scope->defun(funcname, lfunc);
+    return c->car();
+}
 
-    exec_stack.front().scope->defun(funcname->name(), lfunc);
+void eval_defun_special_form(execstack& exec_stack) {
+    exec_stack.front().code = eval_defun(exec_stack.front().code, exec_stack.front().scope);
     exec_stack.front().evaled_args.clear();
     exec_stack.front().mark = evaled;
-    exec_stack.front().code = c->car();
 }
 
-void eval_defmacro_special_form(std::deque<stackframe>& exec_stack) {
-    shared_ptr<lispobj> lobj = exec_stack.front().code;
-    shared_ptr<cons> c = dynamic_pointer_cast<cons>(lobj);
+shared_ptr<lispobj> eval_defmacro(shared_ptr<lispobj> lobj, shared_ptr<lexicalscope> scope) {
+    shared_ptr<cons> c = lisp_cast<cons>(lobj);
     if(!c) {
         throw string("defmacro needs more arguments");
     }
 
-    shared_ptr<symbol> macroname = dynamic_pointer_cast<symbol>(c->car());
+    shared_ptr<symbol> macroname = lisp_cast<symbol>(c->car());
     if(!macroname) {
         std::stringstream errormsg;
         errormsg << "defmacro: first argument must be symbol, instead got: ";
@@ -1454,36 +2794,40 @@ void eval_defmacro_special_form(std::deque<stackframe>& exec_stack) {
         throw errormsg.str();
     }
 
-    shared_ptr<cons> c2 = dynamic_pointer_cast<cons>(c->cdr());
+    shared_ptr<cons> c2 = lisp_cast<cons>(c->cdr());
     if(!c2) {
         throw string("defmacro: not enough arguments");
     }
 
-    if(typeid(*(c2->car())) != typeid(cons) &&
-       typeid(*(c2->car())) != typeid(nil)) {
+    if(!lisp_cast<cons>(c2->car()) &&
+       !is_a<nil>(c2->car())) {
         throw string("defmacro: second argument not list");
     }
 
-    if(typeid(*(c2->cdr())) == typeid(nil)) {
+    if(is_a<nil>(c2->cdr())) {
         cout << "defmacro: " << macroname->name() << " has no function body" << endl;
     }
 
-    shared_ptr<macro> mac(new macro(c2->car(), exec_stack.front().scope, c2->cdr()));
+    shared_ptr<macro> mac(new macro(c2->car(), scope, c2->cdr()));
+
+    scope->defun(macroname, mac);
+    return macroname;
+}
 
-    exec_stack.front().scope->defun(macroname->name(), mac);
+void eval_defmacro_special_form(execstack& exec_stack) {
+    exec_stack.front().code = eval_defmacro(exec_stack.front().code, exec_stack.front().scope);
     exec_stack.front().evaled_args.clear();
     exec_stack.front().mark = evaled;
-    exec_stack.front().code = macroname;
 }
 
-void eval_lambda_special_form(std::deque<stackframe>& exec_stack) {
+void eval_lambda_special_form(execstack& exec_stack) {
     shared_ptr<lispobj> lobj = exec_stack.front().code;
-    shared_ptr<cons> c = dynamic_pointer_cast<cons>(lobj);
+    shared_ptr<cons> c = lisp_cast<cons>(lobj);
     if(!c) {
         throw string("lambda needs more arguments");
     }
 
-    shared_ptr<cons> c2 = dynamic_pointer_cast<cons>(c->cdr());
+    shared_ptr<cons> c2 = lisp_cast<cons>(c->cdr());
     if(!c2) {
         throw string("lambda needs more arguments");
     }
@@ -1494,52 +2838,52 @@ void eval_lambda_special_form(std::deque<stackframe>& exec_stack) {
 }
 
 void make_let_star_bindings(shared_ptr<lexicalscope> scope, shared_ptr<lispobj> bindings) {
-    shared_ptr<cons> c = dynamic_pointer_cast<cons>(bindings);
+    shared_ptr<cons> c = lisp_cast<cons>(bindings);
 
     while(c) {
         shared_ptr<lispobj> binding = c->car();
-        shared_ptr<symbol> symbol_binding = dynamic_pointer_cast<symbol>(binding);
-        shared_ptr<cons> cons_binding = dynamic_pointer_cast<cons>(binding);
+        shared_ptr<symbol> symbol_binding = lisp_cast<symbol>(binding);
+        shared_ptr<cons> cons_binding = lisp_cast<cons>(binding);
 
         if(symbol_binding) {
-            scope->defval(symbol_binding->name(), make_shared<nil>());
+            scope->defval(symbol_binding, make_nil());
         } else if(cons_binding) {
-            shared_ptr<symbol> name = dynamic_pointer_cast<symbol>(cons_binding->car());
+            shared_ptr<symbol> name = lisp_cast<symbol>(cons_binding->car());
             if(!name) {
                 throw string("invalid let binding variable");
             }
 
-            shared_ptr<cons> c2 = dynamic_pointer_cast<cons>(cons_binding->cdr());
+            shared_ptr<cons> c2 = lisp_cast<cons>(cons_binding->cdr());
             if(c2) {
                 shared_ptr<lispobj> val = eval(c2->car(), scope);
                 if(val) {
-                    scope->defval(name->name(), val);
+                    scope->defval(name, val);
                 } else {
                     throw string("let binding eval failed");
                 }
             } else {
-                scope->defval(name->name(), make_shared<nil>());
+                scope->defval(name, make_nil());
             }
         } else {
             throw string("Invalid let binding");
         }
 
         bindings = c->cdr();
-        c = dynamic_pointer_cast<cons>(bindings);
+        c = lisp_cast<cons>(bindings);
     }
 }
 
-void eval_let_star_special_form(std::deque<stackframe>& exec_stack) {
+void eval_let_star_special_form(execstack& exec_stack) {
     //add new stack frame with new env, parent of current stack frame
 
     shared_ptr<lispobj> lobj = exec_stack.front().code;
-    shared_ptr<cons> c = dynamic_pointer_cast<cons>(lobj);
+    shared_ptr<cons> c = lisp_cast<cons>(lobj);
 
     if(!c) {
         throw string("let needs more forms");
     }
 
-    shared_ptr<lexicalscope> scope(new lexicalscope(exec_stack.front().scope));
+    shared_ptr<lexicalscope> scope = make_pooled<lexicalscope>(exec_stack.front().scope);
 
     make_let_star_bindings(scope, c->car());
 
@@ -1548,21 +2892,21 @@ void eval_let_star_special_form(std::deque<stackframe>& exec_stack) {
     exec_stack.front().mark = applying;
 }
 
-void eval_special_form(string name,
-                      std::deque<stackframe>& exec_stack) {
-    if(name == "if") {
+void eval_special_form(shared_ptr<symbol> name,
+                      execstack& exec_stack) {
+    if(name == if_symbol) {
         eval_if_special_form(exec_stack);
-    } else if(name == "lambda") {
+    } else if(name == lambda_symbol) {
         eval_lambda_special_form(exec_stack);
-    } else if(name == "module") {
+    } else if(name == module_symbol) {
         eval_module_special_form(exec_stack);
-    } else if(name == "import") {
-        shared_ptr<cons> c = dynamic_pointer_cast<cons>(exec_stack.front().code);
+    } else if(name == import_symbol) {
+        shared_ptr<cons> c = lisp_cast<cons>(exec_stack.front().code);
         if(!c) {
             throw string("import needs more arguments");
         }
 
-        shared_ptr<module> m = nullptr; //env->get_module_by_prefix(c->car());
+        shared_ptr<module> m = exec_stack.front().scope->find_module(c->car());
         if(!m) {
             stringstream errormsg;
             errormsg << "Module ";
@@ -1578,31 +2922,31 @@ void eval_special_form(string name,
         }
         exec_stack.front().scope->add_import(m);
         exec_stack.front().mark = evaled;
-        exec_stack.front().code = make_shared<nil>();
-    } else if(name == "begin") {
+        exec_stack.front().code = make_nil();
+    } else if(name == begin_symbol) {
         exec_stack.front().mark = applying;
-    } else if(name == "defun") {
+    } else if(name == defun_symbol) {
         eval_defun_special_form(exec_stack);
-    } else if(name == "defmacro") {
+    } else if(name == defmacro_symbol) {
         eval_defmacro_special_form(exec_stack);
-    } else if(name == "quote") {
-        shared_ptr<cons> c = dynamic_pointer_cast<cons>(exec_stack.front().code);
+    } else if(name == quote_symbol) {
+        shared_ptr<cons> c = lisp_cast<cons>(exec_stack.front().code);
         if(!c) {
             throw string("quote needs more arguments");
         }
 
-        if(!dynamic_pointer_cast<nil>(c->cdr())) {
+        if(!is_a<nil>(c->cdr())) {
             throw string("quote has too many args");
         }
 
         exec_stack.front().code = c->car();
         exec_stack.front().mark = evaled;
-    } else if(name == "let*") {
+    } else if(name == let_star_symbol) {
         eval_let_star_special_form(exec_stack);
-    } else if(name == "macro-expand-1") {
+    } else if(name == macro_expand_1_symbol) {
         if (exec_stack.front().evaled_args.size() == 1) {
             shared_ptr<lispobj> lobj = exec_stack.front().code;
-            shared_ptr<cons> c = dynamic_pointer_cast<cons>(lobj);
+            shared_ptr<cons> c = lisp_cast<cons>(lobj);
             if(!c) {
                 std::stringstream errormsg;
                 lobj->print(errormsg);
@@ -1610,32 +2954,32 @@ void eval_special_form(string name,
                 throw errormsg.str();
             }
             exec_stack.front().code = c->cdr();
-            exec_stack.push_front(stackframe(exec_stack.front().scope,
-                                             evaluating,
-                                             c->car()));
+            exec_stack.push_front(exec_stack.front().scope,
+                                  evaluating,
+                                  c->car());
         } else if(exec_stack.front().evaled_args.size() == 2) {
-            shared_ptr<cons> first_arg = dynamic_pointer_cast<cons>(exec_stack.front().evaled_args[1]);
+            shared_ptr<cons> first_arg = lisp_cast<cons>(exec_stack.front().evaled_args[1]);
             if(!first_arg) {
                 // argument is something besides a fun/macro call, so just return it
                 exec_stack.front().mark = evaled;
                 exec_stack.front().code = exec_stack.front().evaled_args[1];
                 return;
             }
-            shared_ptr<symbol> sym = dynamic_pointer_cast<symbol>(first_arg->car());
+            shared_ptr<symbol> sym = lisp_cast<symbol>(first_arg->car());
             if(!sym) {
                 // argument is not a macro call
                 exec_stack.front().mark = evaled;
                 exec_stack.front().code = first_arg;
                 return;
             }
-            shared_ptr<macro> mac = dynamic_pointer_cast<macro>(
-                exec_stack.front().scope->getfun(sym->name()));
+            shared_ptr<macro> mac = lisp_cast<macro>(
+                exec_stack.front().scope->getfun(sym));
             if(mac) {
                 exec_stack.front().evaled_args[0] = mac;
                 exec_stack.front().code = first_arg->cdr();
                 exec_stack.front().mark = applying;
                 apply_macro(exec_stack);
-                exec_stack[1].code = make_shared<nil>();
+                exec_stack[1].code = make_nil();
                 //print_stack(exec_stack);
             } else {
                 exec_stack.front().mark = evaled;
@@ -1645,12 +2989,13 @@ void eval_special_form(string name,
     }
 }
 
-void evalstep(std::deque<stackframe>& exec_stack) {
+void evalstep(execstack& exec_stack) {
+    ++runtime_stats.steps[exec_stack.front().mark];
     if(exec_stack.front().mark == evaled) {
-        shared_ptr<lispobj> c = exec_stack.front().code;
+        shared_ptr<lispobj> c = std::move(exec_stack.front().code);
         exec_stack.pop_front();
         if(exec_stack.front().mark == applying) {
-            if(dynamic_pointer_cast<nil>(exec_stack.front().code)) {
+            if(exec_stack.front().code->type() == NIL_TYPE) {
                 exec_stack.front().mark = evaled;
                 exec_stack.front().code = c;
             } else {
@@ -1668,22 +3013,35 @@ void evalstep(std::deque<stackframe>& exec_stack) {
             throw string("bad stack 1");
         }
     } else if(exec_stack.front().mark == applying) {
-        if(dynamic_pointer_cast<nil>(exec_stack.front().code)) {
+        switch(exec_stack.front().code->type()) {
+        case NIL_TYPE:
             exec_stack.front().mark = evaled;
-        } else if(shared_ptr<cons> c = dynamic_pointer_cast<cons>(exec_stack.front().code)) {
-            shared_ptr<lispobj> next_statement = c->car();
-            exec_stack.front().code = c->cdr();
-            exec_stack.push_front(stackframe(exec_stack.front().scope,
-                                             evaluating,
-                                             next_statement));
-        } else {
+            break;
+        case CONS_TYPE: {
+            shared_ptr<cons> c = static_pointer_cast<cons>(exec_stack.front().code);
+            if(c->cdr()->type() == NIL_TYPE) {
+                // last statement, so it takes over this frame and a call
+                // in tail position does not grow the stack
+                exec_stack.front().mark = evaluating;
+                exec_stack.front().code = c->car();
+                exec_stack.front().form = c->car();
+                exec_stack.front().evaled_args.clear();
+            } else {
+                exec_stack.front().code = c->cdr();
+                exec_stack.push_front(exec_stack.front().scope,
+                                      evaluating,
+                                      c->car());
+            }
+            break;
+        }
+        default:
             throw string("bad stack 2");
         }
     } else if(exec_stack.front().mark == evaluating) {
-        shared_ptr<cons> c = dynamic_pointer_cast<cons>(exec_stack.front().code);
-        if(c) {
+        switch(exec_stack.front().code->type()) {
+        case CONS_TYPE: {
             //evaluating arguments
-            shared_ptr<macro> macrofunc;
+            shared_ptr<cons> c = static_pointer_cast<cons>(exec_stack.front().code);
             if(exec_stack.front().evaled_args.size() == 0 &&
                is_special_form(c->car())) {
                 //special forms go here, rather than normal argument evaluation
@@ -1691,232 +3049,282 @@ void evalstep(std::deque<stackframe>& exec_stack) {
                 exec_stack.front().evaled_args.push_back(c->car());
                 exec_stack.front().code = c->cdr();
             } else if(exec_stack.front().evaled_args.size() == 1 &&
-                      (macrofunc = dynamic_pointer_cast<macro>(exec_stack.front().evaled_args.front()))) {
+                      exec_stack.front().evaled_args.front()->type() == MACRO_TYPE) {
                 exec_stack.front().mark = evalmacro;
                 apply_macro(exec_stack);
             } else {
+                symbol* head = c->car()->type() == SYMBOL_TYPE ? static_cast<symbol*>(c->car().get()) : nullptr;
                 exec_stack.front().code = c->cdr();
-                exec_stack.push_front(stackframe(exec_stack.front().scope,
-                                                 evaluating,
-                                                 c->car()));
+                if(exec_stack.front().evaled_args.size() == 0 && head &&
+                   head != nil_symbol.get() && head != t_symbol.get() && !head->is_keyword()) {
+                    // first element of a call, so look up a function
+                    exec_stack.front().evaled_args.push_back(
+                        exec_stack.front().scope->getfun(static_pointer_cast<symbol>(c->car())));
+                } else {
+                    exec_stack.push_front(exec_stack.front().scope,
+                                          evaluating,
+                                          c->car());
+                }
             }
-        } else if(dynamic_pointer_cast<nil>(exec_stack.front().code)) {
-            auto evaled_args = exec_stack.front().evaled_args;
+            break;
+        }
+        case NIL_TYPE: {
+            auto& evaled_args = exec_stack.front().evaled_args;
             if(evaled_args.empty()) {
                 throw string("empty function application");
-            } else if(typeid(*(evaled_args.front())) == typeid(lispfunc)) {
+            }
+
+            switch(evaled_args.front()->type()) {
+            case FUNC_TYPE:
                 apply_lispfunc(exec_stack);
-            } else if(shared_ptr<cfunc> func = dynamic_pointer_cast<cfunc>(evaled_args.front())) {
-                evaled_args.erase(evaled_args.begin());
-                shared_ptr<lispobj> ret = func->func(evaled_args);
+                break;
+            case CFUNC_TYPE: {
+                cfunc* func = static_cast<cfunc*>(evaled_args.front().get());
+                shared_ptr<lispobj> ret = func->func(argspan(evaled_args.data() + 1,
+                                                             evaled_args.data() + evaled_args.size()));
                 if(!ret) {
                     throw string("error in cfunc");
                 }
                 exec_stack.front().mark = evaled;
                 exec_stack.front().code = ret;
                 exec_stack.front().evaled_args.clear();
-            } else {
+                break;
+            }
+            default:
                 throw string("trying to apply a non-function");
             }
-        } else if(shared_ptr<symbol> s = dynamic_pointer_cast<symbol>(exec_stack.front().code)) {
+            break;
+        }
+        case SYMBOL_TYPE: {
             //variable lookup
+            shared_ptr<symbol> s = static_pointer_cast<symbol>(exec_stack.front().code);
             exec_stack.front().mark = evaled;
 
-            if(s->name() == "nil") {
-                exec_stack.front().code = make_shared<nil>();
-            } else if(s->name() == "t" || s->name()[0] == ':') {
+            if(s == nil_symbol) {
+                exec_stack.front().code = make_nil();
+            } else if(s == t_symbol || s->is_keyword()) {
                 //self evaling
-            } else if(exec_stack.size() > 1 &&
-                      exec_stack[1].mark == evaluating &&
-                      exec_stack[1].evaled_args.size() == 0) {
-                // first element of a call, so look up a function
-                exec_stack.front().code = exec_stack.front().scope->getfun(s->name());
             } else {
-                exec_stack.front().code = exec_stack.front().scope->getval(s->name());
+                exec_stack.front().code = exec_stack.front().scope->getval(s);
             }
             //cout << "getting var " << s->name() << ": ";
             //print(exec_stack.front().code); cout << endl;
-        } else {
+            break;
+        }
+        default:
             //constant value
             exec_stack.front().mark = evaled;
         }
     } else if(exec_stack.front().mark == evalspecial) {
-        shared_ptr<lispobj> list_head = exec_stack.front().evaled_args[0];
-        shared_ptr<symbol> sym = dynamic_pointer_cast<symbol>(list_head);
+        shared_ptr<symbol> sym = lisp_cast<symbol>(exec_stack.front().evaled_args[0]);
         if(!sym) {
             throw string("non-special form given evalspecial mark.");
         }
 
-        eval_special_form(sym->name(), exec_stack);
+        eval_special_form(sym, exec_stack);
     } else {
         throw string("bad stack 3");
     }
 }
 
-shared_ptr<lispobj> eval(shared_ptr<lispobj> code,
-                         shared_ptr<lexicalscope> tls) {
-    std::deque<stackframe> exec_stack;
+// Stacks left over from finished run_stepper calls. The stepper and the
+// vm call each other, so several stacks can be in use at once.
+static thread_local vector< std::unique_ptr<execstack> > spare_stacks;
 
-    exec_stack.push_front(stackframe(tls, evaluating, code));
+class borrowedstack {
+public:
+    borrowedstack() {
+        if(spare_stacks.empty()) {
+            stack.reset(new execstack);
+        } else {
+            stack = std::move(spare_stacks.back());
+            spare_stacks.pop_back();
+        }
+    }
+
+    ~borrowedstack() {
+        stack->clear();
+        spare_stacks.push_back(std::move(stack));
+    }
+
+    std::unique_ptr<execstack> stack;
+};
+
+static void collect_stepper_frames(const void* stack, vector<profileframe>& out) {
+    const execstack& exec_stack = *static_cast<const execstack*>(stack);
+    for(size_t i = exec_stack.size(); i > 0; --i) {
+        const stackframe& frame = exec_stack[i - 1];
+        if(frame.func) {
+            profileframe f;
+            f.func = frame.func;
+            out.push_back(f);
+        }
+    }
+}
+
+shared_ptr<lispobj> run_stepper(shared_ptr<lispobj> code,
+                                shared_ptr<lexicalscope> tls) {
+    evaluatorguard guard;
+    borrowedstack borrowed;
+    execstack& exec_stack = *borrowed.stack;
+    profiledstack profiled(collect_stepper_frames, &exec_stack);
+
+    exec_stack.push_front(tls, evaluating, code);
 
     try {
         while(exec_stack.size() != 0 && (exec_stack.size() > 1 || exec_stack.front().mark != evaled)) {
+            if(profile_sample_due) {
+                take_profile_sample();
+            }
             evalstep(exec_stack);
             //print_stack(exec_stack);
         }
     } catch(string error) {
-        cout << error << endl;
-        print_stack(exec_stack);
-        return NULL;
+        stringstream trace;
+        trace << error;
+        if(error.empty() || *error.rbegin() != '\n') {
+            trace << endl;
+        }
+        print_stack(exec_stack, trace);
+        throw trace.str();
     }
 
     return exec_stack.front().code;
 }
 
-shared_ptr<lispobj> plus(vector<shared_ptr<lispobj> > args) {
+static thread_local size_t evaluator_nesting = 0;
+
+evaluatorguard::evaluatorguard() {
+    if(evaluator_nesting >= max_evaluator_nesting) {
+        throw string("ERROR: evaluators nested too deeply");
+    }
+    ++evaluator_nesting;
+}
+
+evaluatorguard::~evaluatorguard() {
+    --evaluator_nesting;
+}
+
+shared_ptr<lispobj> eval_stepper(shared_ptr<lispobj> code,
+                                 shared_ptr<lexicalscope> tls) {
+    try {
+        return run_stepper(code, tls);
+    } catch(string error) {
+        cout << error;
+        return NULL;
+    }
+}
+
+shared_ptr<lispobj> eval(shared_ptr<lispobj> code,
+                         shared_ptr<lexicalscope> tls) {
+    maybe_collect_cycles();
+
+    if(get_eval_mode() == vm_mode) {
+        return vm_eval(code, tls);
+    } else {
+        return eval_stepper(code, tls);
+    }
+}
+
+// Used by the arithmetic builtins, which see every argument but do not
+// need to own any of them.
+static int number_arg(const shared_ptr<lispobj>& obj, const char* error) {
+    if(obj->type() != NUMBER_TYPE) {
+        throw string(error);
+    }
+    return static_cast<number*>(obj.get())->value();
+}
+
+shared_ptr<lispobj> plus(argspan args) {
     int sum = 0;
-    for(auto obj : args) {
-        shared_ptr<number> n = dynamic_pointer_cast<number>(obj);
-        if(!n) {
-            throw string("plus requires numbers");
-        }
-        sum += n->value();
+    for(const auto& obj : args) {
+        sum += number_arg(obj, "plus requires numbers");
     }
-    return make_shared<number>(sum);
+    return make_number(sum);
 }
 
-shared_ptr<lispobj> minus(vector<shared_ptr<lispobj> > args) {
+shared_ptr<lispobj> minus(argspan args) {
     if(args.size() > 1) {
-        shared_ptr<number> n = dynamic_pointer_cast<number>(args[0]);
-        if(!n) {
-            throw string("minus requires numbers");
+        int diff = number_arg(args[0], "minus requires numbers");
+        for(auto it = args.begin() + 1; it != args.end(); ++it) {
+            diff -= number_arg(*it, "minus requires numbers");
         }
-        int diff = n->value();
-        args.erase(args.begin());
-
-        for(auto obj : args) {
-            shared_ptr<number> n = dynamic_pointer_cast<number>(obj);
-            if(!n) {
-                throw string("minus requires numbers");
-            }
-            diff -= n->value();
-        }
-        return make_shared<number>(diff);
+        return make_number(diff);
     } else {
-        shared_ptr<lispobj> obj(args[0]);
-        shared_ptr<number> n = dynamic_pointer_cast<number>(obj);
-        if(!n) {
-            throw string("minus requires numbers");
-        }
-        return make_shared<number>(-(n->value()));
+        return make_number(-number_arg(args[0], "minus requires numbers"));
     }
 }
 
-shared_ptr<lispobj> multiply(vector<shared_ptr<lispobj> > args) {
+shared_ptr<lispobj> multiply(argspan args) {
     int product = 1;
-    for(auto obj : args) {
-        shared_ptr<number> n = dynamic_pointer_cast<number>(obj);
-        if(!n) {
-            throw string("multiply requires numbers");
-        }
-        product *= n->value();
+    for(const auto& obj : args) {
+        product *= number_arg(obj, "multiply requires numbers");
     }
-    return make_shared<number>(product);
+    return make_number(product);
 }
 
-shared_ptr<lispobj> divide(vector<shared_ptr<lispobj> > args) {
+shared_ptr<lispobj> divide(argspan args) {
     if(args.size() > 1) {
-        shared_ptr<number> n = dynamic_pointer_cast<number>(args[0]);
-        if(!n) {
-            throw string("divide requires numbers");
-        }
-        int quotient = n->value();
-        args.erase(args.begin());
-
-        for(auto obj : args) {
-            shared_ptr<number> n = dynamic_pointer_cast<number>(obj);
-            if(!n) {
-                throw string("divide requires numbers");
-            }
-            quotient /= n->value();
+        int quotient = number_arg(args[0], "divide requires numbers");
+        for(auto it = args.begin() + 1; it != args.end(); ++it) {
+            quotient /= number_arg(*it, "divide requires numbers");
         }
-        return make_shared<number>(quotient);
+        return make_number(quotient);
     } else {
-        shared_ptr<lispobj> obj(args[0]);
-        shared_ptr<number> n = dynamic_pointer_cast<number>(obj);
-        if(!n) {
-            throw string("divide requires numbers");
-        }
-        return make_shared<number>(n->value());
+        return make_number(number_arg(args[0], "divide requires numbers"));
     }
 }
 
-shared_ptr<lispobj> print_cfunc(vector< shared_ptr<lispobj> > args) {
-    for(shared_ptr<lispobj> lobj : args) {
+shared_ptr<lispobj> print_cfunc(argspan args) {
+    for(const auto& lobj : args) {
         lobj->print();
     }
 
-    return make_shared<nil>();
+    return make_nil();
 }
 
-shared_ptr<lispobj> newline(vector< shared_ptr<lispobj> > /*args*/) {
+shared_ptr<lispobj> newline(argspan /*args*/) {
     cout << endl;
-    return make_shared<nil>();
+    return make_nil();
 }
 
-shared_ptr<lispobj> list_cfunc(vector< shared_ptr<lispobj> > args) {
+shared_ptr<lispobj> list_cfunc(argspan args) {
     return make_reverse_list(args.rbegin(), args.rend());
 }
 
-shared_ptr<lispobj> eq_cfunc(vector< shared_ptr<lispobj> > args) {
-    if(args.size() != 2) {
-        throw string("ERROR eq wants 2 args");
-    }
-
-    if(eq(args[0], args[1])) {
-        return make_shared<symbol>("t");
+shared_ptr<lispobj> eq_cfunc(const shared_ptr<lispobj>& left, const shared_ptr<lispobj>& right) {
+    if(eq(left, right)) {
+        return t_symbol;
     } else {
-        return make_shared<nil>();
+        return make_nil();
     }
 }
 
-shared_ptr<lispobj> eqv_cfunc(vector< shared_ptr<lispobj> > args) {
-    if(args.size() != 2) {
-        throw string("ERROR eqv wants 2 args");
-    }
-
-    if(eqv(args[0], args[1])) {
-        return make_shared<symbol>("t");
+shared_ptr<lispobj> eqv_cfunc(const shared_ptr<lispobj>& left, const shared_ptr<lispobj>& right) {
+    if(eqv(left, right)) {
+        return t_symbol;
     } else {
-        return make_shared<nil>();
+        return make_nil();
     }
 }
 
-shared_ptr<lispobj> equal_cfunc(vector< shared_ptr<lispobj> > args) {
-    if(args.size() != 2) {
-        throw string("ERROR equal wants 2 args");
-    }
-
-    if(equal(args[0], args[1])) {
-        return make_shared<symbol>("t");
+shared_ptr<lispobj> equal_cfunc(const shared_ptr<lispobj>& left, const shared_ptr<lispobj>& right) {
+    if(equal(left, right)) {
+        return t_symbol;
     } else {
-        return make_shared<nil>();
+        return make_nil();
     }
 }
 
-shared_ptr<lispobj> cons_cfunc(vector< shared_ptr<lispobj> > args) {
-    if(args.size() != 2) {
-        throw string("ERROR cons wants 2 args");
-    }
-
-    return make_shared<cons>(args[0], args[1]);
+shared_ptr<lispobj> cons_cfunc(const shared_ptr<lispobj>& car, const shared_ptr<lispobj>& cdr) {
+    return make_pooled<cons>(car, cdr);
 }
 
-shared_ptr<lispobj> string_append_cfunc(vector< shared_ptr<lispobj> > args) {
+shared_ptr<lispobj> string_append_cfunc(argspan args) {
     shared_ptr<lispstring> lstr(new lispstring(""));
 
     for(auto it = args.begin(); it != args.end(); ++it) {
-        shared_ptr<lispstring> arg = dynamic_pointer_cast<lispstring>(*it);
+        shared_ptr<lispstring> arg = lisp_cast<lispstring>(*it);
         if(!arg) {
             throw string("ERROR string-append wants only strings");
         }
@@ -1927,136 +3335,208 @@ shared_ptr<lispobj> string_append_cfunc(vector< shared_ptr<lispobj> > args) {
     return lstr;
 }
 
-shared_ptr<lispobj> open_file_cfunc(vector< shared_ptr<lispobj> > args) {
-    if(args.size() != 1 || !dynamic_pointer_cast<lispstring>(args[0])) {
-        throw string("ERROR open-file wants one string");
+shared_ptr<lispobj> string_length_cfunc(const shared_ptr<lispstring>& str) {
+    return make_number(str->size());
+}
+
+shared_ptr<lispobj> substring_cfunc(const shared_ptr<lispstring>& str,
+                                    const shared_ptr<number>& start,
+                                    const shared_ptr<number>& end) {
+    if(start->value() < 0 || end->value() < 0) {
+        throw string("ERROR substring: range is outside the string");
     }
+    return str->substring(start->value(), end->value());
+}
 
-    shared_ptr<lispstring> filename = dynamic_pointer_cast<lispstring>(args[0]);
+shared_ptr<lispobj> open_file_cfunc(const shared_ptr<lispstring>& filename) {
     return make_shared<fileinputport>(filename->get_contents());
 }
 
-shared_ptr<lispobj> read_cfunc(vector< shared_ptr<lispobj> > args) {
-    if(args.size() != 1 || !dynamic_pointer_cast<fileinputport>(args[0])) {
-        throw string("ERROR read wants on input-port");
-    }
-
-    shared_ptr<fileinputport> port = dynamic_pointer_cast<fileinputport>(args[0]);
+shared_ptr<lispobj> read_cfunc(const shared_ptr<fileinputport>& port) {
     return port->read();
 }
 
-shared_ptr<lispobj> car_cfunc(vector< shared_ptr<lispobj> > args) {
-    if(args.size() != 1 || !dynamic_pointer_cast<cons>(args[0])) {
-        throw string("ERROR car wants one cons");
+shared_ptr<lispobj> read_line_cfunc(const shared_ptr<fileinputport>& port) {
+    return port->read_line();
+}
+
+shared_ptr<lispobj> read_bytes_cfunc(const shared_ptr<fileinputport>& port,
+                                     const shared_ptr<number>& count) {
+    if(count->value() < 0) {
+        throw string("ERROR read-bytes: count must not be negative");
     }
+    return port->read_bytes(count->value());
+}
 
-    shared_ptr<cons> c = dynamic_pointer_cast<cons>(args[0]);
-    return c->car();
+shared_ptr<lispobj> read_all_cfunc(const shared_ptr<fileinputport>& port) {
+    return port->read_all();
 }
 
-shared_ptr<lispobj> cdr_cfunc(vector< shared_ptr<lispobj> > args) {
-    if(args.size() != 1 || !dynamic_pointer_cast<cons>(args[0])) {
-        throw string("ERROR cdr wants one cons");
-    }
+shared_ptr<lispobj> car_cfunc(const shared_ptr<cons>& c) {
+    return c->car();
+}
 
-    shared_ptr<cons> c = dynamic_pointer_cast<cons>(args[0]);
+shared_ptr<lispobj> cdr_cfunc(const shared_ptr<cons>& c) {
     return c->cdr();
 }
 
-shared_ptr<lispobj> consp_cfunc(vector< shared_ptr<lispobj> > args) {
-    if(args.size() != 1) {
-        throw string("ERROR cons? wants one argument");
-    }
-
-    if(dynamic_pointer_cast<cons>(args[0]) != nullptr) {
-        return make_shared<symbol>("t");
+shared_ptr<lispobj> consp_cfunc(const shared_ptr<lispobj>& obj) {
+    if(lisp_cast<cons>(obj) != nullptr) {
+        return t_symbol;
     } else {
-        return make_shared<nil>();
+        return make_nil();
     }
 }
 
-shared_ptr<lispobj> bitvector_cfunc(vector< shared_ptr<lispobj> > args) {
-    if(args.size() != 1 || !dynamic_pointer_cast<number>(args[0])) {
-        throw string("ERROR bitvector wants one number argument");
-    }
-
-    shared_ptr<number> n = dynamic_pointer_cast<number>(args[0]);
+shared_ptr<lispobj> bitvector_cfunc(const shared_ptr<number>& n) {
     return make_shared<bitvector>(n->value());
 }
 
-shared_ptr<lispobj> get_bit(vector< shared_ptr<lispobj> > args) {
-    if(args.size() != 2 ||
-       !dynamic_pointer_cast<bitvector>(args[0]) ||
-       !dynamic_pointer_cast<number>(args[1])) {
-        throw string("ERROR get-bit wants 2 arguments: bitvector number");
-    }
-
-    shared_ptr<bitvector> bv = dynamic_pointer_cast<bitvector>(args[0]);
-    shared_ptr<number> n = dynamic_pointer_cast<number>(args[1]);
-    return make_shared<number>(bv->get_bit(n->value()));
+shared_ptr<lispobj> get_bit(const shared_ptr<bitvector>& bv, const shared_ptr<number>& n) {
+    return make_number(bv->get_bit(n->value()));
 }
 
-shared_ptr<lispobj> set_bit(vector< shared_ptr<lispobj> > args) {
-    if(args.size() != 3 ||
-       !dynamic_pointer_cast<bitvector>(args[0]) ||
-       !dynamic_pointer_cast<number>(args[1]) ||
-       !dynamic_pointer_cast<number>(args[2])) {
-        throw string("ERROR set-bit wants 3 argument: bitvector number number");
-    }
-
-    shared_ptr<bitvector> bv = dynamic_pointer_cast<bitvector>(args[0]);
-    shared_ptr<number> position = dynamic_pointer_cast<number>(args[1]);
-    shared_ptr<number> value = dynamic_pointer_cast<number>(args[2]);
-
+shared_ptr<lispobj> set_bit(const shared_ptr<bitvector>& bv,
+                            const shared_ptr<number>& position,
+                            const shared_ptr<number>& value) {
     bv->set_bit(position->value(), value->value());
-    return make_shared<symbol>("t");
+    return t_symbol;
 }
 
-shared_ptr<lispobj> set_bits(vector< shared_ptr<lispobj> > args) {
-    if(args.size() != 3 ||
-       !dynamic_pointer_cast<bitvector>(args[0]) ||
-       !dynamic_pointer_cast<number>(args[2])) {
-        throw string("ERROR set-bits wants 3 arguments: bitvector list number");
-    }
-
-    shared_ptr<bitvector> bv = dynamic_pointer_cast<bitvector>(args[0]);
-    shared_ptr<number> value = dynamic_pointer_cast<number>(args[2]);
-
-    shared_ptr<cons> value_list = dynamic_pointer_cast<cons>(args[1]);
+shared_ptr<lispobj> set_bits(const shared_ptr<bitvector>& bv,
+                             const shared_ptr<lispobj>& positions,
+                             const shared_ptr<number>& value) {
+    shared_ptr<cons> value_list = lisp_cast<cons>(positions);
     while(value_list) {
-        shared_ptr<number> position = dynamic_pointer_cast<number>(value_list->car());
+        shared_ptr<number> position = lisp_cast<number>(value_list->car());
         if(!position) {
             throw string("ERROR set-bits wants only number in its second argument");
         }
 
         bv->set_bit(position->value(), value->value());
-        value_list = dynamic_pointer_cast<cons>(value_list->cdr());
+        value_list = lisp_cast<cons>(value_list->cdr());
     }
 
-    return make_shared<symbol>("t");
+    return t_symbol;
 }
 
-shared_ptr<lispobj> set_bit_range(vector< shared_ptr<lispobj> > args) {
-    if(args.size() != 4 ||
-       !dynamic_pointer_cast<bitvector>(args[0]) ||
-       !dynamic_pointer_cast<number>(args[1]) ||
-       !dynamic_pointer_cast<number>(args[2]) ||
-       !dynamic_pointer_cast<number>(args[3])) {
-        throw string("ERROR set-bit-range wants 3 argument: bitvector number number number");
-    }
+shared_ptr<lispobj> set_bit_range(const shared_ptr<bitvector>& bv,
+                                  const shared_ptr<number>& start,
+                                  const shared_ptr<number>& end,
+                                  const shared_ptr<number>& value) {
+    bv->set_bit_range(start->value(), end->value(), value->value());
+    return t_symbol;
+}
 
-    shared_ptr<bitvector> bv = dynamic_pointer_cast<bitvector>(args[0]);
-    shared_ptr<number> start = dynamic_pointer_cast<number>(args[1]);
-    shared_ptr<number> end = dynamic_pointer_cast<number>(args[2]);
-    shared_ptr<number> value = dynamic_pointer_cast<number>(args[3]);
+shared_ptr<lispobj> gc_cfunc() {
+    return make_number(collect_cycles());
+}
 
-    bv->set_bit_range(start->value(), end->value(), value->value());
-    return make_shared<symbol>("t");
+shared_ptr<lispobj> alloc_stats_cfunc() {
+    poolstats stats = get_pool_stats();
+    vector< shared_ptr<lispobj> > ret;
+    ret.push_back(intern(":allocations"));
+    ret.push_back(make_number(stats.allocations));
+    ret.push_back(intern(":bytes"));
+    ret.push_back(make_number(stats.bytes));
+    ret.push_back(intern(":slabs"));
+    ret.push_back(make_number(stats.slabs));
+    ret.push_back(intern(":slab-bytes"));
+    ret.push_back(make_number(stats.slab_bytes));
+    return make_list(ret.begin(), ret.end());
+}
+
+shared_ptr<lispobj> expansion_stats_cfunc() {
+    expansionstats stats = get_expansion_stats();
+    vector< shared_ptr<lispobj> > ret;
+    ret.push_back(intern(":expansions"));
+    ret.push_back(make_number(stats.expansions));
+    ret.push_back(intern(":cache-hits"));
+    ret.push_back(make_number(stats.cache_hits));
+    ret.push_back(intern(":cache-misses"));
+    ret.push_back(make_number(stats.cache_misses));
+    ret.push_back(intern(":macro-calls"));
+    ret.push_back(make_number(stats.macro_calls));
+    ret.push_back(intern(":microseconds"));
+    ret.push_back(make_number(stats.microseconds));
+    return make_list(ret.begin(), ret.end());
+}
+
+shared_ptr<lispobj> call_cache_stats_cfunc() {
+    callcachestats stats = get_call_cache_stats();
+    vector< shared_ptr<lispobj> > ret;
+    ret.push_back(intern(":hits"));
+    ret.push_back(make_number(stats.hits));
+    ret.push_back(intern(":misses"));
+    ret.push_back(make_number(stats.misses));
+    return make_list(ret.begin(), ret.end());
+}
+
+// (:steps (:evaluating n ...) :allocations (:cons n ...) :val-lookups n ...)
+shared_ptr<lispobj> runtime_stats_cfunc() {
+    runtimestats stats = get_runtime_stats();
+
+    vector< shared_ptr<lispobj> > steps;
+    for(int mark = 0; mark < stepper_mark_count; ++mark) {
+        steps.push_back(intern(string(":") + stepper_mark_name(mark)));
+        steps.push_back(make_number(stats.steps[mark]));
+    }
+    vector< shared_ptr<lispobj> > allocations;
+    for(int type = NIL_TYPE; type < lisp_type_count; ++type) {
+        allocations.push_back(intern(string(":") + lisp_type_tag_name(type)));
+        allocations.push_back(make_number(stats.allocations[type]));
+    }
+
+    vector< shared_ptr<lispobj> > ret;
+    ret.push_back(intern(":steps"));
+    ret.push_back(make_list(steps.begin(), steps.end()));
+    ret.push_back(intern(":allocations"));
+    ret.push_back(make_list(allocations.begin(), allocations.end()));
+    ret.push_back(intern(":val-lookups"));
+    ret.push_back(make_number(stats.val_lookups));
+    ret.push_back(intern(":val-scopes"));
+    ret.push_back(make_number(stats.val_scopes));
+    ret.push_back(intern(":longest-val-walk"));
+    ret.push_back(make_number(stats.longest_val_walk));
+    ret.push_back(intern(":fun-lookups"));
+    ret.push_back(make_number(stats.fun_lookups));
+    ret.push_back(intern(":fun-scopes"));
+    ret.push_back(make_number(stats.fun_scopes));
+    ret.push_back(intern(":longest-fun-walk"));
+    ret.push_back(make_number(stats.longest_fun_walk));
+    ret.push_back(intern(":macro-expansions"));
+    ret.push_back(make_number(get_expansion_stats().macro_calls));
+    ret.push_back(intern(":peak-stack-depth"));
+    ret.push_back(make_number(stats.peak_stack_depth));
+    ret.push_back(intern(":peak-vm-depth"));
+    ret.push_back(make_number(get_peak_vm_depth()));
+    return make_list(ret.begin(), ret.end());
+}
+
+// (profile thunk "file") calls thunk with the profiler running, writes
+// the folded stacks to file (unless it is "") and prints the top
+// functions. Returns what thunk returned.
+shared_ptr<lispobj> profile_cfunc(const shared_ptr<lispfunc>& thunk,
+                                  const shared_ptr<lispstring>& foldedfile) {
+    start_profiler();
+    shared_ptr<lispobj> ret;
+    try {
+        if(get_eval_mode() == vm_mode) {
+            ret = vm_apply(thunk, nullptr, nullptr);
+        } else {
+            ret = run_stepper(make_pooled<cons>(thunk, make_nil()), thunk->closure);
+        }
+    } catch(...) {
+        stop_profiler("", cout, 0);
+        throw;
+    }
+    stop_profiler(foldedfile->get_contents(), cout);
+    return ret;
 }
 
 shared_ptr<module> make_builtins_module(shared_ptr<lexicalscope> top_level_scope) {
-    shared_ptr<lispobj> module_name(new cons(make_shared<symbol>("builtins"),
-                                             make_shared<nil>()));
+    shared_ptr<lispobj> module_name(new cons(intern("builtins"),
+                                             make_nil()));
     shared_ptr<module> builtins_module(new module(module_name, top_level_scope));
     builtins_module->defun_and_export("+", make_shared<cfunc>(plus));
     builtins_module->defun_and_export("-", make_shared<cfunc>(minus));
@@ -2065,99 +3545,257 @@ shared_ptr<module> make_builtins_module(shared_ptr<lexicalscope> top_level_scope
     builtins_module->defun_and_export("print", make_shared<cfunc>(print_cfunc));
     builtins_module->defun_and_export("newline", make_shared<cfunc>(newline));
     builtins_module->defun_and_export("list", make_shared<cfunc>(list_cfunc));
-    builtins_module->defun_and_export("eq", make_shared<cfunc>(eq_cfunc));
-    builtins_module->defun_and_export("eqv", make_shared<cfunc>(eqv_cfunc));
-    builtins_module->defun_and_export("equal", make_shared<cfunc>(equal_cfunc));
-    builtins_module->defun_and_export("cons", make_shared<cfunc>(cons_cfunc));
+    builtins_module->defun_and_export("eq", make_cfunc("eq", eq_cfunc));
+    builtins_module->defun_and_export("eqv", make_cfunc("eqv", eqv_cfunc));
+    builtins_module->defun_and_export("equal", make_cfunc("equal", equal_cfunc));
+    builtins_module->defun_and_export("cons", make_cfunc("cons", cons_cfunc));
     builtins_module->defun_and_export("string-append", make_shared<cfunc>(string_append_cfunc));
-    builtins_module->defun_and_export("open-file", make_shared<cfunc>(open_file_cfunc));
-    builtins_module->defun_and_export("read", make_shared<cfunc>(read_cfunc));
-    builtins_module->defun_and_export("car", make_shared<cfunc>(car_cfunc));
-    builtins_module->defun_and_export("cdr", make_shared<cfunc>(cdr_cfunc));
-    builtins_module->defun_and_export("cons?", make_shared<cfunc>(consp_cfunc));
-    builtins_module->defun_and_export("bitvector", make_shared<cfunc>(bitvector_cfunc));
-    builtins_module->defun_and_export("get-bit", make_shared<cfunc>(get_bit));
-    builtins_module->defun_and_export("set-bit", make_shared<cfunc>(set_bit));
-    builtins_module->defun_and_export("set-bits", make_shared<cfunc>(set_bits));
-    builtins_module->defun_and_export("set-bit-range", make_shared<cfunc>(set_bit_range));
+    builtins_module->defun_and_export("string-length", make_cfunc("string-length", string_length_cfunc));
+    builtins_module->defun_and_export("substring", make_cfunc("substring", substring_cfunc));
+    builtins_module->defun_and_export("open-file", make_cfunc("open-file", open_file_cfunc));
+    builtins_module->defun_and_export("read", make_cfunc("read", read_cfunc));
+    builtins_module->defun_and_export("read-line", make_cfunc("read-line", read_line_cfunc));
+    builtins_module->defun_and_export("read-bytes", make_cfunc("read-bytes", read_bytes_cfunc));
+    builtins_module->defun_and_export("read-all", make_cfunc("read-all", read_all_cfunc));
+    builtins_module->defun_and_export("car", make_cfunc("car", car_cfunc));
+    builtins_module->defun_and_export("cdr", make_cfunc("cdr", cdr_cfunc));
+    builtins_module->defun_and_export("cons?", make_cfunc("cons?", consp_cfunc));
+    builtins_module->defun_and_export("bitvector", make_cfunc("bitvector", bitvector_cfunc));
+    builtins_module->defun_and_export("get-bit", make_cfunc("get-bit", get_bit));
+    builtins_module->defun_and_export("set-bit", make_cfunc("set-bit", set_bit));
+    builtins_module->defun_and_export("set-bits", make_cfunc("set-bits", set_bits));
+    builtins_module->defun_and_export("set-bit-range", make_cfunc("set-bit-range", set_bit_range));
+    builtins_module->defun_and_export("gc", make_cfunc("gc", gc_cfunc));
+    builtins_module->defun_and_export("alloc-stats", make_cfunc("alloc-stats", alloc_stats_cfunc));
+    builtins_module->defun_and_export("expansion-stats", make_cfunc("expansion-stats", expansion_stats_cfunc));
+    builtins_module->defun_and_export("call-cache-stats", make_cfunc("call-cache-stats", call_cache_stats_cfunc));
+    builtins_module->defun_and_export("runtime-stats", make_cfunc("runtime-stats", runtime_stats_cfunc));
+    builtins_module->defun_and_export("profile", make_cfunc("profile", profile_cfunc));
 
     return builtins_module;
 }
 
-bool istrue(shared_ptr<lispobj> lobj) {
-    return !dynamic_pointer_cast<nil>(lobj);
+bool istrue(const shared_ptr<lispobj>& lobj) {
+    // the reader still makes its own nils, with source locations, so
+    // compare the type rather than the pointer
+    return lobj->type() != NIL_TYPE;
+}
+
+// Expansions of source forms, so a form is expanded once even when many
+// closures are made from it. Entries hold their form weakly and are
+// dropped when any macro binding changes.
+class expansioncacheentry {
+public:
+    std::weak_ptr<lispobj> source;
+    shared_ptr<lispobj> expansion;
+};
+
+static std::unordered_map<const lispobj*, expansioncacheentry> expansion_cache;
+static size_t expansion_cache_prune_size = 4096;
+static size_t macro_generation = 0;
+static expansionstats expansion_stats = expansionstats();
+static int expansion_nesting = 0;
+
+void invalidate_macro_expansions() {
+    ++macro_generation;
+    expansion_cache.clear();
+}
+
+static void prune_expansion_cache() {
+    for(auto it = expansion_cache.begin(); it != expansion_cache.end();) {
+        if(it->second.source.expired()) {
+            it = expansion_cache.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    expansion_cache_prune_size = std::max<size_t>(4096, expansion_cache.size() * 2);
+}
+
+expansionstats get_expansion_stats() {
+    return expansion_stats;
 }
 
+// Times the outermost expansion only, since expanding a form can run
+// macros whose own bodies need expanding.
+class expansiontimer {
+public:
+    expansiontimer() :
+        start(std::chrono::steady_clock::now())
+    {
+        ++expansion_nesting;
+    }
+
+    ~expansiontimer() {
+        if(--expansion_nesting == 0) {
+            auto elapsed = std::chrono::steady_clock::now() - start;
+            expansion_stats.microseconds += std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+        }
+    }
+
+private:
+    std::chrono::steady_clock::time_point start;
+};
+
 shared_ptr<lispobj> expand_function_body(shared_ptr<lispobj> body, shared_ptr<lexicalscope> tls) {
-    vector<shared_ptr<lispobj>> expanded_code;
+    shared_ptr<lispobj> expanded_code = make_nil();
+    shared_ptr<cons> placeinlist(nullptr);
 
     while(istrue(body)) {
-        shared_ptr<cons> body_cons = dynamic_pointer_cast<cons>(body);
+        shared_ptr<cons> body_cons = lisp_cast<cons>(body);
         if(body_cons) {
-            expanded_code.push_back(expand_sexp(body_cons->car(), tls));
+            shared_ptr<cons> cell = make_pooled<cons>(expand_sexp(body_cons->car(), tls), make_nil());
+            // keep the reader's location, so stack traces can find it
+            sourcelocation location;
+            if(get_source_location(body_cons.get(), location)) {
+                set_source_location(cell.get(), location);
+            }
+
+            if(placeinlist) {
+                placeinlist->set_cdr(cell);
+            } else {
+                expanded_code = cell;
+            }
+            placeinlist = cell;
             body = body_cons->cdr();
         } else {
             throw "weird body when trying to macro expand";
         }
     }
 
-    return make_list(expanded_code.begin(), expanded_code.end());
+    return expanded_code;
 }
 
 shared_ptr<lispobj> make_quote(shared_ptr<lispobj> sexp) {
     vector<shared_ptr<lispobj>> quote_sexp;
-    quote_sexp.push_back(make_shared<symbol>("quote"));
+    quote_sexp.push_back(quote_symbol);
     quote_sexp.push_back(sexp);
     return make_list(quote_sexp.begin(), quote_sexp.end());
 }
 
-shared_ptr<lispobj> make_macro_expand(shared_ptr<lispobj> sexp) {
-    vector<shared_ptr<lispobj>> macro_expand_sexp;
-    macro_expand_sexp.push_back(make_shared<symbol>("macro-expand-1"));
-    macro_expand_sexp.push_back(make_quote(sexp));
-    return make_list(macro_expand_sexp.begin(), macro_expand_sexp.end());
+// One step of macro expansion. Returns the expansion if sexp is a call
+// to a macro, otherwise nullptr.
+shared_ptr<lispobj> macro_expand_1(shared_ptr<lispobj> sexp, shared_ptr<lexicalscope> tls) {
+    shared_ptr<cons> c = lisp_cast<cons>(sexp);
+    if(!c) {
+        return nullptr;
+    }
+
+    shared_ptr<symbol> head = lisp_cast<symbol>(c->car());
+    if(!head) {
+        return nullptr;
+    }
+
+    shared_ptr<macro> mac = lisp_cast<macro>(tls->getfun(head));
+    if(!mac) {
+        return nullptr;
+    }
+
+    ++expansion_stats.macro_calls;
+    return call_macro(mac, c->cdr());
+}
+
+// Expands the value of each (name value) binding, so that a let* body is
+// compiled without any macros left in it.
+shared_ptr<lispobj> expand_let_star_bindings(shared_ptr<lispobj> bindings, shared_ptr<lexicalscope> tls) {
+    vector<shared_ptr<lispobj>> expanded_bindings;
+
+    while(istrue(bindings)) {
+        shared_ptr<cons> bindings_cons = lisp_cast<cons>(bindings);
+        if(!bindings_cons) {
+            throw string("Invalid let binding");
+        }
+
+        shared_ptr<cons> binding = lisp_cast<cons>(bindings_cons->car());
+        shared_ptr<cons> value = binding ? lisp_cast<cons>(binding->cdr()) : nullptr;
+        if(value) {
+            expanded_bindings.push_back(make_pooled<cons>(binding->car(),
+                                                          make_pooled<cons>(expand_sexp(value->car(), tls),
+                                                                            value->cdr())));
+        } else {
+            expanded_bindings.push_back(bindings_cons->car());
+        }
+        bindings = bindings_cons->cdr();
+    }
+
+    return make_list(expanded_bindings.begin(), expanded_bindings.end());
 }
 
 shared_ptr<lispobj> expand_sexp(shared_ptr<lispobj> sexp, shared_ptr<lexicalscope> tls) {
+    if(!lisp_cast<cons>(sexp)) {
+        return sexp;
+    }
+
+    expansiontimer timer;
+    ++expansion_stats.expansions;
+
+    auto cached = expansion_cache.find(sexp.get());
+    if(cached != expansion_cache.end() && cached->second.source.lock() == sexp) {
+        ++expansion_stats.cache_hits;
+        return cached->second.expansion;
+    }
+    ++expansion_stats.cache_misses;
+
+    size_t generation = macro_generation;
+    shared_ptr<lispobj> expansion = expand_sexp_uncached(sexp, tls);
+
+    // a macro that was run while expanding may have defined another one
+    if(generation == macro_generation) {
+        if(expansion_cache.size() >= expansion_cache_prune_size) {
+            prune_expansion_cache();
+        }
+        expansioncacheentry& entry = expansion_cache[sexp.get()];
+        entry.source = sexp;
+        entry.expansion = expansion;
+    }
+
+    return expansion;
+}
+
+shared_ptr<lispobj> expand_sexp_uncached(shared_ptr<lispobj> sexp, shared_ptr<lexicalscope> tls) {
     // macro-expand it
-    shared_ptr<lispobj> new_sexp = eval(make_macro_expand(sexp), tls);
-    while(!equal(sexp, new_sexp)) {
-        sexp = new_sexp;
-        new_sexp = eval(make_macro_expand(sexp), tls);
+    shared_ptr<lispobj> new_sexp = sexp;
+    while(shared_ptr<lispobj> expanded = macro_expand_1(new_sexp, tls)) {
+        new_sexp = expanded;
     }
 
     // if new_sexp is not a cons, we fully expanded and can just return it
-    shared_ptr<cons> new_sexp_cons = dynamic_pointer_cast<cons>(new_sexp);
+    shared_ptr<cons> new_sexp_cons = lisp_cast<cons>(new_sexp);
     if(!new_sexp_cons) {
         return new_sexp;
     }
 
     // now we know that new_sexp is a cons, so we have to check to see if
     // it is a special form, and destructure it appropriately.
-    shared_ptr<symbol> sym = dynamic_pointer_cast<symbol>(new_sexp_cons->car());
+    shared_ptr<symbol> sym = lisp_cast<symbol>(new_sexp_cons->car());
     if(!sym) {
         return expand_function_body(new_sexp, tls);
     }
 
-    if(sym->name() == "if" ||
-       sym->name() == "begin" ||
-       sym->name() == "macro-expand-1") {
+    if(sym == if_symbol ||
+       sym == begin_symbol ||
+       sym == macro_expand_1_symbol) {
         return expand_function_body(new_sexp, tls);
-    } else if(sym->name() == "lambda" ||
-              sym->name() == "defun" ||
-              sym->name() == "defmacro") {
-        shared_ptr<cons> nscons_cdr = dynamic_pointer_cast<cons>(new_sexp_cons->cdr());
+    } else if(sym == lambda_symbol ||
+              sym == defun_symbol ||
+              sym == defmacro_symbol) {
+        shared_ptr<cons> nscons_cdr = lisp_cast<cons>(new_sexp_cons->cdr());
         shared_ptr<lispobj> arglist = nscons_cdr->car();
-        return make_shared<cons>(sym,
-                                 make_shared<cons>(arglist,
+        return make_pooled<cons>(sym,
+                                 make_pooled<cons>(arglist,
                                                    expand_function_body(nscons_cdr->cdr(), tls)));
-    } else if(sym->name() == "module") {
+    } else if(sym == module_symbol) {
         throw "i hate you";
-    } else if(sym->name() == "import" || sym->name() == "quote") {
-        return new_sexp;
-    } else if(sym->name() == "let*") {
-        // this is complicated, so punt for now
+    } else if(sym == import_symbol || sym == quote_symbol) {
         return new_sexp;
+    } else if(sym == let_star_symbol) {
+        shared_ptr<cons> nscons_cdr = lisp_cast<cons>(new_sexp_cons->cdr());
+        if(!nscons_cdr) {
+            return new_sexp;
+        }
+        return make_pooled<cons>(sym,
+                                 make_pooled<cons>(expand_let_star_bindings(nscons_cdr->car(), tls),
+                                                   expand_function_body(nscons_cdr->cdr(), tls)));
     } else {
         return expand_function_body(new_sexp, tls);
     }
@@ -1,18 +1,30 @@
 #pragma once
 
 #include <fstream>
+#include <functional>
 #include <ostream>
 #include <iostream>
+#include <iterator>
 #include <map>
 #include <memory>
+#include <set>
 #include <string>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include "gc.hpp"
+#include "pool.hpp"
+#include "scanner.hpp"
+
 using std::string;
 using std::shared_ptr;
 using std::vector;
 using std::ostream;
 
+// Every lispobj records its concrete type, so code that needs to know
+// it can switch on type() instead of going through RTTI.
 const int INVALID_TYPE = 0;
 const int NIL_TYPE = 1;
 const int CONS_TYPE = 2;
@@ -23,70 +35,191 @@ const int CFUNC_TYPE = 6;
 const int MODULE_TYPE = 7;
 const int STRING_TYPE = 8;
 const int FILEINPUTPORT_TYPE = 9;
+const int BITVECTOR_TYPE = 10;
+const int MACRO_TYPE = 11;
+const int FOREIGN_TYPE = 12;
+const int lisp_type_count = 13;
+
+// "cons", "symbol" etc, for reports
+const char* lisp_type_tag_name(int type);
+
+// Where the reader found an object. Locations live in a table beside the
+// objects, keyed by address, so read code is made of plain conses. The
+// file name is stored once and referred to by number.
+class sourcelocation {
+public:
+    sourcelocation();
+    sourcelocation(uint16_t file, int line, int column);
+
+    string filename() const;
+    int line() const;
+    int column() const;
+
+private:
+    uint16_t fileid;
+    uint16_t col;
+    uint32_t linenum;
+};
+
+uint16_t intern_source_name(const string& name);
 
 class lispobj {
 public:
-    lispobj();
+    explicit lispobj(int type);
     virtual ~lispobj();
 
+    int type() const { return typetag; }
+
     virtual void print(ostream& out = std::cout) = 0;
+
+private:
+    friend void set_source_location(lispobj* obj, sourcelocation location);
+
+    int typetag;
+    // set when the object has an entry in the source location table
+    bool haslocation;
 };
 
 class module;
+class bytecode;
+class symbol;
+
+// names of the slots of a lexicalscope, in slot order
+typedef vector< shared_ptr<symbol> > slotlayout;
 
-class lexicalscope {
+class lexicalscope : public gcobject {
 public:
     lexicalscope();
     lexicalscope(shared_ptr<lexicalscope> p);
+    lexicalscope(shared_ptr<lexicalscope> p, shared_ptr<const slotlayout> layout);
 
+    void defval(const shared_ptr<symbol>& name, shared_ptr<lispobj> value);
+    void defun(const shared_ptr<symbol>& name, shared_ptr<lispobj> value);
     void defval(string name, shared_ptr<lispobj> value);
     void defun(string name, shared_ptr<lispobj> value);
-    void undefval(string name);
-    void undefun(string name);
-    void setval(string name, shared_ptr<lispobj> value);
-    void setfun(string name, shared_ptr<lispobj> value);
+    void undefval(const shared_ptr<symbol>& name);
+    void undefun(const shared_ptr<symbol>& name);
+    void setval(const shared_ptr<symbol>& name, shared_ptr<lispobj> value);
+    void setfun(const shared_ptr<symbol>& name, shared_ptr<lispobj> value);
     void add_import(shared_ptr<module> mod);
     // this is honestly kind of gross
     void set_ismodulescope(bool ismodulescope);
 
+    shared_ptr<lispobj> getval(const shared_ptr<symbol>& name);
+    shared_ptr<lispobj> getfun(const shared_ptr<symbol>& name);
     shared_ptr<lispobj> getval(string name);
+    // Where getfun would find the function, or nullptr. ownscopes is how
+    // many scopes, starting at this one, belong to the running call
+    // alone. cacheable says the function is bound in a module or top
+    // level scope, or in what one imports, and the walk there only passed
+    // the call's own scopes, so the same lookup from the same code gives
+    // the same binding until definition_epoch changes.
+    const shared_ptr<lispobj>* find_fun_binding(const shared_ptr<symbol>& name, size_t ownscopes,
+                                                bool& cacheable);
     shared_ptr<lispobj> getfun(string name);
     const vector< shared_ptr<module> >& get_imports() const;
     shared_ptr<module> find_module(shared_ptr<lispobj> module_prefix);
 
+    // Compiled code resolves function arguments and let* variables to a
+    // (depth, slot) pair ahead of time, so it can skip the name lookup.
+    shared_ptr<lispobj>& getslot(int depth, int slot) {
+        lexicalscope* scope = this;
+        for(; depth > 0; --depth) {
+            scope = scope->parent.get();
+        }
+        return scope->slots[slot];
+    }
+
     void dump();
 
+    virtual void traverse(gcvisitor& visitor);
+    virtual void clear_references();
+
 private:
-    std::map<string, shared_ptr<lispobj> > valbindings;
-    std::map<string, shared_ptr<lispobj> > funbindings;
+    // heap images (image.cpp) save and restore the private state
+    friend class imagewriter;
+    friend class imagereader;
+
+    // slots are also found by name, for code that was not compiled
+    shared_ptr<const slotlayout> slotnames;
+    vector< shared_ptr<lispobj> > slots;
+
+    // keyed by symbol id
+    std::unordered_map<int, shared_ptr<lispobj> > valbindings;
+    std::unordered_map<int, shared_ptr<lispobj> > funbindings;
     std::shared_ptr<lexicalscope> parent;
     std::vector< shared_ptr<module> > imports;
 
+    // every name the imports export, by symbol id, with the first module
+    // exporting it. Built on the first lookup after any module's imports
+    // or exports change.
+    module* find_exporter(const shared_ptr<symbol>& name);
+    std::unordered_map<int, module*> exporters;
+    uint64_t exportersversion;
+
     // this is honestly kind of gross
     bool ismodulescope;
 };
 
 class nil : public lispobj {
 public:
+    static const int type_tag = NIL_TYPE;
+
     nil();
     virtual void print(ostream& out = std::cout);
 };
 
+// There is a single shared nil. Use this instead of allocating a new one.
+const shared_ptr<nil>& make_nil();
+
+// Symbols are interned: there is exactly one symbol object per name,
+// so symbols can be compared by pointer. Get them with intern().
 class symbol : public lispobj {
 public:
-    symbol(string sn);
-    string name() const;
+    static const int type_tag = SYMBOL_TYPE;
+
+    const string& name() const;
+    int id() const;
+    bool is_keyword() const;
     virtual void print(ostream& out = std::cout);
 
 private:
+    symbol(const string& sn, int id);
+    friend shared_ptr<symbol> intern(const string& name);
+
     string symname;
+    int symid;
+    bool keyword;
 };
 
+shared_ptr<symbol> intern(const string& name);
+shared_ptr<symbol> symbol_by_id(int id);
+
+// symbols the evaluator looks for
+extern const shared_ptr<symbol> nil_symbol;
+extern const shared_ptr<symbol> t_symbol;
+extern const shared_ptr<symbol> rest_symbol;
+extern const shared_ptr<symbol> if_symbol;
+extern const shared_ptr<symbol> lambda_symbol;
+extern const shared_ptr<symbol> macro_symbol;
+extern const shared_ptr<symbol> module_symbol;
+extern const shared_ptr<symbol> import_symbol;
+extern const shared_ptr<symbol> export_symbol;
+extern const shared_ptr<symbol> init_symbol;
+extern const shared_ptr<symbol> begin_symbol;
+extern const shared_ptr<symbol> defun_symbol;
+extern const shared_ptr<symbol> defmacro_symbol;
+extern const shared_ptr<symbol> quote_symbol;
+extern const shared_ptr<symbol> let_star_symbol;
+extern const shared_ptr<symbol> macro_expand_1_symbol;
+
 class cons : public lispobj {
 public:
+    static const int type_tag = CONS_TYPE;
+
     cons(shared_ptr<lispobj> a, shared_ptr<lispobj> d);
-    shared_ptr<lispobj> car() const;
-    shared_ptr<lispobj> cdr() const;
+    const shared_ptr<lispobj>& car() const;
+    const shared_ptr<lispobj>& cdr() const;
 
     void set_car(shared_ptr<lispobj> a);
     void set_cdr(shared_ptr<lispobj> d);
@@ -100,6 +233,8 @@ private:
 
 class number : public lispobj {
 public:
+    static const int type_tag = NUMBER_TYPE;
+
     number(int num);
     int value() const;
 
@@ -109,23 +244,67 @@ private:
     int num;
 };
 
+// Numbers are immutable, so small ones come from a preallocated table
+// and arithmetic on them does not allocate.
+const int small_number_min = -1024;
+const int small_number_max = 4096;
+shared_ptr<number> make_number(int num);
+
+// The characters of a string: a run of a shared buffer, or two pieces
+// joined. Pieces are never changed once made, so strings share them.
+class stringpiece {
+public:
+    stringpiece(shared_ptr<const string> t, size_t o, size_t l);
+    stringpiece(shared_ptr<stringpiece> l, shared_ptr<stringpiece> r);
+    ~stringpiece();
+
+    // set for runs
+    shared_ptr<const string> text;
+    size_t offset;
+    size_t length;
+    // set for joins
+    shared_ptr<stringpiece> left;
+    shared_ptr<stringpiece> right;
+};
+
+// A string owns its characters until a long append or substring needs
+// to share them, when they move into a piece. Appending joins pieces
+// instead of copying characters, so building a long string a bit at a
+// time is linear. The pieces are copied back into the string the first
+// time the whole string is needed as a std::string.
 class lispstring : public lispobj {
 public:
-    explicit lispstring(const string& str);
+    static const int type_tag = STRING_TYPE;
+
+    explicit lispstring(string str);
+    // the length characters of text from offset, without copying them
+    lispstring(shared_ptr<const string> text, size_t offset, size_t length);
 
     void append(shared_ptr<lispstring> lstr);
 
+    size_t size() const;
     const string& get_contents() const;
+    // short substrings are copied; longer ones share this string's
+    // buffer, after joining its pieces if need be
+    shared_ptr<lispstring> substring(size_t start, size_t end) const;
 
     virtual void print(ostream& out = std::cout);
     virtual void repr(ostream& out = std::cout);
 
 private:
-    string contents;
+    void flatten() const;
+    // the characters as a piece, moving them into one the first time
+    const shared_ptr<stringpiece>& share() const;
+
+    // the characters while pieces is null
+    mutable string text;
+    mutable shared_ptr<stringpiece> pieces;
 };
 
 class bitvector : public lispobj {
 public:
+    static const int type_tag = BITVECTOR_TYPE;
+
     explicit bitvector(int size);
     void set_bit(int position, uint8_t value);
     void set_bit_range(int start, int end, uint32_t value);
@@ -136,74 +315,169 @@ public:
     virtual void print(ostream& out = std::cout);
 
 private:
+    friend class imagewriter;
+    friend class imagereader;
+
     int size;
     vector<uint8_t> contents;
 };
 
-class lispfunc : public lispobj {
+class lispfunc : public lispobj, public gcobject {
 public:
+    static const int type_tag = FUNC_TYPE;
+
     lispfunc(shared_ptr<lispobj> _args,
              shared_ptr<lexicalscope> _closure,
              shared_ptr<lispobj> _code);
 
     virtual void print(ostream& out = std::cout);
+    virtual void traverse(gcvisitor& visitor);
+    virtual void clear_references();
 
     shared_ptr<lispobj> get_expanded_code();
+    void set_expanded_code(shared_ptr<lispobj> expanded);
+    shared_ptr<bytecode> get_compiled_code();
+    void set_compiled_code(shared_ptr<bytecode> compiled);
 
     shared_ptr<lispobj> args;
     shared_ptr<lexicalscope> closure;
     shared_ptr<lispobj> code;
+    // the name it was defun'd with, null for lambdas
+    shared_ptr<symbol> name;
 
 private:
+    friend class imagewriter;
+
     shared_ptr<lispobj> expandedcode;
+    shared_ptr<bytecode> compiledcode;
 };
 
-class macro : public lispobj {
+class macro : public lispobj, public gcobject {
 public:
+    static const int type_tag = MACRO_TYPE;
+
     macro(shared_ptr<lispobj> _args,
           shared_ptr<lexicalscope> _closure,
           shared_ptr<lispobj> _code);
 
     virtual void print(ostream& out = std::cout);
+    virtual void traverse(gcvisitor& visitor);
+    virtual void clear_references();
+
+    shared_ptr<lispobj> get_expanded_code();
+    void set_expanded_code(shared_ptr<lispobj> expanded);
+    shared_ptr<bytecode> get_compiled_code();
 
     shared_ptr<lispobj> args;
     shared_ptr<lexicalscope> closure;
     shared_ptr<lispobj> code;
+
+private:
+    friend class imagewriter;
+
+    shared_ptr<lispobj> expandedcode;
+    shared_ptr<bytecode> compiledcode;
 };
 
+// The arguments of a cfunc call. It points straight at the caller's
+// argument storage, so it is only valid for the duration of the call.
+class argspan {
+public:
+    typedef const shared_ptr<lispobj>* iterator;
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+
+    argspan(iterator first, iterator last) :
+        first(first),
+        last(last)
+    {}
+
+    size_t size() const { return last - first; }
+    bool empty() const { return first == last; }
+    const shared_ptr<lispobj>& operator[](size_t i) const { return first[i]; }
+
+    iterator begin() const { return first; }
+    iterator end() const { return last; }
+    reverse_iterator rbegin() const { return reverse_iterator(last); }
+    reverse_iterator rend() const { return reverse_iterator(first); }
+
+private:
+    iterator first;
+    iterator last;
+};
+
+typedef std::function<shared_ptr<lispobj>(argspan)> cfunctype;
+
 class cfunc : public lispobj {
 public:
-    cfunc(std::function<shared_ptr<lispobj>(vector<shared_ptr<lispobj> >)> f);
+    static const int type_tag = CFUNC_TYPE;
+
+    cfunc(cfunctype f);
 
     virtual void print(ostream& out = std::cout);
 
-    std::function<shared_ptr<lispobj>(vector<shared_ptr<lispobj> >)> func;
+    cfunctype func;
 };
 
+const size_t port_buffer_size = 1 << 16;
+
+// Reads a file through a buffer of port_buffer_size bytes. Reads return
+// exactly the bytes they got, which is fewer than asked for only at the
+// end of the file. A port on a file that couldn't be opened is empty.
 class fileinputport : public lispobj {
 public:
+    static const int type_tag = FILEINPUTPORT_TYPE;
+
     fileinputport(string fname);
+    ~fileinputport();
 
+    // up to 256 bytes, "" at the end of the file
     shared_ptr<lispobj> read();
+    // one character, "" at the end of the file
     shared_ptr<lispobj> readchar();
+    // the next line without its newline, nil at the end of the file
+    shared_ptr<lispobj> read_line();
+    // up to count bytes, "" at the end of the file
+    shared_ptr<lispobj> read_bytes(size_t count);
+    // the rest of the file, read straight into one string of its size
+    // when it is a regular file
+    shared_ptr<lispobj> read_all();
 
     virtual void print(ostream& out = std::cout);
 
 private:
+    fileinputport(const fileinputport&);
+    fileinputport& operator=(const fileinputport&);
+
+    // false at the end of the file; only called once the buffer is used up
+    bool fill();
+    // reads past the buffer into out, stopping short only at the end of
+    // the file, and returns how many bytes it read
+    size_t read_direct(char* out, size_t count);
+    // how much of the file is past what has been read, or
+    // unknown_file_size if it isn't a regular file
+    size_t unread_file_size();
+    static const size_t unknown_file_size = size_t(-1);
+
     string filename;
-    std::ifstream instream;
+    int fd;
+    vector<char> buffer;
+    // the unread part of buffer
+    size_t start;
+    size_t end;
 };
 
-class module : public lispobj {
+class module : public lispobj, public gcobject {
 public:
+    static const int type_tag = MODULE_TYPE;
+
     module(shared_ptr<lispobj> _name, shared_ptr<lexicalscope> enc_scope);
 
     shared_ptr<lispobj> eval(shared_ptr<lispobj> command);
 
     void add_import(shared_ptr<module> mod);
     void add_export(shared_ptr<symbol> sym);
-    void defval(string name, shared_ptr<lispobj> value);
-    void defun(string name, shared_ptr<lispobj> value);
+    void defval(shared_ptr<symbol> name, shared_ptr<lispobj> value);
+    void defun(shared_ptr<symbol> name, shared_ptr<lispobj> value);
     void defval_and_export(string symname, shared_ptr<lispobj> value);
     void defun_and_export(string symname, shared_ptr<lispobj> value);
     void add_init(shared_ptr<lispobj> initblock);
@@ -215,15 +489,23 @@ public:
 
     const vector< shared_ptr<lispobj> >& get_imports() const;
     const vector< shared_ptr<symbol> >& get_exports() const;
+    bool exports_symbol(const shared_ptr<symbol>& sym) const;
     const vector< shared_ptr<lispobj> >& get_initblocks() const;
 
     virtual void print(ostream& out = std::cout);
+    virtual void traverse(gcvisitor& visitor);
+    virtual void clear_references();
 
 private:
     bool ismodulecommand(shared_ptr<lispobj> command);
 
+    friend class imagewriter;
+    friend class imagereader;
+
     shared_ptr<lispobj> name;
     vector< shared_ptr<symbol> > exports;
+    // the ids of the exported symbols
+    std::unordered_set<int> exportids;
     vector< shared_ptr<lispobj> > imports;
     shared_ptr<lexicalscope> module_scope;
     vector< shared_ptr<lispobj> > defines;
@@ -231,79 +513,56 @@ private:
     bool inited;
 };
 
-template<class type>
+template<class wrapped>
 class foreignobject : public lispobj {
 public:
-    foreignobject(type* obj);
+    static const int type_tag = FOREIGN_TYPE;
 
-    type* get();
+    foreignobject(wrapped* obj);
 
-private:
-    std::unique_ptr<type> object;
-};
-
-class syntaxlocation {
-public:
-    syntaxlocation(string name, int linenum, int charnum);
-
-    string name;
-    int linenum;
-    int charnum;
-};
-
-class syntax {
-public:
-    syntax(shared_ptr<syntaxlocation> loc, shared_ptr<syntax> par);
-    virtual ~syntax();
-
-    shared_ptr<syntaxlocation> get_location();
-    shared_ptr<syntax> get_parent();
-    void set_parent(shared_ptr<syntax> p);
+    wrapped* get();
 
 private:
-    shared_ptr<syntaxlocation> location;
-    shared_ptr<syntax> parent;
+    std::unique_ptr<wrapped> object;
 };
 
-class syntaxnil : public syntax, public nil {
-public:
-    syntaxnil(shared_ptr<syntaxlocation> loc, shared_ptr<syntax> par);
-};
-
-class syntaxsymbol : public syntax, public symbol {
-public:
-    syntaxsymbol(string sn, shared_ptr<syntaxlocation> loc, shared_ptr<syntax> par);
-};
-
-class syntaxcons : public syntax, public cons {
-public:
-    syntaxcons(shared_ptr<lispobj> a,
-               shared_ptr<lispobj> d,
-               shared_ptr<syntaxlocation> loc,
-               shared_ptr<syntax> par);
-};
+// Numbers, symbols and nil are shared between uses, so the reader only
+// records locations for conses and strings. An entry is removed when its
+// object is destroyed.
+void set_source_location(lispobj* obj, sourcelocation location);
+bool get_source_location(const lispobj* obj, sourcelocation& location);
+size_t source_location_count();
+
+// dynamic_pointer_cast for lisp objects, using the type tag
+template<typename type>
+shared_ptr<type> lisp_cast(const shared_ptr<lispobj>& obj) {
+    if(obj && obj->type() == type::type_tag) {
+        return std::static_pointer_cast<type>(obj);
+    }
+    return nullptr;
+}
 
-class syntaxnumber : public syntax, public number {
-public:
-    syntaxnumber(int num, shared_ptr<syntaxlocation> loc, shared_ptr<syntax> par);
-};
+template<>
+inline shared_ptr<lispobj> lisp_cast<lispobj>(const shared_ptr<lispobj>& obj) {
+    return obj;
+}
 
-class syntaxstring : public syntax, public lispstring {
-public:
-    syntaxstring(const string& str, shared_ptr<syntaxlocation> loc, shared_ptr<syntax> par);
-};
+template<typename type>
+bool is_a(const shared_ptr<lispobj>& obj) {
+    return obj && obj->type() == type::type_tag;
+}
 
-bool eq(shared_ptr<lispobj> left, shared_ptr<lispobj> right);
-bool eqv(shared_ptr<lispobj> left, shared_ptr<lispobj> right);
-bool equal(shared_ptr<lispobj> left, shared_ptr<lispobj> right);
+bool eq(const shared_ptr<lispobj>& left, const shared_ptr<lispobj>& right);
+bool eqv(const shared_ptr<lispobj>& left, const shared_ptr<lispobj>& right);
+bool equal(const shared_ptr<lispobj>& left, const shared_ptr<lispobj>& right);
 
 template<typename input_iterator>
 shared_ptr<lispobj> make_reverse_list(input_iterator begin,
                                       input_iterator end) {
-    shared_ptr<lispobj> ret(new nil());
+    shared_ptr<lispobj> ret = make_nil();
 
     for(auto it = begin; it != end; ++it) {
-        ret.reset(new cons(*it, ret));
+        ret = make_pooled<cons>(*it, ret);
     }
 
     return ret;
@@ -312,16 +571,16 @@ shared_ptr<lispobj> make_reverse_list(input_iterator begin,
 template<typename input_iterator>
 shared_ptr<lispobj> make_list(input_iterator begin,
                               input_iterator end) {
-    shared_ptr<lispobj> ret(new nil());
+    shared_ptr<lispobj> ret = make_nil();
     shared_ptr<cons> placeinlist(nullptr);
 
     for(auto it = begin; it != end; ++it) {
-        if(std::dynamic_pointer_cast<nil>(ret)) {
-            ret.reset(new cons(*it, ret));
-            placeinlist = std::dynamic_pointer_cast<cons>(ret);
+        if(is_a<nil>(ret)) {
+            ret = make_pooled<cons>(*it, ret);
+            placeinlist = lisp_cast<cons>(ret);
         } else {
-            placeinlist->set_cdr(std::make_shared<cons>(*it, placeinlist->cdr()));
-            placeinlist = std::dynamic_pointer_cast<cons>(placeinlist->cdr());
+            placeinlist->set_cdr(make_pooled<cons>(*it, placeinlist->cdr()));
+            placeinlist = lisp_cast<cons>(placeinlist->cdr());
         }
     }
 
@@ -330,29 +589,278 @@ shared_ptr<lispobj> make_list(input_iterator begin,
 
 void printall(vector< shared_ptr<lispobj> > objs);
 
+// The bytes a reader works over. Files are memory-mapped when they can
+// be; anything else (strings, pipes) is copied into the buffer.
+class sourcebuffer {
+public:
+    explicit sourcebuffer(string contents);
+    ~sourcebuffer();
+
+    // nullptr if the file can't be opened
+    static shared_ptr<sourcebuffer> open_file(const string& filename);
+
+    const char* begin() const;
+    const char* end() const;
+    size_t size() const;
+
+private:
+    sourcebuffer();
+    sourcebuffer(const sourcebuffer&);
+    sourcebuffer& operator=(const sourcebuffer&);
+
+    string contents;
+    void* mapping;
+    size_t mappedsize;
+};
+
 class reader {
 public:
-    reader(shared_ptr<std::istream> in, string name);
-    shared_ptr<lispobj> read(shared_ptr<syntax> parent = nullptr);
+    reader(shared_ptr<sourcebuffer> in, string name);
+    // nullptr at the end of the input, or at a ')' closing an enclosing list
+    shared_ptr<lispobj> read();
     vector< shared_ptr<lispobj> > readall();
+    // like readall, but finds the tokens with scan_structure() first
+    vector< shared_ptr<lispobj> > readall_indexed();
+    // consumes the '(' starting a list, so read() returns its elements
+    bool enter_list();
+    bool at_end();
 
 private:
+    void skip_whitespace_and_comments();
+    void jump_to_next_token();
     char get_char();
-    char peek_char();
+    // skips characters that are known not to be newlines
+    void advance(size_t count);
+    [[noreturn]] void syntax_error(const string& message, int line, int col);
 
-    shared_ptr<std::istream> input;
+    shared_ptr<sourcebuffer> input;
+    const char* pos;
+    const char* end;
     string streamname;
+    uint16_t streamid;
     int linenum;
     int colnum;
+
+    // while readall_indexed() runs: the tokens after whitespace, relative
+    // to indexbase, and the next one not yet passed
+    vector<tokenstart> index;
+    const char* indexbase;
+    size_t nexttoken;
 };
 
+class moduledependency;
+
+// Every module file found at startup, by the name in its (module (name)
+// ...) header. Only the header is read up front. The rest of the file is
+// read and evaluated, and the module initialized, the first time an import
+// asks for it. With a cache directory set, the file is read from the
+// module cache when it can be (see modulecache.hpp).
+class moduleindex {
+public:
+    moduleindex(shared_ptr<lexicalscope> scope);
+
+    // false if the file doesn't start with a module form, in which case it
+    // has to be loaded some other way
+    bool add_file(const string& filename);
+    void set_cache_directory(const string& directory);
+    // loads the first module matching prefix, or nullptr if there isn't
+    // one that hasn't been loaded already. A module that fails to load is
+    // reported, returns nullptr and can be imported again later.
+    shared_ptr<module> load(shared_ptr<lispobj> prefix);
+
+    size_t loaded_count() const;
+    size_t cached_count() const;
+    double load_milliseconds() const;
+
+private:
+    class entry {
+    public:
+        shared_ptr<lispobj> name;
+        string filename;
+        bool loaded;
+        bool hashed;
+        uint64_t hash;
+    };
+
+    entry* find_entry(shared_ptr<lispobj> name);
+    // throws on a syntax error or a failed init
+    shared_ptr<module> load_entry(entry& e, shared_ptr<lispobj> prefix);
+    uint64_t source_hash(entry& e);
+    void collect_dependencies(shared_ptr<module> mod, std::set<module*>& seen,
+                              vector<moduledependency>& out);
+    bool read_cache(entry& e, vector< shared_ptr<lispobj> >& forms);
+    void write_cache(entry& e, const vector< shared_ptr<lispobj> >& forms);
+
+    shared_ptr<lexicalscope> scope;
+    vector<entry> entries;
+    string cachedir;
+    size_t cache_hits;
+    int loading_depth;
+    double loading_time;
+};
+
+// lexicalscope::find_module falls back to this index when no scope has
+// the module yet
+void set_module_index(shared_ptr<moduleindex> index);
+
+// Bumped whenever a function binding is added, replaced or removed, or a
+// scope's imports or a module's exports change, so anything remembering
+// where a function name resolved knows to look again. Never 0.
+extern uint64_t definition_epoch;
+
+// Scopes keep a table of what their imports export. Anything that changes
+// the imports or exports of a scope or module without going through
+// add_import or add_export has to call this.
+void invalidate_import_tables();
+
+// the first form in str, or nullptr if there is none
 shared_ptr<lispobj> read(string str);
 vector< shared_ptr<lispobj> > readall(string str);
+// What the repl does with a line: reads it, evaluates it in mod and
+// prints the result to out. A syntax or evaluation error is printed
+// instead, and the repl goes on.
+void read_eval_print(const string& lispstr, shared_ptr<module> mod, ostream& out = std::cout);
 
 shared_ptr<lispobj> eval(shared_ptr<lispobj> code,
                          shared_ptr<lexicalscope> tls);
+shared_ptr<lispobj> eval_stepper(shared_ptr<lispobj> code,
+                                 shared_ptr<lexicalscope> tls);
+// like eval_stepper, but errors are rethrown with the stack appended
+shared_ptr<lispobj> run_stepper(shared_ptr<lispobj> code,
+                                shared_ptr<lexicalscope> tls);
+bool is_special_form(shared_ptr<lispobj> form);
+
+// Limits the number of frames on one stepper or vm stack, so runaway
+// recursion is a lisp error instead of running out of memory.
+void set_max_stack_depth(size_t depth);
+size_t get_max_stack_depth();
+void throw_stack_depth_error();
+// stack traces show this many frames at most, from both ends
+const size_t max_printed_frames = 40;
+
+// The stepper and the vm can call each other, which recurses on the C++
+// stack. Each run holds one of these so that too much nesting is also an
+// error rather than a crash.
+const size_t max_evaluator_nesting = 2000;
+
+class evaluatorguard {
+public:
+    evaluatorguard();
+    ~evaluatorguard();
+};
+
+shared_ptr<lexicalscope> bind_lispfunc_args(shared_ptr<lispfunc> func,
+                                            const shared_ptr<lispobj>* args,
+                                            const shared_ptr<lispobj>* args_end);
+shared_ptr<lexicalscope> bind_macro_args(shared_ptr<macro> func, shared_ptr<lispobj> args);
+shared_ptr<lispobj> call_macro(shared_ptr<macro> func, shared_ptr<lispobj> args);
+shared_ptr<lispobj> eval_defun(shared_ptr<lispobj> code, shared_ptr<lexicalscope> scope);
+shared_ptr<lispobj> eval_defmacro(shared_ptr<lispobj> code, shared_ptr<lexicalscope> scope);
 shared_ptr<module> make_builtins_module(shared_ptr<lexicalscope> top_level_scope);
-bool istrue(shared_ptr<lispobj> lobj);
+
+// Names used in argument errors from make_cfunc
+template<typename type> const char* lisp_type_name() { return "object"; }
+template<> inline const char* lisp_type_name<cons>() { return "cons"; }
+template<> inline const char* lisp_type_name<symbol>() { return "symbol"; }
+template<> inline const char* lisp_type_name<number>() { return "number"; }
+template<> inline const char* lisp_type_name<lispstring>() { return "string"; }
+template<> inline const char* lisp_type_name<fileinputport>() { return "input-port"; }
+template<> inline const char* lisp_type_name<bitvector>() { return "bitvector"; }
+template<> inline const char* lisp_type_name<lispfunc>() { return "function"; }
+
+template<size_t... i> class argindices {};
+template<size_t n, size_t... i> class make_argindices : public make_argindices<n - 1, n - 1, i...> {};
+template<size_t... i> class make_argindices<0, i...> {
+public:
+    typedef argindices<i...> type;
+};
+
+template<typename... argtypes>
+string cfunc_signature(const string& name) {
+    const char* names[] = { lisp_type_name<argtypes>()..., nullptr };
+    string ret = "ERROR " + name + " wants " + std::to_string(sizeof...(argtypes)) +
+        (sizeof...(argtypes) == 1 ? " argument" : " arguments");
+    for(size_t i = 0; i < sizeof...(argtypes); ++i) {
+        ret += (i == 0 ? ": " : " ");
+        ret += names[i];
+    }
+    return ret;
+}
+
+template<typename... argtypes, size_t... i>
+shared_ptr<lispobj> call_typed_cfunc(shared_ptr<lispobj> (*f)(const shared_ptr<argtypes>&...),
+                                     const string& name,
+                                     argspan args,
+                                     argindices<i...>) {
+    if(args.size() != sizeof...(argtypes)) {
+        throw cfunc_signature<argtypes...>(name);
+    }
+
+    std::tuple< shared_ptr<argtypes>... > typed{lisp_cast<argtypes>(args[i])...};
+    bool ok[] = { (std::get<i>(typed) != nullptr)..., true };
+    for(size_t arg = 0; arg < sizeof...(argtypes); ++arg) {
+        if(!ok[arg]) {
+            throw cfunc_signature<argtypes...>(name);
+        }
+    }
+
+    return f(std::get<i>(typed)...);
+}
+
+// Wraps a function with a fixed number of typed arguments as a cfunc.
+// The argument count and types are checked before f is called.
+template<typename... argtypes>
+shared_ptr<cfunc> make_cfunc(const string& name,
+                             shared_ptr<lispobj> (*f)(const shared_ptr<argtypes>&...)) {
+    return std::make_shared<cfunc>([=](argspan args) {
+        return call_typed_cfunc(f, name, args, typename make_argindices<sizeof...(argtypes)>::type());
+    });
+}
+
+bool istrue(const shared_ptr<lispobj>& lobj);
 
 shared_ptr<lispobj> expand_function_body(shared_ptr<lispobj> body, shared_ptr<lexicalscope> tls);
 shared_ptr<lispobj> expand_sexp(shared_ptr<lispobj> sexp, shared_ptr<lexicalscope> tls);
+shared_ptr<lispobj> expand_sexp_uncached(shared_ptr<lispobj> sexp, shared_ptr<lexicalscope> tls);
+shared_ptr<lispobj> expand_let_star_bindings(shared_ptr<lispobj> bindings, shared_ptr<lexicalscope> tls);
+shared_ptr<lispobj> macro_expand_1(shared_ptr<lispobj> sexp, shared_ptr<lexicalscope> tls);
+
+// Expanded forms are cached by source form until a macro is defined or
+// redefined.
+void invalidate_macro_expansions();
+
+class expansionstats {
+public:
+    size_t expansions;
+    size_t cache_hits;
+    size_t cache_misses;
+    size_t macro_calls;
+    size_t microseconds;
+};
+
+// totals since startup
+expansionstats get_expansion_stats();
+
+// The stepper's frame marks, which index runtimestats::steps
+const int stepper_mark_count = 5;
+const char* stepper_mark_name(int mark);
+
+// Counters cheap enough to leave in release builds. Allocations are
+// counted for every thread, the rest only by the evaluating thread.
+class runtimestats {
+public:
+    size_t steps[stepper_mark_count];
+    size_t allocations[lisp_type_count];
+    // scopes visited by getval and getfun lookups, not counting calls
+    // the vm answered from a call site cache
+    size_t val_lookups;
+    size_t val_scopes;
+    size_t longest_val_walk;
+    size_t fun_lookups;
+    size_t fun_scopes;
+    size_t longest_fun_walk;
+    size_t peak_stack_depth;
+};
+
+// totals since startup
+runtimestats get_runtime_stats();
@@ -0,0 +1,141 @@
+#include <algorithm>
+
+#include "gc.hpp"
+
+static gcobject* gc_head = nullptr;
+static size_t tracked_objects = 0;
+static size_t collections = 0;
+static size_t freed_objects = 0;
+
+// collect when the number of tracked objects passes this
+static const size_t min_gc_threshold = 10000;
+static size_t gc_threshold = min_gc_threshold;
+
+gcobject::gcobject() :
+    prev(nullptr),
+    next(gc_head),
+    gcrefs(-1)
+{
+    if(gc_head) {
+        gc_head->prev = this;
+    }
+    gc_head = this;
+    ++tracked_objects;
+}
+
+gcobject::gcobject(const gcobject&) :
+    gcobject()
+{
+
+}
+
+gcobject& gcobject::operator=(const gcobject&) {
+    // the list links belong to this object, not its value
+    return *this;
+}
+
+gcobject::~gcobject() {
+    if(prev) {
+        prev->next = next;
+    } else {
+        gc_head = next;
+    }
+    if(next) {
+        next->prev = prev;
+    }
+    --tracked_objects;
+}
+
+gcvisitor::gcvisitor(phase p) :
+    current(p)
+{
+
+}
+
+bool gcvisitor::visit_object(gcobject* obj, long use_count) {
+    switch(current) {
+    case count:
+        // the first reference we see tells us the total, and every
+        // reference from a tracked object is then taken off it
+        if(obj->gcrefs < 0) {
+            obj->gcrefs = use_count;
+        }
+        --obj->gcrefs;
+        return false;
+    case mark:
+        if(obj->gcrefs == 0) {
+            obj->gcrefs = 1;
+            worklist.push_back(obj);
+        }
+        return false;
+    case hold:
+        return obj->gcrefs == 0;
+    }
+
+    return false;
+}
+
+size_t collect_cycles() {
+    for(gcobject* obj = gc_head; obj; obj = obj->next) {
+        obj->gcrefs = -1;
+    }
+
+    gcvisitor counter(gcvisitor::count);
+    for(gcobject* obj = gc_head; obj; obj = obj->next) {
+        obj->traverse(counter);
+    }
+
+    // anything with references from outside the tracked objects is
+    // alive, and so is everything it refers to
+    gcvisitor marker(gcvisitor::mark);
+    for(gcobject* obj = gc_head; obj; obj = obj->next) {
+        if(obj->gcrefs != 0) {
+            marker.worklist.push_back(obj);
+        }
+    }
+    while(!marker.worklist.empty()) {
+        gcobject* obj = marker.worklist.back();
+        marker.worklist.pop_back();
+        obj->traverse(marker);
+    }
+
+    // What is left is only referenced from inside dead cycles. Keep it
+    // all alive until every object has dropped its references, so that
+    // nothing is destroyed while we are still walking the list.
+    gcvisitor holder(gcvisitor::hold);
+    std::vector<gcobject*> dead;
+    for(gcobject* obj = gc_head; obj; obj = obj->next) {
+        if(obj->gcrefs == 0) {
+            dead.push_back(obj);
+            obj->traverse(holder);
+        }
+    }
+    for(gcobject* obj : dead) {
+        obj->clear_references();
+    }
+    holder.held.clear();
+
+    ++collections;
+    freed_objects += dead.size();
+    gc_threshold = std::max(min_gc_threshold, 2 * tracked_objects);
+
+    return dead.size();
+}
+
+void maybe_collect_cycles() {
+    if(tracked_objects > gc_threshold) {
+        collect_cycles();
+    }
+}
+
+size_t gc_tracked_objects() {
+    return tracked_objects;
+}
+
+size_t gc_collections() {
+    return collections;
+}
+
+size_t gc_freed_objects() {
+    return freed_objects;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// Lisp objects are owned by shared_ptr, which frees everything except
+// reference cycles. Closures make a lot of those: a function defined in a
+// scope is bound in that scope and also holds it as its closure. Objects
+// that can be part of such a cycle (scopes, functions, macros and modules)
+// derive from gcobject, which keeps them on a list so collect_cycles() can
+// find the groups that are only referenced from each other.
+//
+// There is no root set to maintain. A reference from anywhere else (the
+// exec stack, vm registers, the module registry, a C++ local) shows up as
+// a use_count that the tracked objects do not account for, and keeps the
+// object and everything it reaches alive.
+//
+// The object list is not locked, so only the evaluating thread may create
+// or destroy tracked objects.
+
+class gcobject;
+
+class gcvisitor {
+public:
+    enum phase {
+        count,
+        mark,
+        hold
+    };
+
+    gcvisitor(phase p);
+
+    template<typename type>
+    void visit(const std::shared_ptr<type>& ptr) {
+        gcobject* obj = dynamic_cast<gcobject*>(ptr.get());
+        if(obj && visit_object(obj, ptr.use_count())) {
+            held.push_back(ptr);
+        }
+    }
+
+    std::vector<gcobject*> worklist;
+    std::vector< std::shared_ptr<void> > held;
+
+private:
+    // returns true if ptr should be added to held
+    bool visit_object(gcobject* obj, long use_count);
+
+    phase current;
+};
+
+class gcobject {
+public:
+    gcobject();
+    gcobject(const gcobject& other);
+    gcobject& operator=(const gcobject& other);
+    virtual ~gcobject();
+
+    // calls visitor.visit() on every shared_ptr the object holds, once each
+    virtual void traverse(gcvisitor& visitor) = 0;
+    // drops the shared_ptrs the object holds, to break a dead cycle
+    virtual void clear_references() = 0;
+
+private:
+    friend class gcvisitor;
+    friend size_t collect_cycles();
+
+    gcobject* prev;
+    gcobject* next;
+    // references not accounted for by other tracked objects, or -1
+    // if no tracked object refers to this one
+    long gcrefs;
+};
+
+// Frees unreachable cycles and returns the number of tracked objects freed.
+size_t collect_cycles();
+// Runs collect_cycles() once enough tracked objects have been created
+// since the last collection.
+void maybe_collect_cycles();
+
+size_t gc_tracked_objects();
+size_t gc_collections();
+size_t gc_freed_objects();
@@ -0,0 +1,743 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+
+#include <unistd.h>
+
+#include "image.hpp"
+
+using std::make_shared;
+
+// bump whenever the format changes
+const uint32_t image_format_version = 2;
+const char image_magic[4] = {'D', 'V', 'S', 'I'};
+
+// Every record is its kind, the length of what follows, and then that.
+// Records are numbered from 1 in the order they appear; 0 is a missing
+// reference.
+enum imagerecord {
+    rec_nil,
+    rec_number,
+    rec_symbol,
+    rec_string,
+    rec_bitvector,
+    rec_cons,
+    rec_function,
+    rec_macro,
+    rec_native_function,
+    rec_native_module,
+    rec_native_scope,
+    rec_module,
+    rec_scope,
+    rec_layout
+};
+
+static string module_name_string(shared_ptr<module> mod) {
+    std::stringstream ss;
+    mod->get_name()->print(ss);
+    return ss.str();
+}
+
+class imagewriter {
+public:
+    imagewriter(const vector< shared_ptr<module> >& natives) {
+        for(size_t i = 0; i < natives.size(); ++i) {
+            nativenames.push_back(module_name_string(natives[i]));
+            nativemodules[natives[i].get()] = i;
+            nativescopes[natives[i]->get_bindings().get()] = i;
+
+            shared_ptr<lexicalscope> bindings = natives[i]->get_bindings();
+            for(auto& sym : natives[i]->get_exports()) {
+                shared_ptr<lispobj> values[] = { bindings->getfun(sym), bindings->getval(sym) };
+                for(auto& value : values) {
+                    if(is_a<cfunc>(value) && !nativefunctions.count(value.get())) {
+                        nativefunctions[value.get()] = std::make_pair(i, symbol_index(sym.get()));
+                    }
+                }
+            }
+        }
+    }
+
+    uint64_t object_id(lispobj* obj) {
+        if(!obj) {
+            return 0;
+        }
+        auto it = ids.find(obj);
+        if(it != ids.end()) {
+            return it->second;
+        }
+        pendingrecord record = { obj, nullptr, nullptr };
+        return add_pending(obj, record);
+    }
+
+    uint64_t scope_id(lexicalscope* scope) {
+        if(!scope) {
+            return 0;
+        }
+        auto it = ids.find(scope);
+        if(it != ids.end()) {
+            return it->second;
+        }
+        pendingrecord record = { nullptr, scope, nullptr };
+        return add_pending(scope, record);
+    }
+
+    uint64_t layout_id(const slotlayout* layout) {
+        if(!layout) {
+            return 0;
+        }
+        auto it = ids.find(layout);
+        if(it != ids.end()) {
+            return it->second;
+        }
+        pendingrecord record = { nullptr, nullptr, layout };
+        return add_pending(layout, record);
+    }
+
+    // Writes the records for everything found so far, and for everything
+    // they refer to. Records are added to the end of pending as they are
+    // found, so nothing recurses.
+    void write_pending() {
+        for(size_t i = written; i < pending.size(); ++i) {
+            payload.clear();
+            imagerecord kind;
+            if(pending[i].obj) {
+                kind = write_object(pending[i].obj);
+            } else if(pending[i].scope) {
+                kind = write_scope(pending[i].scope);
+            } else {
+                kind = rec_layout;
+                write_varint(payload, pending[i].layout->size());
+                for(auto& sym : *pending[i].layout) {
+                    write_varint(payload, symbol_index(sym.get()));
+                }
+            }
+
+            body.push_back(kind);
+            write_varint(body, payload.size());
+            body.append(payload);
+        }
+        written = pending.size();
+    }
+
+    void write_file(const string& filename, uint64_t topscope, uint64_t usermodule) {
+        string header(image_magic, sizeof(image_magic));
+        write_varint(header, image_format_version);
+        write_strings(header, symbolnames);
+        write_strings(header, sourcenames);
+        write_strings(header, nativenames);
+        write_varint(header, pending.size());
+        write_varint(header, topscope);
+        write_varint(header, usermodule);
+
+        // written beside it and renamed, so readers never see half a file
+        std::stringstream temppath;
+        temppath << filename << "." << getpid() << ".tmp";
+        {
+            std::ofstream out(temppath.str(), std::ios::binary);
+            out.write(header.data(), header.size());
+            out.write(body.data(), body.size());
+            if(!out) {
+                unlink(temppath.str().c_str());
+                throw string("ERROR: couldn't write image ") + filename;
+            }
+        }
+
+        if(rename(temppath.str().c_str(), filename.c_str()) != 0) {
+            unlink(temppath.str().c_str());
+            throw string("ERROR: couldn't write image ") + filename;
+        }
+    }
+
+private:
+    class pendingrecord {
+    public:
+        lispobj* obj;
+        lexicalscope* scope;
+        const slotlayout* layout;
+    };
+
+    uint64_t add_pending(const void* ptr, const pendingrecord& record) {
+        pending.push_back(record);
+        ids[ptr] = pending.size();
+        return pending.size();
+    }
+
+    imagerecord write_object(lispobj* obj) {
+        switch(obj->type()) {
+        case NIL_TYPE:
+            return rec_nil;
+        case NUMBER_TYPE: {
+            // zigzag on the unsigned bits: shifting a negative int64_t left is undefined
+            uint64_t value = static_cast<uint64_t>(int64_t(static_cast<number*>(obj)->value()));
+            write_varint(payload, (value << 1) ^ (0 - (value >> 63)));
+            return rec_number;
+        }
+        case SYMBOL_TYPE:
+            write_varint(payload, symbol_index(static_cast<symbol*>(obj)));
+            return rec_symbol;
+        case STRING_TYPE: {
+            const string& contents = static_cast<lispstring*>(obj)->get_contents();
+            write_location(obj);
+            write_varint(payload, contents.size());
+            payload.append(contents);
+            return rec_string;
+        }
+        case BITVECTOR_TYPE: {
+            bitvector* bits = static_cast<bitvector*>(obj);
+            write_varint(payload, bits->size);
+            payload.append(bits->contents.begin(), bits->contents.end());
+            return rec_bitvector;
+        }
+        case CONS_TYPE: {
+            cons* c = static_cast<cons*>(obj);
+            write_location(obj);
+            write_varint(payload, object_id(c->car().get()));
+            write_varint(payload, object_id(c->cdr().get()));
+            return rec_cons;
+        }
+        case FUNC_TYPE: {
+            lispfunc* func = static_cast<lispfunc*>(obj);
+            write_varint(payload, object_id(func->args.get()));
+            write_varint(payload, scope_id(func->closure.get()));
+            write_varint(payload, object_id(func->code.get()));
+            write_varint(payload, object_id(func->expandedcode.get()));
+            write_varint(payload, object_id(func->name.get()));
+            return rec_function;
+        }
+        case MACRO_TYPE: {
+            macro* mac = static_cast<macro*>(obj);
+            write_varint(payload, object_id(mac->args.get()));
+            write_varint(payload, scope_id(mac->closure.get()));
+            write_varint(payload, object_id(mac->code.get()));
+            write_varint(payload, object_id(mac->expandedcode.get()));
+            return rec_macro;
+        }
+        case CFUNC_TYPE: {
+            auto it = nativefunctions.find(obj);
+            if(it == nativefunctions.end()) {
+                throw string("ERROR: can't save a C++ function that no builtin module exports");
+            }
+            write_varint(payload, it->second.first);
+            write_varint(payload, it->second.second);
+            return rec_native_function;
+        }
+        case MODULE_TYPE: {
+            auto native = nativemodules.find(obj);
+            if(native != nativemodules.end()) {
+                write_varint(payload, native->second);
+                return rec_native_module;
+            }
+            return write_module(static_cast<module*>(obj));
+        }
+        default: {
+            std::stringstream errormsg;
+            errormsg << "ERROR: can't save ";
+            obj->print(errormsg);
+            errormsg << " in an image";
+            throw errormsg.str();
+        }
+        }
+    }
+
+    imagerecord write_module(module* mod) {
+        write_varint(payload, object_id(mod->name.get()));
+        write_varint(payload, scope_id(mod->module_scope.get()));
+        payload.push_back(mod->inited);
+        write_objects(mod->imports);
+        write_varint(payload, mod->exports.size());
+        for(auto& sym : mod->exports) {
+            write_varint(payload, symbol_index(sym.get()));
+        }
+        write_objects(mod->defines);
+        write_objects(mod->initblocks);
+        return rec_module;
+    }
+
+    imagerecord write_scope(lexicalscope* scope) {
+        auto native = nativescopes.find(scope);
+        if(native != nativescopes.end()) {
+            write_varint(payload, native->second);
+            return rec_native_scope;
+        }
+
+        write_varint(payload, scope_id(scope->parent.get()));
+        payload.push_back(scope->ismodulescope);
+        write_varint(payload, layout_id(scope->slotnames.get()));
+        write_objects(scope->slots);
+        write_bindings(scope->valbindings);
+        write_bindings(scope->funbindings);
+        write_varint(payload, scope->imports.size());
+        for(auto& mod : scope->imports) {
+            write_varint(payload, object_id(mod.get()));
+        }
+        return rec_scope;
+    }
+
+    template<typename objtype>
+    void write_objects(const vector< shared_ptr<objtype> >& objs) {
+        write_varint(payload, objs.size());
+        for(auto& obj : objs) {
+            write_varint(payload, object_id(obj.get()));
+        }
+    }
+
+    void write_bindings(const std::unordered_map<int, shared_ptr<lispobj> >& bindings) {
+        write_varint(payload, bindings.size());
+        for(auto& binding : bindings) {
+            write_varint(payload, symbol_index(symbol_by_id(binding.first).get()));
+            write_varint(payload, object_id(binding.second.get()));
+        }
+    }
+
+    void write_location(lispobj* obj) {
+        sourcelocation location;
+        if(!get_source_location(obj, location)) {
+            write_varint(payload, 0);
+            return;
+        }
+
+        string filename = location.filename();
+        auto it = sourceids.find(filename);
+        if(it == sourceids.end()) {
+            it = sourceids.insert(std::make_pair(filename, sourcenames.size())).first;
+            sourcenames.push_back(filename);
+        }
+        write_varint(payload, it->second + 1);
+        write_varint(payload, location.line());
+        write_varint(payload, location.column());
+    }
+
+    uint64_t symbol_index(symbol* sym) {
+        auto it = symbolids.find(sym);
+        if(it == symbolids.end()) {
+            it = symbolids.insert(std::make_pair(sym, symbolnames.size())).first;
+            symbolnames.push_back(sym->name());
+        }
+        return it->second;
+    }
+
+    void write_strings(string& out, const vector<string>& strings) {
+        write_varint(out, strings.size());
+        for(auto& str : strings) {
+            write_varint(out, str.size());
+            out.append(str);
+        }
+    }
+
+    void write_varint(string& out, uint64_t value) {
+        while(value >= 0x80) {
+            out.push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<char>(value));
+    }
+
+    std::unordered_map<const void*, uint64_t> ids;
+    vector<pendingrecord> pending;
+    size_t written = 0;
+
+    string body;
+    string payload;
+
+    std::unordered_map<symbol*, uint64_t> symbolids;
+    vector<string> symbolnames;
+    std::unordered_map<string, uint64_t> sourceids;
+    vector<string> sourcenames;
+
+    vector<string> nativenames;
+    std::unordered_map<const void*, size_t> nativemodules;
+    std::unordered_map<const void*, size_t> nativescopes;
+    // the native module exporting it, and the index of the exported name
+    std::unordered_map<const void*, std::pair<size_t, uint64_t> > nativefunctions;
+};
+
+void save_image(const string& filename,
+                shared_ptr<lexicalscope> top_level_scope,
+                const vector< shared_ptr<module> >& natives,
+                shared_ptr<module> user_module) {
+    imagewriter writer(natives);
+    uint64_t topscope = writer.scope_id(top_level_scope.get());
+    uint64_t usermodule = writer.object_id(user_module.get());
+    writer.write_pending();
+    writer.write_file(filename, topscope, usermodule);
+}
+
+// Records are read in two passes. The first makes every object, with
+// conses, functions, modules and scopes left empty, so the second can
+// fill them in whatever order they refer to each other.
+class imagereader {
+public:
+    imagereader(const char* begin, const char* end) :
+        pos(begin),
+        end(end)
+    {}
+
+    void read_header(shared_ptr<lexicalscope> top_level_scope,
+                     const vector< shared_ptr<module> >& natives) {
+        if(read_varint() != image_format_version) {
+            throw string("ERROR: image is from another version of deviser");
+        }
+
+        for(auto& name : read_strings()) {
+            symbols.push_back(intern(name));
+        }
+        for(auto& name : read_strings()) {
+            sourceids.push_back(intern_source_name(name));
+        }
+        for(auto& name : read_strings()) {
+            shared_ptr<module> found;
+            for(auto& mod : natives) {
+                if(module_name_string(mod) == name) {
+                    found = mod;
+                }
+            }
+            if(!found) {
+                throw "ERROR: image needs the native module " + name;
+            }
+            nativemodules.push_back(found);
+        }
+
+        records.resize(read_varint());
+        topscope = read_varint();
+        usermodule = read_varint();
+        if(topscope == 0 || topscope > records.size()) {
+            throw string("ERROR: image has no top level scope");
+        }
+        records[topscope - 1].scope = top_level_scope;
+    }
+
+    void make_records() {
+        for(auto& record : records) {
+            record.kind = read_byte();
+            uint64_t size = read_varint();
+            if(size > static_cast<uint64_t>(end - pos)) {
+                throw string("ERROR: image is truncated");
+            }
+            record.payload = pos;
+            const char* payloadend = pos + size;
+            make_record(record);
+            pos = payloadend;
+        }
+    }
+
+    void link_records() {
+        for(auto& record : records) {
+            pos = record.payload;
+            switch(record.kind) {
+            case rec_cons: {
+                shared_ptr<cons> c = std::static_pointer_cast<cons>(record.obj);
+                read_location(c.get());
+                c->set_car(read_object());
+                c->set_cdr(read_object());
+                break;
+            }
+            case rec_function: {
+                shared_ptr<lispfunc> func = std::static_pointer_cast<lispfunc>(record.obj);
+                func->args = read_object();
+                func->closure = read_scope();
+                func->code = read_object();
+                func->set_expanded_code(read_object());
+                func->name = lisp_cast<symbol>(read_object());
+                break;
+            }
+            case rec_macro: {
+                shared_ptr<macro> mac = std::static_pointer_cast<macro>(record.obj);
+                mac->args = read_object();
+                mac->closure = read_scope();
+                mac->code = read_object();
+                mac->set_expanded_code(read_object());
+                break;
+            }
+            case rec_module:
+                link_module(*std::static_pointer_cast<module>(record.obj));
+                break;
+            case rec_scope:
+                link_scope(*record.scope);
+                break;
+            }
+        }
+
+        // the scopes' imports were filled in directly
+        invalidate_import_tables();
+    }
+
+    shared_ptr<module> user_module() {
+        return lisp_cast<module>(record_at(usermodule).obj);
+    }
+
+private:
+    class record {
+    public:
+        uint8_t kind;
+        const char* payload;
+        shared_ptr<lispobj> obj;
+        shared_ptr<lexicalscope> scope;
+        shared_ptr<const slotlayout> layout;
+    };
+
+    void make_record(record& r) {
+        switch(r.kind) {
+        case rec_nil:
+            r.obj = make_nil();
+            break;
+        case rec_number: {
+            uint64_t encoded = read_varint();
+            int64_t value = static_cast<int64_t>(encoded >> 1) ^ -static_cast<int64_t>(encoded & 1);
+            r.obj = make_number(static_cast<int>(value));
+            break;
+        }
+        case rec_symbol:
+            r.obj = read_symbol();
+            break;
+        case rec_string: {
+            sourcelocation location;
+            bool located = read_location(location);
+            r.obj = make_shared<lispstring>(read_bytes());
+            if(located) {
+                set_source_location(r.obj.get(), location);
+            }
+            break;
+        }
+        case rec_bitvector: {
+            shared_ptr<bitvector> bits = make_shared<bitvector>(read_varint());
+            if(static_cast<size_t>(end - pos) < bits->contents.size()) {
+                throw string("ERROR: image is truncated");
+            }
+            memcpy(bits->contents.data(), pos, bits->contents.size());
+            r.obj = bits;
+            break;
+        }
+        case rec_cons:
+            r.obj = make_pooled<cons>(make_nil(), make_nil());
+            break;
+        case rec_function:
+            r.obj = shared_ptr<lispfunc>(new lispfunc(make_nil(), nullptr, make_nil()));
+            break;
+        case rec_macro:
+            r.obj = shared_ptr<macro>(new macro(make_nil(), nullptr, make_nil()));
+            break;
+        case rec_native_function: {
+            shared_ptr<module> native = read_native();
+            shared_ptr<symbol> name = read_symbol();
+            shared_ptr<lexicalscope> bindings = native->get_bindings();
+            r.obj = bindings->getfun(name);
+            if(!is_a<cfunc>(r.obj)) {
+                r.obj = bindings->getval(name);
+            }
+            if(!is_a<cfunc>(r.obj)) {
+                throw "ERROR: image needs the native function " + name->name() +
+                    ", which " + module_name_string(native) + " doesn't have";
+            }
+            break;
+        }
+        case rec_native_module:
+            r.obj = read_native();
+            break;
+        case rec_native_scope:
+            r.scope = read_native()->get_bindings();
+            break;
+        case rec_module:
+            r.obj = shared_ptr<module>(new module(make_nil(), nullptr));
+            break;
+        case rec_scope:
+            // the top level scope was made by the caller
+            if(!r.scope) {
+                r.scope = make_pooled<lexicalscope>();
+            }
+            break;
+        case rec_layout: {
+            shared_ptr<slotlayout> layout = make_shared<slotlayout>();
+            uint64_t count = read_varint();
+            for(uint64_t i = 0; i < count; ++i) {
+                layout->push_back(read_symbol());
+            }
+            r.layout = layout;
+            break;
+        }
+        default:
+            throw string("ERROR: image has a bad record");
+        }
+    }
+
+    void link_module(module& mod) {
+        mod.name = read_object();
+        mod.module_scope = read_scope();
+        mod.inited = read_byte();
+        read_objects(mod.imports);
+        uint64_t count = read_varint();
+        for(uint64_t i = 0; i < count; ++i) {
+            mod.add_export(read_symbol());
+        }
+        read_objects(mod.defines);
+        read_objects(mod.initblocks);
+    }
+
+    void link_scope(lexicalscope& scope) {
+        scope.parent = read_scope();
+        scope.ismodulescope = read_byte();
+        uint64_t layout = read_varint();
+        if(layout) {
+            scope.slotnames = record_at(layout).layout;
+        }
+        read_objects(scope.slots);
+        read_bindings(scope.valbindings);
+        read_bindings(scope.funbindings);
+
+        // replaces what the top level scope imported before
+        scope.imports.clear();
+        uint64_t count = read_varint();
+        for(uint64_t i = 0; i < count; ++i) {
+            shared_ptr<module> mod = lisp_cast<module>(read_object());
+            if(!mod) {
+                throw string("ERROR: image imports something that isn't a module");
+            }
+            scope.imports.push_back(mod);
+        }
+    }
+
+    void read_objects(vector< shared_ptr<lispobj> >& out) {
+        uint64_t count = read_varint();
+        out.clear();
+        out.reserve(count);
+        for(uint64_t i = 0; i < count; ++i) {
+            out.push_back(read_object());
+        }
+    }
+
+    void read_bindings(std::unordered_map<int, shared_ptr<lispobj> >& out) {
+        uint64_t count = read_varint();
+        out.clear();
+        for(uint64_t i = 0; i < count; ++i) {
+            int id = read_symbol()->id();
+            out[id] = read_object();
+        }
+    }
+
+    record& record_at(uint64_t id) {
+        if(id == 0 || id > records.size()) {
+            throw string("ERROR: image has a bad reference");
+        }
+        return records[id - 1];
+    }
+
+    shared_ptr<lispobj> read_object() {
+        uint64_t id = read_varint();
+        return id ? record_at(id).obj : nullptr;
+    }
+
+    shared_ptr<lexicalscope> read_scope() {
+        uint64_t id = read_varint();
+        return id ? record_at(id).scope : nullptr;
+    }
+
+    shared_ptr<symbol> read_symbol() {
+        uint64_t index = read_varint();
+        if(index >= symbols.size()) {
+            throw string("ERROR: image has a bad symbol");
+        }
+        return symbols[index];
+    }
+
+    shared_ptr<module> read_native() {
+        uint64_t index = read_varint();
+        if(index >= nativemodules.size()) {
+            throw string("ERROR: image has a bad native module");
+        }
+        return nativemodules[index];
+    }
+
+    bool read_location(sourcelocation& location) {
+        uint64_t source = read_varint();
+        if(source == 0) {
+            return false;
+        }
+        if(source > sourceids.size()) {
+            throw string("ERROR: image has a bad source file");
+        }
+        int line = read_varint();
+        int column = read_varint();
+        location = sourcelocation(sourceids[source - 1], line, column);
+        return true;
+    }
+
+    void read_location(lispobj* obj) {
+        sourcelocation location;
+        if(read_location(location)) {
+            set_source_location(obj, location);
+        }
+    }
+
+    vector<string> read_strings() {
+        vector<string> ret(read_varint());
+        for(auto& str : ret) {
+            str = read_bytes();
+        }
+        return ret;
+    }
+
+    string read_bytes() {
+        uint64_t size = read_varint();
+        if(size > static_cast<uint64_t>(end - pos)) {
+            throw string("ERROR: image is truncated");
+        }
+        string ret(pos, size);
+        pos += size;
+        return ret;
+    }
+
+    uint8_t read_byte() {
+        if(pos == end) {
+            throw string("ERROR: image is truncated");
+        }
+        return static_cast<uint8_t>(*pos++);
+    }
+
+    uint64_t read_varint() {
+        uint64_t value = 0;
+        for(int shift = 0; shift < 64; shift += 7) {
+            uint8_t byte = read_byte();
+            value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if(!(byte & 0x80)) {
+                return value;
+            }
+        }
+        throw string("ERROR: image has a bad number");
+    }
+
+    const char* pos;
+    const char* end;
+    vector<record> records;
+    uint64_t topscope;
+    uint64_t usermodule;
+
+    vector< shared_ptr<symbol> > symbols;
+    vector<uint16_t> sourceids;
+    vector< shared_ptr<module> > nativemodules;
+};
+
+shared_ptr<module> load_image(const string& filename,
+                              shared_ptr<lexicalscope> top_level_scope,
+                              const vector< shared_ptr<module> >& natives) {
+    shared_ptr<sourcebuffer> buf = sourcebuffer::open_file(filename);
+    if(!buf) {
+        throw "ERROR: couldn't open image " + filename;
+    }
+    if(buf->size() < sizeof(image_magic) ||
+       memcmp(buf->begin(), image_magic, sizeof(image_magic)) != 0) {
+        throw "ERROR: " + filename + " isn't a deviser image";
+    }
+
+    imagereader r(buf->begin() + sizeof(image_magic), buf->end());
+    r.read_header(top_level_scope, natives);
+    r.make_records();
+    r.link_records();
+
+    shared_ptr<module> ret = r.user_module();
+    if(!ret) {
+        throw string("ERROR: image has no user module");
+    }
+    return ret;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "deviser.hpp"
+
+// A heap image is everything reachable from the top level scope and the
+// user module, written to a file so a later run can start from it instead
+// of reading and evaluating the module files again.
+//
+// The modules written in C++ (builtins, console) are not saved: the loading
+// interpreter builds them as usual and passes them in, and the image
+// refers to them, and to the functions they export, by name. Everything
+// else is a record with a number, and records refer to each other by
+// number, so the file can be read from wherever it is mapped. Symbols and
+// source file names are kept in tables of names, since their ids differ
+// from run to run.
+//
+// Expanded function bodies are saved, compiled ones are not; they are
+// compiled again the first time they are called.
+
+// Throws if something can't be saved: input ports, foreign objects, and
+// C++ functions that no native module exports.
+void save_image(const string& filename,
+                shared_ptr<lexicalscope> top_level_scope,
+                const vector< shared_ptr<module> >& natives,
+                shared_ptr<module> user_module);
+
+// Fills top_level_scope, which should import the natives and nothing else
+// yet, and returns the user module. Throws if the file is damaged, from
+// another format version, or needs a native function that isn't there.
+shared_ptr<module> load_image(const string& filename,
+                              shared_ptr<lexicalscope> top_level_scope,
+                              const vector< shared_ptr<module> >& natives);
@@ -1,4 +1,5 @@
 #include <histedit.h>
+#include <memory>
 #include <string>
 
 class LineEditor {
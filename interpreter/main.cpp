@@ -1,17 +1,27 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <future>
 #include <memory>
+#include <sstream>
 #include <string>
 #include <istream>
 #include <iostream>
 #include <fstream>
+#include <thread>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fts.h>
+#include <getopt.h>
 #include <unistd.h>
 
 #include "lineeditor.hpp"
 #include "deviser.hpp"
 #include "console.hpp"
+#include "image.hpp"
+#include "profiler.hpp"
+#include "vm.hpp"
 
 using std::shared_ptr;
 using std::cout;
@@ -19,27 +29,33 @@ using std::endl;
 using std::dynamic_pointer_cast;
 using std::make_shared;
 
-void read_eval_print(const string& lispstr, shared_ptr<module> mod) {
-    //cout << "(print (eval (read \"" << lispstr << "\"))) => ";
-    auto lobj = read(lispstr);
-    //lobj->print(); cout << endl;
-    auto retlobj = mod->eval(lobj);
-    retlobj->print();
-    cout << endl;
-}
+class parsedfile {
+public:
+    parsedfile() : opened(false), milliseconds(0) {}
 
-vector< shared_ptr<lispobj> > read_file(string filename) {
-    shared_ptr<std::ifstream> infile(new std::ifstream(filename));
-    vector< shared_ptr<lispobj> > ret;
-    if(!(infile->good())) {
-        cout << "Couldn't open " << filename << endl;
-        return ret;
-    }
+    bool opened;
+    vector< shared_ptr<lispobj> > forms;
+    double milliseconds;
+};
 
-    reader r(std::static_pointer_cast<std::istream>(infile), filename);
+typedef std::chrono::steady_clock startup_clock;
+
+double milliseconds_since(startup_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(startup_clock::now() - start).count();
+}
 
-    ret = r.readall();
+parsedfile parse_file(const string& filename) {
+    startup_clock::time_point start = startup_clock::now();
+    parsedfile ret;
 
+    shared_ptr<sourcebuffer> infile = sourcebuffer::open_file(filename);
+    if(infile) {
+        ret.opened = true;
+        reader r(infile, filename);
+        ret.forms = r.readall();
+    }
+
+    ret.milliseconds = milliseconds_since(start);
     return ret;
 }
 
@@ -80,15 +96,147 @@ vector<string> find_modules(string module_path) {
     return ret;
 }
 
-vector< shared_ptr<lispobj> > eval_file(string filename, shared_ptr<lexicalscope> scope) {
-    vector< shared_ptr<lispobj> > file_forms = read_file(filename);
-    vector< shared_ptr<lispobj> > return_values;
+class startuptimes {
+public:
+    startuptimes() : scan(0), parse(0), parse_work(0), parse_wait(0), evaluate(0), threads(0) {}
+
+    double scan;
+    double parse;
+    double parse_work;
+    double parse_wait;
+    double evaluate;
+    unsigned threads;
+};
+
+// Files are read on a pool of threads while this thread evaluates them in
+// the order given, each one as soon as it has been read.
+// threads of 0 means one per core.
+void load_files(const vector<string>& filenames, shared_ptr<lexicalscope> scope,
+                unsigned threads, startuptimes& times) {
+    size_t count = filenames.size();
+    vector< std::promise<parsedfile> > parsed(count);
+    vector< std::future<parsedfile> > results;
+    for(auto& promise : parsed) {
+        results.push_back(promise.get_future());
+    }
+
+    startup_clock::time_point start = startup_clock::now();
+    std::atomic<size_t> next(0);
+    std::atomic<size_t> left(count);
+    std::atomic<int64_t> parse_done_us(0);
+
+    auto parse_files = [&]() {
+        for(size_t i = next++; i < count; i = next++) {
+            try {
+                parsed[i].set_value(parse_file(filenames[i]));
+            } catch(...) {
+                parsed[i].set_exception(std::current_exception());
+            }
+            if(--left == 0) {
+                parse_done_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                    startup_clock::now() - start).count();
+            }
+        }
+    };
+
+    if(threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = std::min<size_t>(threads, std::max<size_t>(count, 1));
+    vector<std::thread> pool;
+    for(unsigned i = 0; i < threads; ++i) {
+        pool.push_back(std::thread(parse_files));
+    }
+
+    auto stop_parsing = [&]() {
+        next = count;
+        for(auto& thread : pool) {
+            thread.join();
+        }
+    };
 
-    for(auto form : file_forms) {
-        return_values.push_back(eval(form, scope));
+    try {
+        for(size_t i = 0; i < count; ++i) {
+            startup_clock::time_point waited = startup_clock::now();
+            parsedfile file;
+            try {
+                file = results[i].get();
+            } catch(string& error) {
+                // a syntax error: the rest of the files still load
+                times.parse_wait += milliseconds_since(waited);
+                cout << "Couldn't load " << filenames[i] << ": " << error << endl;
+                continue;
+            }
+            times.parse_wait += milliseconds_since(waited);
+            times.parse_work += file.milliseconds;
+
+            if(!file.opened) {
+                cout << "Couldn't open " << filenames[i] << endl;
+                continue;
+            }
+
+            cout << "loading " << filenames[i] << endl;
+            startup_clock::time_point evaluated = startup_clock::now();
+            for(auto form : file.forms) {
+                eval(form, scope);
+            }
+            times.evaluate += milliseconds_since(evaluated);
+        }
+    } catch(...) {
+        stop_parsing();
+        throw;
     }
 
-    return return_values;
+    stop_parsing();
+    times.parse = parse_done_us / 1000.0;
+    times.threads = threads;
+}
+
+void print_startup_times(const startuptimes& times, double total) {
+    std::stringstream ss;
+    ss.setf(std::ios::fixed);
+    ss.precision(1);
+    ss << "startup: scan " << times.scan << "ms, parse " << times.parse
+       << "ms on " << times.threads << " threads (" << times.parse_work
+       << "ms of work, " << times.parse_wait << "ms waited for), evaluate "
+       << times.evaluate << "ms, total " << total << "ms";
+    cout << ss.str() << endl;
+}
+
+void print_module_times(const moduleindex& index) {
+    std::stringstream ss;
+    ss.setf(std::ios::fixed);
+    ss.precision(1);
+    ss << "modules: " << index.loaded_count() << " loaded (" << index.cached_count()
+       << " from cache) in " << index.load_milliseconds() << "ms";
+    cout << ss.str() << endl;
+}
+
+static double average(size_t total, size_t count) {
+    return count ? double(total) / count : 0.0;
+}
+
+void print_runtime_stats(const runtimestats& stats) {
+    std::stringstream ss;
+    ss.setf(std::ios::fixed);
+    ss.precision(1);
+    ss << "steps:";
+    for(int mark = 0; mark < stepper_mark_count; ++mark) {
+        ss << (mark ? ", " : " ") << stepper_mark_name(mark) << " " << stats.steps[mark];
+    }
+    ss << endl << "allocations:";
+    for(int type = NIL_TYPE; type < lisp_type_count; ++type) {
+        ss << (type > NIL_TYPE ? ", " : " ") << lisp_type_tag_name(type) << " " << stats.allocations[type];
+    }
+    ss << endl << "lookups: " << stats.val_lookups << " values walking "
+       << average(stats.val_scopes, stats.val_lookups) << " scopes (at most "
+       << stats.longest_val_walk << "), " << stats.fun_lookups << " functions walking "
+       << average(stats.fun_scopes, stats.fun_lookups) << " scopes (at most "
+       << stats.longest_fun_walk << ")";
+    ss << endl << "macro expansions " << get_expansion_stats().macro_calls
+       << ", peak stack depth " << stats.peak_stack_depth
+       << ", peak vm depth " << get_peak_vm_depth();
+    cout << ss.str() << endl;
 }
 
 int main(int argc, char** argv)
@@ -96,15 +244,62 @@ int main(int argc, char** argv)
     int ch;
     vector<string> modulesdirs{"../kernel-modules", "../compiler"};
     vector<string> statements_to_run;
+    bool show_startup_times = false;
+    bool show_runtime_stats = false;
+    unsigned parse_threads = 0;
+    string cache_directory;
+    string image_to_load;
+    string image_to_save;
+    string profile_file;
+    startup_clock::time_point startup = startup_clock::now();
+    startuptimes times;
 
-    while((ch = getopt(argc, argv, "e:hm:")) != -1) {
+    enum { save_image_option = 256, image_option, stats_option };
+    static const struct option long_options[] = {
+        {"image", required_argument, nullptr, image_option},
+        {"save-image", required_argument, nullptr, save_image_option},
+        {"profile", required_argument, nullptr, 'p'},
+        {"stats", no_argument, nullptr, stats_option},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    while((ch = getopt_long(argc, argv, "c:d:e:hj:m:p:st", long_options, nullptr)) != -1) {
         switch(ch) {
+        case image_option:
+            image_to_load = optarg;
+            break;
+        case save_image_option:
+            image_to_save = optarg;
+            break;
+        case stats_option:
+            show_runtime_stats = true;
+            break;
+        case 'c':
+            cache_directory = optarg;
+            break;
+        case 'd':
+            set_max_stack_depth(std::stoul(optarg));
+            break;
         case 'e':
             statements_to_run.push_back(optarg);
             break;
+        case 'j':
+            parse_threads = std::stoul(optarg);
+            break;
         case 'm':
             modulesdirs.push_back(optarg);
             break;
+        case 'p':
+            // folded stacks go to the file, the top functions to stdout
+            profile_file = optarg;
+            break;
+        case 's':
+            // reference mode: run everything on the old stepper
+            set_eval_mode(stepper_mode);
+            break;
+        case 't':
+            show_startup_times = true;
+            break;
         case 'h':
         default:
             usage();
@@ -114,27 +309,58 @@ int main(int argc, char** argv)
     argc -= optind;
     argv += optind;
 
-    vector<string> modules_to_load;
+    vector<string> files_to_load;
     shared_ptr<lexicalscope> top_level_scope(new lexicalscope);
 
-    for(auto directory : modulesdirs) {
-        vector<string> modules_found = find_modules(directory);
-        modules_to_load.insert(modules_to_load.end(), modules_found.begin(), modules_found.end());
-    }
-
     shared_ptr<module> builtins_module = make_builtins_module(top_level_scope);
     top_level_scope->add_import(builtins_module);
 
     shared_ptr<module> console_module = make_console_module(top_level_scope);
     top_level_scope->add_import(console_module);
 
-    shared_ptr<module> user_module(new module(make_shared<cons>(make_shared<symbol>("user"),
-                                                                make_shared<nil>()),
-                                              top_level_scope));
+    vector< shared_ptr<module> > native_modules{builtins_module, console_module};
+    shared_ptr<module> user_module;
+    if(!image_to_load.empty()) {
+        // the image already has everything load_files would load, and
+        // every module that had been imported
+        startup_clock::time_point restore = startup_clock::now();
+        try {
+            user_module = load_image(image_to_load, top_level_scope, native_modules);
+        } catch(string& error) {
+            cout << error << endl;
+            return 1;
+        }
+        times.evaluate = milliseconds_since(restore);
+    } else {
+        user_module.reset(new module(make_pooled<cons>(intern("user"), make_nil()),
+                                     top_level_scope));
+    }
+
+    // modules are loaded when something imports them; anything else is
+    // loaded now
+    startup_clock::time_point scan = startup_clock::now();
+    shared_ptr<moduleindex> index(new moduleindex(top_level_scope));
+    for(auto directory : modulesdirs) {
+        for(auto filename : find_modules(directory)) {
+            if(!index->add_file(filename) && image_to_load.empty()) {
+                files_to_load.push_back(filename);
+            }
+        }
+    }
+    if(!cache_directory.empty()) {
+        mkdir(cache_directory.c_str(), 0777);
+        index->set_cache_directory(cache_directory);
+    }
+    set_module_index(index);
+    times.scan = milliseconds_since(scan);
 
-    for(auto module_file : modules_to_load) {
-        cout << "loading " << module_file << endl;
-        eval_file(module_file, top_level_scope);
+    if(!profile_file.empty()) {
+        start_profiler();
+    }
+
+    load_files(files_to_load, top_level_scope, parse_threads, times);
+    if(show_startup_times) {
+        print_startup_times(times, milliseconds_since(startup));
     }
 
     if(!statements_to_run.empty()) {
@@ -152,5 +378,30 @@ int main(int argc, char** argv)
         cout << endl;
     }
 
+    if(!profile_file.empty()) {
+        try {
+            stop_profiler(profile_file, cout);
+        } catch(string& error) {
+            cout << error << endl;
+        }
+    }
+
+    if(show_startup_times) {
+        print_module_times(*index);
+    }
+
+    if(show_runtime_stats) {
+        print_runtime_stats(get_runtime_stats());
+    }
+
+    if(!image_to_save.empty()) {
+        try {
+            save_image(image_to_save, top_level_scope, native_modules, user_module);
+        } catch(string& error) {
+            cout << error << endl;
+            return 1;
+        }
+    }
+
     return 0;
 }
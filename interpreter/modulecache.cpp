@@ -0,0 +1,325 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+
+#include <unistd.h>
+
+#include "modulecache.hpp"
+
+using std::make_shared;
+
+// bump whenever the format, or the meaning of what's cached, changes
+const uint32_t cache_format_version = 1;
+const char cache_magic[4] = {'D', 'V', 'S', 'C'};
+
+enum cachetag {
+    tag_nil,
+    tag_cons,
+    tag_located_cons,
+    tag_symbol,
+    tag_number,
+    tag_string,
+    tag_located_string
+};
+
+// 64 bit FNV-1a
+uint64_t hash_source(const char* begin, const char* end) {
+    uint64_t hash = 14695981039346656037ULL;
+    for(const char* p = begin; p < end; ++p) {
+        hash ^= static_cast<unsigned char>(*p);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+string module_cache_path(const string& directory, uint64_t sourcehash) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.dvsc", static_cast<unsigned long long>(sourcehash));
+    return directory + "/" + name;
+}
+
+class cachewriter {
+public:
+    // false if obj holds something that can't be written
+    bool write_object(lispobj* obj) {
+        // the cdrs of a list are written in a loop, so long lists don't
+        // recurse deeply
+        while(obj->type() == CONS_TYPE) {
+            cons* c = static_cast<cons*>(obj);
+            write_location(obj, tag_cons, tag_located_cons);
+            if(!write_object(c->car().get())) {
+                return false;
+            }
+            obj = c->cdr().get();
+        }
+
+        switch(obj->type()) {
+        case NIL_TYPE:
+            body.push_back(tag_nil);
+            return true;
+        case SYMBOL_TYPE: {
+            symbol* sym = static_cast<symbol*>(obj);
+            auto it = symbolids.find(sym);
+            if(it == symbolids.end()) {
+                it = symbolids.insert(std::make_pair(sym, symbolnames.size())).first;
+                symbolnames.push_back(sym->name());
+            }
+            body.push_back(tag_symbol);
+            write_varint(body, it->second);
+            return true;
+        }
+        case NUMBER_TYPE: {
+            // zigzag on the unsigned bits: shifting a negative int64_t left is undefined
+            uint64_t value = static_cast<uint64_t>(int64_t(static_cast<number*>(obj)->value()));
+            body.push_back(tag_number);
+            write_varint(body, (value << 1) ^ (0 - (value >> 63)));
+            return true;
+        }
+        case STRING_TYPE: {
+            const string& contents = static_cast<lispstring*>(obj)->get_contents();
+            write_location(obj, tag_string, tag_located_string);
+            write_varint(body, contents.size());
+            body.append(contents);
+            return true;
+        }
+        default:
+            return false;
+        }
+    }
+
+    void write_uint64(string& out, uint64_t value) {
+        for(int i = 0; i < 8; ++i) {
+            out.push_back(static_cast<char>(value >> (8 * i)));
+        }
+    }
+
+    void write_varint(string& out, uint64_t value) {
+        while(value >= 0x80) {
+            out.push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<char>(value));
+    }
+
+    void write_location(lispobj* obj, cachetag plain, cachetag located) {
+        sourcelocation location;
+        if(get_source_location(obj, location)) {
+            body.push_back(located);
+            write_varint(body, location.line());
+            write_varint(body, location.column());
+        } else {
+            body.push_back(plain);
+        }
+    }
+
+    string body;
+    std::unordered_map<symbol*, uint64_t> symbolids;
+    vector<string> symbolnames;
+};
+
+bool write_module_cache(const string& path, const cachedmodule& cached) {
+    cachewriter writer;
+
+    writer.write_varint(writer.body, cached.dependencies.size());
+    for(auto& dependency : cached.dependencies) {
+        if(!writer.write_object(dependency.name.get())) {
+            return false;
+        }
+        writer.write_uint64(writer.body, dependency.hash);
+    }
+
+    writer.write_varint(writer.body, cached.forms.size());
+    for(auto& form : cached.forms) {
+        if(!writer.write_object(form.get())) {
+            return false;
+        }
+    }
+
+    string header(cache_magic, sizeof(cache_magic));
+    writer.write_varint(header, cache_format_version);
+    writer.write_uint64(header, cached.sourcehash);
+    writer.write_varint(header, writer.symbolnames.size());
+    for(auto& name : writer.symbolnames) {
+        writer.write_varint(header, name.size());
+        header.append(name);
+    }
+
+    // written beside it and renamed, so readers never see half a file
+    std::stringstream temppath;
+    temppath << path << "." << getpid() << ".tmp";
+    {
+        std::ofstream out(temppath.str(), std::ios::binary);
+        out.write(header.data(), header.size());
+        out.write(writer.body.data(), writer.body.size());
+        if(!out) {
+            unlink(temppath.str().c_str());
+            return false;
+        }
+    }
+
+    if(rename(temppath.str().c_str(), path.c_str()) != 0) {
+        unlink(temppath.str().c_str());
+        return false;
+    }
+    return true;
+}
+
+// Reading throws on damaged input; read_module_cache turns that into false.
+class cachereader {
+public:
+    cachereader(const char* begin, const char* end, uint16_t fileid) :
+        pos(begin),
+        end(end),
+        fileid(fileid)
+    {}
+
+    uint8_t read_byte() {
+        if(pos == end) {
+            throw string("module cache is truncated");
+        }
+        return static_cast<uint8_t>(*pos++);
+    }
+
+    uint64_t read_uint64() {
+        uint64_t value = 0;
+        for(int i = 0; i < 8; ++i) {
+            value |= static_cast<uint64_t>(read_byte()) << (8 * i);
+        }
+        return value;
+    }
+
+    uint64_t read_varint() {
+        uint64_t value = 0;
+        for(int shift = 0; shift < 64; shift += 7) {
+            uint8_t byte = read_byte();
+            value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if(!(byte & 0x80)) {
+                return value;
+            }
+        }
+        throw string("module cache has a bad number");
+    }
+
+    string read_bytes() {
+        uint64_t size = read_varint();
+        if(size > static_cast<uint64_t>(end - pos)) {
+            throw string("module cache is truncated");
+        }
+        string ret(pos, size);
+        pos += size;
+        return ret;
+    }
+
+    void read_location(lispobj* obj) {
+        int line = read_varint();
+        int column = read_varint();
+        set_source_location(obj, sourcelocation(fileid, line, column));
+    }
+
+    shared_ptr<lispobj> read_object() {
+        uint8_t tag = read_byte();
+        if(tag != tag_cons && tag != tag_located_cons) {
+            return read_atom(tag);
+        }
+
+        shared_ptr<cons> head;
+        cons* last = nullptr;
+        while(tag == tag_cons || tag == tag_located_cons) {
+            shared_ptr<cons> cell = make_pooled<cons>(make_nil(), make_nil());
+            if(tag == tag_located_cons) {
+                read_location(cell.get());
+            }
+            cell->set_car(read_object());
+
+            if(last) {
+                last->set_cdr(cell);
+            } else {
+                head = cell;
+            }
+            last = cell.get();
+            tag = read_byte();
+        }
+
+        last->set_cdr(read_atom(tag));
+        return head;
+    }
+
+    shared_ptr<lispobj> read_atom(uint8_t tag) {
+        switch(tag) {
+        case tag_nil:
+            return make_nil();
+        case tag_symbol: {
+            uint64_t id = read_varint();
+            if(id >= symbols.size()) {
+                throw string("module cache has a bad symbol");
+            }
+            return symbols[id];
+        }
+        case tag_number: {
+            uint64_t encoded = read_varint();
+            int64_t value = static_cast<int64_t>(encoded >> 1) ^ -static_cast<int64_t>(encoded & 1);
+            return make_number(static_cast<int>(value));
+        }
+        case tag_string:
+        case tag_located_string: {
+            bool located = tag == tag_located_string;
+            int line = located ? read_varint() : 0;
+            int column = located ? read_varint() : 0;
+            shared_ptr<lispstring> str = make_shared<lispstring>(read_bytes());
+            if(located) {
+                set_source_location(str.get(), sourcelocation(fileid, line, column));
+            }
+            return str;
+        }
+        default:
+            throw string("module cache has a bad tag");
+        }
+    }
+
+    const char* pos;
+    const char* end;
+    uint16_t fileid;
+    vector< shared_ptr<symbol> > symbols;
+};
+
+bool read_module_cache(const string& path, const string& sourcename, cachedmodule& out) {
+    shared_ptr<sourcebuffer> buf = sourcebuffer::open_file(path);
+    if(!buf || buf->size() < sizeof(cache_magic) ||
+       memcmp(buf->begin(), cache_magic, sizeof(cache_magic)) != 0) {
+        return false;
+    }
+
+    cachereader r(buf->begin() + sizeof(cache_magic), buf->end(), intern_source_name(sourcename));
+    try {
+        if(r.read_varint() != cache_format_version) {
+            return false;
+        }
+        out.sourcehash = r.read_uint64();
+
+        uint64_t symbolcount = r.read_varint();
+        for(uint64_t i = 0; i < symbolcount; ++i) {
+            r.symbols.push_back(intern(r.read_bytes()));
+        }
+
+        uint64_t dependencycount = r.read_varint();
+        out.dependencies.clear();
+        for(uint64_t i = 0; i < dependencycount; ++i) {
+            moduledependency dependency;
+            dependency.name = r.read_object();
+            dependency.hash = r.read_uint64();
+            out.dependencies.push_back(dependency);
+        }
+
+        uint64_t formcount = r.read_varint();
+        out.forms.clear();
+        for(uint64_t i = 0; i < formcount; ++i) {
+            out.forms.push_back(r.read_object());
+        }
+    } catch(string&) {
+        return false;
+    }
+
+    return true;
+}
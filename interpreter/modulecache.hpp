@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "deviser.hpp"
+
+// Module files can be cached on disk after they have been loaded once,
+// with their function and macro bodies already macro expanded. The cache
+// file is named after a hash of the source, and lists every module the
+// source imported (directly or not) with the hash of its source, so a
+// change to any of them makes the cache stale.
+//
+// Objects are written as a tree in a small binary format: symbols by
+// index into a table of names, numbers and lengths as varints, and conses
+// and strings with their line and column.
+
+uint64_t hash_source(const char* begin, const char* end);
+
+class moduledependency {
+public:
+    shared_ptr<lispobj> name;
+    uint64_t hash;
+};
+
+class cachedmodule {
+public:
+    uint64_t sourcehash;
+    vector<moduledependency> dependencies;
+    vector< shared_ptr<lispobj> > forms;
+};
+
+string module_cache_path(const string& directory, uint64_t sourcehash);
+// false if the file is missing, damaged or from another format version;
+// locations in the forms are given sourcename
+bool read_module_cache(const string& path, const string& sourcename, cachedmodule& out);
+// false if it can't be written, including when a form holds something
+// other than conses, symbols, numbers and strings
+bool write_module_cache(const string& path, const cachedmodule& cached);
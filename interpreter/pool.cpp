@@ -0,0 +1,136 @@
+#include <atomic>
+#include <mutex>
+#include <set>
+
+#include "pool.hpp"
+
+const size_t pool_size_classes = pool_max_block_size / pool_block_align;
+
+class freeblock {
+public:
+    freeblock* next;
+};
+
+// Each thread counts its own allocations, so the fast path doesn't share
+// a cache line with other threads. Only the owning thread writes them;
+// they are atomic so get_pool_stats can read them from another thread.
+class poolcounts {
+public:
+    std::atomic<size_t> allocations;
+    std::atomic<size_t> bytes;
+};
+
+static std::atomic<size_t> slabs(0);
+static std::atomic<size_t> slab_bytes(0);
+
+// free lists left behind by threads that have exited
+static std::mutex orphan_mutex;
+static freeblock* orphans[pool_size_classes];
+// the counts of running threads, and the totals of those that exited
+static std::set<poolcounts*> thread_counts;
+static size_t exited_allocations = 0;
+static size_t exited_bytes = 0;
+
+static size_t size_class(size_t size) {
+    return (size + pool_block_align - 1) / pool_block_align - 1;
+}
+
+// Plain arrays, so the fast path needs no thread_local initialization
+// check. They stay usable while other thread_locals are being destroyed.
+static thread_local freeblock* free_lists[pool_size_classes];
+static thread_local poolcounts counts;
+
+static void count(std::atomic<size_t>& counter, size_t n) {
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+class orphaner {
+public:
+    orphaner() {
+        std::lock_guard<std::mutex> lock(orphan_mutex);
+        thread_counts.insert(&counts);
+    }
+
+    // first use in a thread registers the constructor and destructor
+    void arm() {}
+
+    ~orphaner() {
+        std::lock_guard<std::mutex> lock(orphan_mutex);
+        thread_counts.erase(&counts);
+        exited_allocations += counts.allocations.load(std::memory_order_relaxed);
+        exited_bytes += counts.bytes.load(std::memory_order_relaxed);
+        for(size_t i = 0; i < pool_size_classes; ++i) {
+            while(free_lists[i]) {
+                freeblock* block = free_lists[i];
+                free_lists[i] = block->next;
+                block->next = orphans[i];
+                orphans[i] = block;
+            }
+        }
+    }
+};
+
+static thread_local orphaner thread_exit;
+
+static void refill(size_t sc) {
+    thread_exit.arm();
+
+    {
+        std::lock_guard<std::mutex> lock(orphan_mutex);
+        if(orphans[sc]) {
+            free_lists[sc] = orphans[sc];
+            orphans[sc] = nullptr;
+            return;
+        }
+    }
+
+    size_t block_size = (sc + 1) * pool_block_align;
+    char* slab = static_cast<char*>(::operator new(pool_slab_size));
+    slabs.fetch_add(1, std::memory_order_relaxed);
+    slab_bytes.fetch_add(pool_slab_size, std::memory_order_relaxed);
+
+    // thread the blocks together back to front, so they are handed out
+    // in address order
+    for(size_t offset = pool_slab_size / block_size * block_size; offset > 0; offset -= block_size) {
+        freeblock* block = reinterpret_cast<freeblock*>(slab + offset - block_size);
+        block->next = free_lists[sc];
+        free_lists[sc] = block;
+    }
+}
+
+void* pool_allocate(size_t size) {
+    size_t sc = size_class(size);
+    if(!free_lists[sc]) {
+        refill(sc);
+    }
+
+    freeblock* block = free_lists[sc];
+    free_lists[sc] = block->next;
+
+    count(counts.allocations, 1);
+    count(counts.bytes, (sc + 1) * pool_block_align);
+    return block;
+}
+
+void pool_deallocate(void* p, size_t size) {
+    size_t sc = size_class(size);
+    freeblock* block = static_cast<freeblock*>(p);
+    block->next = free_lists[sc];
+    free_lists[sc] = block;
+}
+
+poolstats get_pool_stats() {
+    poolstats stats;
+    {
+        std::lock_guard<std::mutex> lock(orphan_mutex);
+        stats.allocations = exited_allocations;
+        stats.bytes = exited_bytes;
+        for(poolcounts* c : thread_counts) {
+            stats.allocations += c->allocations.load(std::memory_order_relaxed);
+            stats.bytes += c->bytes.load(std::memory_order_relaxed);
+        }
+    }
+    stats.slabs = slabs.load(std::memory_order_relaxed);
+    stats.slab_bytes = slab_bytes.load(std::memory_order_relaxed);
+    return stats;
+}
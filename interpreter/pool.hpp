@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+
+// Small fixed size objects (cons cells, scopes, reader syntax objects) are
+// allocated from large slabs instead of one operator new each. Blocks are
+// grouped by size, and each thread has its own free list for every size,
+// so allocating is a pop and freeing is a push. Slabs are never returned
+// to the system; a thread that exits hands its free blocks to the next
+// thread that runs out.
+
+const size_t pool_block_align = 16;
+const size_t pool_max_block_size = 256;
+const size_t pool_slab_size = 64 * 1024;
+
+void* pool_allocate(size_t size);
+void pool_deallocate(void* block, size_t size);
+
+class poolstats {
+public:
+    size_t allocations;
+    size_t bytes;
+    size_t slabs;
+    size_t slab_bytes;
+};
+
+// totals for all threads since startup
+poolstats get_pool_stats();
+
+// For allocate_shared, which puts the object and its reference counts in
+// one block.
+template<typename type>
+class poolallocator {
+public:
+    typedef type value_type;
+
+    poolallocator() noexcept {}
+
+    template<typename other>
+    poolallocator(const poolallocator<other>&) noexcept {}
+
+    type* allocate(size_t n) {
+        if(n != 1 || sizeof(type) > pool_max_block_size || alignof(type) > pool_block_align) {
+            return static_cast<type*>(::operator new(n * sizeof(type)));
+        }
+        return static_cast<type*>(pool_allocate(sizeof(type)));
+    }
+
+    void deallocate(type* p, size_t n) {
+        if(n != 1 || sizeof(type) > pool_max_block_size || alignof(type) > pool_block_align) {
+            ::operator delete(p);
+            return;
+        }
+        pool_deallocate(p, sizeof(type));
+    }
+};
+
+template<typename left, typename right>
+bool operator==(const poolallocator<left>&, const poolallocator<right>&) {
+    return true;
+}
+
+template<typename left, typename right>
+bool operator!=(const poolallocator<left>&, const poolallocator<right>&) {
+    return false;
+}
+
+// make_shared, but from the pool
+template<typename type, typename... argtypes>
+std::shared_ptr<type> make_pooled(argtypes&&... args) {
+    return std::allocate_shared<type>(poolallocator<type>(), std::forward<argtypes>(args)...);
+}
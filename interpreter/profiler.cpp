@@ -0,0 +1,273 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <unordered_map>
+
+#include <sys/time.h>
+
+#include "profiler.hpp"
+#include "vm.hpp"
+
+using std::endl;
+
+volatile sig_atomic_t profile_sample_due = 0;
+
+// A node per distinct stack prefix, keyed by the function of its last
+// frame. samples counts the samples whose innermost frame was this node.
+class profilenode {
+public:
+    profilenode() :
+        samples(0)
+    {}
+
+    size_t samples;
+    std::unordered_map<const void*, std::unique_ptr<profilenode> > children;
+};
+
+class profiledfunction {
+public:
+    // keeps the address used as the key from being reused by another
+    // function while the profile lasts
+    shared_ptr<void> owner;
+    string label;
+};
+
+static bool running = false;
+static int sample_interval_us = default_profile_interval_us;
+static profiledstack* innermost_stack = nullptr;
+
+static profilenode root;
+static std::unordered_map<const void*, profiledfunction> functions;
+static size_t total_samples = 0;
+
+profiledstack::profiledstack(profilecollector c, const void* s) :
+    collector(c),
+    stack(s),
+    outer(innermost_stack),
+    linked(running)
+{
+    if(linked) {
+        innermost_stack = this;
+    }
+}
+
+profiledstack::~profiledstack() {
+    if(linked) {
+        innermost_stack = outer;
+    }
+}
+
+// name and file:line of the function; a vm frame without a name is a
+// lambda if it has parameters, or top level code being run
+static profiledfunction describe(const profileframe& frame) {
+    profiledfunction ret;
+    std::stringstream label;
+    shared_ptr<lispobj> source;
+
+    if(frame.func) {
+        ret.owner = frame.func;
+        label << (frame.func->name ? frame.func->name->name() : string("lambda"));
+        source = frame.func->get_expanded_code();
+    } else {
+        ret.owner = frame.code;
+        if(frame.code->name) {
+            label << frame.code->name->name();
+        } else {
+            label << (frame.code->params ? "lambda" : "toplevel");
+        }
+        source = frame.code->source;
+    }
+
+    sourcelocation location;
+    if(source && get_source_location(source.get(), location)) {
+        label << " " << location.filename() << ":" << location.line();
+    }
+
+    ret.label = label.str();
+    // ; separates frames in the folded output
+    std::replace(ret.label.begin(), ret.label.end(), ';', ',');
+    return ret;
+}
+
+void take_profile_sample() {
+    profile_sample_due = 0;
+    if(!running) {
+        return;
+    }
+
+    vector<const profiledstack*> stacks;
+    for(const profiledstack* s = innermost_stack; s; s = s->outer) {
+        stacks.push_back(s);
+    }
+
+    vector<profileframe> frames;
+    for(auto s = stacks.rbegin(); s != stacks.rend(); ++s) {
+        (*s)->collector((*s)->stack, frames);
+    }
+    if(frames.empty()) {
+        return;
+    }
+
+    profilenode* node = &root;
+    for(const profileframe& frame : frames) {
+        const void* key = frame.func ? static_cast<const void*>(frame.func.get()) : frame.code.get();
+        if(functions.find(key) == functions.end()) {
+            functions[key] = describe(frame);
+        }
+
+        std::unique_ptr<profilenode>& child = node->children[key];
+        if(!child) {
+            child.reset(new profilenode);
+        }
+        node = child.get();
+    }
+
+    ++node->samples;
+    ++total_samples;
+}
+
+static void on_sigprof(int) {
+    profile_sample_due = 1;
+}
+
+static void set_timer(int interval_us) {
+    struct itimerval timer;
+    timer.it_interval.tv_sec = interval_us / 1000000;
+    timer.it_interval.tv_usec = interval_us % 1000000;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, nullptr);
+}
+
+void start_profiler(int interval_us) {
+    if(running) {
+        throw string("ERROR: the profiler is already running");
+    }
+    if(interval_us <= 0) {
+        throw string("ERROR: profile interval must be positive");
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_sigprof;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, nullptr);
+
+    root.children.clear();
+    root.samples = 0;
+    functions.clear();
+    total_samples = 0;
+    sample_interval_us = interval_us;
+    profile_sample_due = 0;
+    running = true;
+
+    set_timer(interval_us);
+}
+
+bool profiler_running() {
+    return running;
+}
+
+class functiontimes {
+public:
+    functiontimes() :
+        self(0),
+        total(0),
+        active(0)
+    {}
+
+    size_t self;
+    size_t total;
+    // how many times it is on the stack being walked, so a recursive
+    // function's total counts each sample once
+    int active;
+};
+
+// returns the samples in node and below
+static size_t report_node(const profilenode& node,
+                          vector<const string*>& path,
+                          std::unordered_map<string, functiontimes>& times,
+                          ostream& folded) {
+    size_t subtotal = node.samples;
+    if(node.samples && !path.empty()) {
+        for(size_t i = 0; i < path.size(); ++i) {
+            folded << (i ? ";" : "") << *path[i];
+        }
+        folded << " " << node.samples << "\n";
+        times[*path.back()].self += node.samples;
+    }
+
+    for(const auto& child : node.children) {
+        const string& label = functions[child.first].label;
+        functiontimes& t = times[label];
+        ++t.active;
+        path.push_back(&label);
+
+        size_t below = report_node(*child.second, path, times, folded);
+
+        path.pop_back();
+        if(--times[label].active == 0) {
+            times[label].total += below;
+        }
+        subtotal += below;
+    }
+
+    return subtotal;
+}
+
+static string percent(size_t samples) {
+    std::stringstream out;
+    out << std::fixed << std::setprecision(1)
+        << (total_samples ? 100.0 * samples / total_samples : 0.0) << "%";
+    return out.str();
+}
+
+void stop_profiler(const string& foldedfile, ostream& out, size_t top) {
+    if(!running) {
+        throw string("ERROR: the profiler is not running");
+    }
+
+    set_timer(0);
+    running = false;
+    profile_sample_due = 0;
+
+    std::stringstream folded;
+    std::unordered_map<string, functiontimes> times;
+    vector<const string*> path;
+    report_node(root, path, times, folded);
+
+    if(!foldedfile.empty()) {
+        std::ofstream file(foldedfile);
+        file << folded.str();
+        if(!file) {
+            throw string("ERROR: couldn't write profile to ") + foldedfile;
+        }
+    }
+
+    vector< std::pair<string, functiontimes> > sorted(times.begin(), times.end());
+    std::sort(sorted.begin(), sorted.end(),
+              [](const std::pair<string, functiontimes>& a,
+                 const std::pair<string, functiontimes>& b) {
+                  if(a.second.self != b.second.self) {
+                      return a.second.self > b.second.self;
+                  }
+                  if(a.second.total != b.second.total) {
+                      return a.second.total > b.second.total;
+                  }
+                  return a.first < b.first;
+              });
+
+    out << "profile: " << total_samples << " samples, "
+        << sample_interval_us << "us apart" << endl;
+    out << std::setw(8) << "self" << std::setw(8) << "total" << "  function" << endl;
+    for(size_t i = 0; i < sorted.size() && i < top; ++i) {
+        out << std::setw(8) << percent(sorted[i].second.self)
+            << std::setw(8) << percent(sorted[i].second.total)
+            << "  " << sorted[i].first << endl;
+    }
+
+    root.children.clear();
+    functions.clear();
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <csignal>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "deviser.hpp"
+
+class bytecode;
+
+// A sampling profiler for lisp code. While it runs, a SIGPROF timer marks
+// a sample as due every interval of cpu time, and the evaluators take the
+// sample at the next function call (the vm) or step (the stepper) by
+// walking the stacks of every evaluator that is running. Outside of a
+// profile, this costs the evaluators one load and compare per call.
+//
+// Samples are reported as folded stacks, one "outer;inner;innermost count"
+// line per distinct stack, which flamegraph.pl and speedscope read, and as
+// a table of the functions with the most self and total time.
+
+extern volatile sig_atomic_t profile_sample_due;
+
+// One lisp function on an evaluator stack: a vm frame gives its bytecode,
+// a stepper frame the function being applied.
+class profileframe {
+public:
+    shared_ptr<bytecode> code;
+    shared_ptr<lispfunc> func;
+};
+
+// Appends the frames of stack to frames, outermost first.
+typedef void (*profilecollector)(const void* stack, vector<profileframe>& frames);
+
+// Registers an evaluator's stack for as long as the evaluator runs, if
+// the profiler is running when it starts.
+class profiledstack {
+public:
+    profiledstack(profilecollector c, const void* s);
+    ~profiledstack();
+
+    profilecollector collector;
+    const void* stack;
+    profiledstack* outer;
+    bool linked;
+};
+
+void take_profile_sample();
+
+const int default_profile_interval_us = 1000;
+const size_t default_profile_top = 20;
+
+// Throws if the profiler is already running.
+void start_profiler(int interval_us = default_profile_interval_us);
+
+// Stops the timer, writes the folded stacks to foldedfile unless it is
+// empty, and prints the top functions to out.
+void stop_profiler(const string& foldedfile, ostream& out, size_t top = default_profile_top);
+
+bool profiler_running();
@@ -0,0 +1,245 @@
+#include <cstring>
+#include <limits>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "scanner.hpp"
+
+const size_t scan_block_size = 64;
+
+class blockmasks {
+public:
+    uint64_t space;
+    uint64_t quote;
+    uint64_t backslash;
+    uint64_t semicolon;
+    uint64_t newline;
+    uint64_t paren;
+};
+
+#if defined(__AVX2__)
+
+static inline uint64_t match_bytes(__m256i lo, __m256i hi, char c) {
+    __m256i needle = _mm256_set1_epi8(c);
+    uint32_t low = _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, needle));
+    uint32_t high = _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, needle));
+    return static_cast<uint64_t>(high) << 32 | low;
+}
+
+// ' ' and '\t' through '\r'; signed compares leave bytes over 127 out
+static inline uint32_t space_bytes(__m256i chunk) {
+    __m256i controls = _mm256_and_si256(_mm256_cmpgt_epi8(chunk, _mm256_set1_epi8(8)),
+                                        _mm256_cmpgt_epi8(_mm256_set1_epi8(14), chunk));
+    __m256i spaces = _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(' '));
+    return _mm256_movemask_epi8(_mm256_or_si256(controls, spaces));
+}
+
+static void classify_block(const char* block, blockmasks& masks) {
+    __m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block));
+    __m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + 32));
+
+    masks.space = static_cast<uint64_t>(space_bytes(hi)) << 32 | space_bytes(lo);
+    masks.quote = match_bytes(lo, hi, '"');
+    masks.backslash = match_bytes(lo, hi, '\\');
+    masks.semicolon = match_bytes(lo, hi, ';');
+    masks.newline = match_bytes(lo, hi, '\n');
+    masks.paren = match_bytes(lo, hi, '(') | match_bytes(lo, hi, ')');
+}
+
+#elif defined(__SSE2__)
+
+static inline uint64_t match_bytes(const __m128i* chunks, char c) {
+    __m128i needle = _mm_set1_epi8(c);
+    uint64_t ret = 0;
+    for(int i = 0; i < 4; ++i) {
+        uint64_t found = _mm_movemask_epi8(_mm_cmpeq_epi8(chunks[i], needle));
+        ret |= found << (16 * i);
+    }
+    return ret;
+}
+
+// ' ' and '\t' through '\r'; signed compares leave bytes over 127 out
+static inline uint64_t space_bytes(const __m128i* chunks) {
+    uint64_t ret = 0;
+    for(int i = 0; i < 4; ++i) {
+        __m128i controls = _mm_and_si128(_mm_cmpgt_epi8(chunks[i], _mm_set1_epi8(8)),
+                                         _mm_cmpgt_epi8(_mm_set1_epi8(14), chunks[i]));
+        __m128i spaces = _mm_cmpeq_epi8(chunks[i], _mm_set1_epi8(' '));
+        uint64_t found = _mm_movemask_epi8(_mm_or_si128(controls, spaces));
+        ret |= found << (16 * i);
+    }
+    return ret;
+}
+
+static void classify_block(const char* block, blockmasks& masks) {
+    __m128i chunks[4];
+    for(int i = 0; i < 4; ++i) {
+        chunks[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + 16 * i));
+    }
+
+    masks.space = space_bytes(chunks);
+    masks.quote = match_bytes(chunks, '"');
+    masks.backslash = match_bytes(chunks, '\\');
+    masks.semicolon = match_bytes(chunks, ';');
+    masks.newline = match_bytes(chunks, '\n');
+    masks.paren = match_bytes(chunks, '(') | match_bytes(chunks, ')');
+}
+
+#else
+
+static void classify_block(const char* block, blockmasks& masks) {
+    memset(&masks, 0, sizeof(masks));
+
+    for(size_t i = 0; i < scan_block_size; ++i) {
+        uint64_t bit = 1ULL << i;
+        switch(block[i]) {
+        case '\n':
+            masks.newline |= bit;
+            masks.space |= bit;
+            break;
+        case ' ': case '\t': case '\r': case '\f': case '\v':
+            masks.space |= bit;
+            break;
+        case '"':
+            masks.quote |= bit;
+            break;
+        case '\\':
+            masks.backslash |= bit;
+            break;
+        case ';':
+            masks.semicolon |= bit;
+            break;
+        case '(': case ')':
+            masks.paren |= bit;
+            break;
+        }
+    }
+}
+
+#endif
+
+// bits first through last - 1
+static inline uint64_t bit_range(unsigned first, unsigned last) {
+    if(first >= last) {
+        return 0;
+    }
+    uint64_t upto = last == 64 ? ~0ULL : (1ULL << last) - 1;
+    return upto & (~0ULL << first);
+}
+
+bool scan_structure(const char* begin, const char* end,
+                    uint32_t line, uint32_t column,
+                    std::vector<tokenstart>& out) {
+    size_t size = end - begin;
+    if(size > std::numeric_limits<uint32_t>::max()) {
+        return false;
+    }
+
+    out.clear();
+
+    bool instring = false;
+    bool incomment = false;
+    bool escaped = false;
+    // whether the byte before the block was whitespace, or a delimiter a
+    // string may follow; the start of the input counts as both
+    uint64_t prevspace = 1;
+    uint64_t prevdelim = 1;
+    // where the current line starts, relative to begin
+    int64_t linestart = 1 - static_cast<int64_t>(column);
+
+    for(size_t base = 0; base < size; base += scan_block_size) {
+        const char* block = begin + base;
+        char padded[scan_block_size];
+        if(size - base < scan_block_size) {
+            memset(padded, ' ', scan_block_size);
+            memcpy(padded, block, size - base);
+            block = padded;
+        }
+
+        blockmasks masks;
+        classify_block(block, masks);
+
+        // string contents (with the closing quote) and comments
+        uint64_t inside = 0;
+        // bytes a string may directly follow
+        uint64_t delims = masks.space | masks.paren;
+        uint64_t specials = masks.quote | masks.backslash | masks.semicolon | masks.newline;
+        unsigned regionstart = 0;
+
+        if(escaped) {
+            specials &= ~1ULL;
+            escaped = false;
+        }
+
+        while(specials) {
+            unsigned bit = __builtin_ctzll(specials);
+            uint64_t mask = 1ULL << bit;
+            specials &= specials - 1;
+
+            if(incomment) {
+                if(mask & masks.newline) {
+                    inside |= bit_range(regionstart, bit);
+                    incomment = false;
+                }
+            } else if(instring) {
+                if(mask & masks.backslash) {
+                    if(bit == scan_block_size - 1) {
+                        escaped = true;
+                    } else {
+                        specials &= ~(mask << 1);
+                    }
+                } else if(mask & masks.quote) {
+                    inside |= bit_range(regionstart, bit + 1);
+                    delims |= mask;
+                    instring = false;
+                }
+            } else if(mask & masks.semicolon) {
+                incomment = true;
+                regionstart = bit;
+            } else if(mask & masks.quote) {
+                // the reader only starts a string after a delimiter; after
+                // anything else the quote is part of a symbol, or follows
+                // a number, and the masks can't say which
+                uint64_t before = bit == 0 ? prevdelim : delims >> (bit - 1);
+                if(!(before & 1)) {
+                    return false;
+                }
+                instring = true;
+                regionstart = bit + 1;
+            }
+        }
+
+        if(instring || incomment) {
+            inside |= bit_range(regionstart, scan_block_size);
+        }
+
+        uint64_t starts = ~masks.space & (masks.space << 1 | prevspace) & ~inside;
+        while(starts) {
+            unsigned bit = __builtin_ctzll(starts);
+            starts &= starts - 1;
+
+            uint64_t newlines = masks.newline & bit_range(0, bit);
+            int64_t start = linestart;
+            if(newlines) {
+                start = base + (63 - __builtin_clzll(newlines)) + 1;
+            }
+
+            tokenstart token;
+            token.offset = base + bit;
+            token.line = line + __builtin_popcountll(newlines);
+            token.column = base + bit - start + 1;
+            out.push_back(token);
+        }
+
+        line += __builtin_popcountll(masks.newline);
+        if(masks.newline) {
+            linestart = base + (63 - __builtin_clzll(masks.newline)) + 1;
+        }
+        prevspace = masks.space >> 63;
+        prevdelim = delims >> 63;
+    }
+
+    return true;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// A pre-pass for reading big files. The input is classified 64 bytes at a
+// time (with SSE2 or AVX2 where the compiler allows it) into bitmasks of
+// whitespace, parens, quotes, backslashes, semicolons and newlines. Only
+// the quotes, backslashes, semicolons and newlines are then walked one by one,
+// to find the strings and comments. What comes out is where every token
+// that follows whitespace or a comment starts, with its line and column,
+// so the reader can jump over them instead of looking at every byte.
+
+class tokenstart {
+public:
+    uint32_t offset;
+    uint32_t line;
+    uint32_t column;
+};
+
+// Offsets are relative to begin, and line and column give the position of
+// begin itself. Returns false if the input can't be indexed the way the
+// reader would read it (a quote in the middle of a symbol, or input over
+// 4GB); the reader should go byte by byte instead.
+bool scan_structure(const char* begin, const char* end,
+                    uint32_t line, uint32_t column,
+                    std::vector<tokenstart>& out);
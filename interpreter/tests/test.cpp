@@ -1,6 +1,37 @@
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+#include <new>
+#include <sstream>
+#include <thread>
+
+#include <unistd.h>
+
 #include "../deviser.hpp"
+#include "../image.hpp"
+#include "../modulecache.hpp"
+#include "../profiler.hpp"
+#include "../vm.hpp"
 #include "gtest/gtest.h"
 
+// counts every operator new in the test binary, so tests can check how
+// many heap allocations making an object costs
+static size_t heap_allocations = 0;
+
+void* operator new(size_t size) {
+    ++heap_allocations;
+    void* ret = malloc(size ? size : 1);
+    if(!ret) {
+        throw std::bad_alloc();
+    }
+    return ret;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
 TEST(DeviserBase, NilEq) {
     shared_ptr<lispobj> n(new nil);
 
@@ -26,9 +57,9 @@ TEST(DeviserBase, NumEq) {
 }
 
 TEST(DeviserBase, SymbolEq) {
-    shared_ptr<lispobj> sym(new symbol("sym1"));
-    shared_ptr<lispobj> sym1(new symbol("sym1"));
-    shared_ptr<lispobj> sym2(new symbol("sym2"));
+    shared_ptr<lispobj> sym(intern("sym1"));
+    shared_ptr<lispobj> sym1(intern("sym1"));
+    shared_ptr<lispobj> sym2(intern("sym2"));
 
     EXPECT_PRED2(eq, sym, sym);
     EXPECT_PRED2(eq, sym1, sym1);
@@ -41,8 +72,8 @@ TEST(DeviserBase, SymbolEq) {
 }
 
 TEST(DeviserBase, ConsEq) {
-    shared_ptr<lispobj> c1(new cons(std::make_shared<symbol>("a"), std::make_shared<nil>()));
-    shared_ptr<lispobj> c2(new cons(std::make_shared<symbol>("a"), std::make_shared<nil>()));
+    shared_ptr<lispobj> c1(new cons(intern("a"), std::make_shared<nil>()));
+    shared_ptr<lispobj> c2(new cons(intern("a"), std::make_shared<nil>()));
 
     EXPECT_PRED2(eq, c1, c1);
     EXPECT_PRED2(eq, c2, c2);
@@ -59,6 +90,21 @@ TEST(DeviserBase, NilNumEq) {
     EXPECT_FALSE(eq(num, n));
 }
 
+TEST(DeviserBase, SmallNumbersAreShared) {
+    EXPECT_EQ(make_number(5), make_number(5));
+    EXPECT_EQ(make_number(small_number_min), make_number(small_number_min));
+    EXPECT_NE(make_number(small_number_max), make_number(small_number_max));
+    EXPECT_EQ(7, make_number(7)->value());
+    EXPECT_EQ(small_number_max, make_number(small_number_max)->value());
+}
+
+TEST(DeviserBase, SharedNil) {
+    EXPECT_EQ(make_nil(), make_nil());
+    EXPECT_FALSE(istrue(make_nil()));
+    EXPECT_FALSE(istrue(shared_ptr<lispobj>(new nil)));
+    EXPECT_TRUE(istrue(make_number(0)));
+}
+
 TEST(DeviserBase, NumEqv) {
     shared_ptr<lispobj> zero(new number(0));
     shared_ptr<lispobj> zero2(new number(0));
@@ -153,7 +199,7 @@ TEST(DeviserBase, NilPrint) {
 }
 
 TEST(DeviserBase, SymbolPrint) {
-    shared_ptr<lispobj> sym(new symbol("symname"));
+    shared_ptr<lispobj> sym(intern("symname"));
     std::stringstream ss;
 
     sym->print(ss);
@@ -184,117 +230,250 @@ TEST(DeviserBase, ImproperListPrint) {
 
 TEST(DeviserBase, readNumber) {
     shared_ptr<lispobj> readobj(read("1"));
-    shared_ptr<syntaxnumber> num = std::dynamic_pointer_cast<syntaxnumber>(readobj);
+    shared_ptr<number> num = std::dynamic_pointer_cast<number>(readobj);
 
     ASSERT_EQ(readobj, num);
     EXPECT_EQ(1, num->value());
-    EXPECT_EQ(1, num->get_location()->linenum);
-    EXPECT_EQ(1, num->get_location()->charnum);
-    EXPECT_EQ(nullptr, num->get_parent());
 }
 
 TEST(DeviserBase, readNil) {
     shared_ptr<lispobj> readobj(read("()"));
-    shared_ptr<syntaxnil> n = std::dynamic_pointer_cast<syntaxnil>(readobj);
 
-    ASSERT_EQ(readobj, n);
-    EXPECT_EQ(1, n->get_location()->linenum);
-    EXPECT_EQ(1, n->get_location()->charnum);
-    EXPECT_EQ(nullptr, n->get_parent());
+    EXPECT_EQ(make_nil(), readobj);
 }
 
 TEST(DeviserBase, readSymbol) {
     shared_ptr<lispobj> readobj(read("testsymbol"));
-    shared_ptr<syntaxsymbol> sym = std::dynamic_pointer_cast<syntaxsymbol>(readobj);
+    shared_ptr<symbol> sym = std::dynamic_pointer_cast<symbol>(readobj);
 
     ASSERT_EQ(readobj, sym);
     EXPECT_STREQ("testsymbol", sym->name().c_str());
-    EXPECT_EQ(1, sym->get_location()->linenum);
-    EXPECT_EQ(1, sym->get_location()->charnum);
+    EXPECT_EQ(intern("testsymbol"), sym);
+}
+
+TEST(DeviserBase, internSymbol) {
+    shared_ptr<symbol> sym1 = intern("internedsym");
+    shared_ptr<symbol> sym2 = intern("internedsym");
+    shared_ptr<symbol> other = intern("otherinternedsym");
+
+    EXPECT_EQ(sym1, sym2);
+    EXPECT_EQ(sym1->id(), sym2->id());
+    EXPECT_NE(sym1, other);
+    EXPECT_NE(sym1->id(), other->id());
+    EXPECT_EQ(sym1, symbol_by_id(sym1->id()));
+    EXPECT_TRUE(intern(":keyword")->is_keyword());
+    EXPECT_FALSE(sym1->is_keyword());
+}
+
+TEST(DeviserBase, readSymbolsAreInterned) {
+    shared_ptr<cons> c = std::dynamic_pointer_cast<cons>(read("(a b a)"));
+    ASSERT_NE(nullptr, c);
+    shared_ptr<cons> c3 = std::dynamic_pointer_cast<cons>(
+        std::dynamic_pointer_cast<cons>(c->cdr())->cdr());
+
+    EXPECT_EQ(c->car(), c3->car());
+    EXPECT_EQ(intern("a"), c->car());
 }
 
 TEST(DeviserBase, readCons) {
     shared_ptr<lispobj> readobj(read(" ( 1 ) "));
-    shared_ptr<syntaxcons> c = std::dynamic_pointer_cast<syntaxcons>(readobj);
+    shared_ptr<cons> c = std::dynamic_pointer_cast<cons>(readobj);
 
     ASSERT_EQ(readobj, c);
-    EXPECT_EQ(1, c->get_location()->linenum);
-    EXPECT_EQ(2, c->get_location()->charnum);
-    EXPECT_EQ(nullptr, c->get_parent());
-
-    shared_ptr<lispobj> conscar = c->car();
-    shared_ptr<lispobj> conscdr = c->cdr();
-    shared_ptr<syntaxnumber> num = std::dynamic_pointer_cast<syntaxnumber>(conscar);
-    shared_ptr<syntaxnil> n = std::dynamic_pointer_cast<syntaxnil>(conscdr);
-
-    ASSERT_EQ(conscar, num);
-    ASSERT_EQ(conscdr, n);
+    sourcelocation location;
+    ASSERT_TRUE(get_source_location(c.get(), location));
+    EXPECT_EQ("INPUT", location.filename());
+    EXPECT_EQ(1, location.line());
+    EXPECT_EQ(2, location.column());
+
+    shared_ptr<number> num = std::dynamic_pointer_cast<number>(c->car());
+    ASSERT_NE(nullptr, num);
     EXPECT_EQ(1, num->value());
-    EXPECT_EQ(1, num->get_location()->linenum);
-    EXPECT_EQ(4, num->get_location()->charnum);
-    EXPECT_EQ(c, num->get_parent());
-    EXPECT_EQ(1, n->get_location()->linenum);
-    EXPECT_EQ(6, n->get_location()->charnum);
-    EXPECT_EQ(nullptr, n->get_parent());
+    EXPECT_EQ(make_nil(), c->cdr());
 }
 
 TEST(DeviserBase, readComment) {
     shared_ptr<lispobj> readobj(read(" (;comment\n1)"));
-    shared_ptr<syntaxcons> c = std::dynamic_pointer_cast<syntaxcons>(readobj);
+    shared_ptr<cons> c = std::dynamic_pointer_cast<cons>(readobj);
 
     ASSERT_EQ(readobj, c);
-    EXPECT_EQ(1, c->get_location()->linenum);
-    EXPECT_EQ(2, c->get_location()->charnum);
-    EXPECT_EQ(nullptr, c->get_parent());
-
-    shared_ptr<lispobj> conscar = c->car();
-    shared_ptr<lispobj> conscdr = c->cdr();
-    shared_ptr<syntaxnumber> num = std::dynamic_pointer_cast<syntaxnumber>(conscar);
-    shared_ptr<syntaxnil> n = std::dynamic_pointer_cast<syntaxnil>(conscdr);
+    sourcelocation location;
+    ASSERT_TRUE(get_source_location(c.get(), location));
+    EXPECT_EQ(1, location.line());
+    EXPECT_EQ(2, location.column());
 
-    ASSERT_EQ(conscar, num);
-    ASSERT_EQ(conscdr, n);
+    shared_ptr<number> num = std::dynamic_pointer_cast<number>(c->car());
+    ASSERT_NE(nullptr, num);
     EXPECT_EQ(1, num->value());
-    EXPECT_EQ(2, num->get_location()->linenum);
-    EXPECT_EQ(1, num->get_location()->charnum);
-    EXPECT_EQ(c, num->get_parent());
-    EXPECT_EQ(2, n->get_location()->linenum);
-    EXPECT_EQ(2, n->get_location()->charnum);
-    EXPECT_EQ(nullptr, n->get_parent());
+    EXPECT_EQ(make_nil(), c->cdr());
 }
 
 TEST(DeviserBase, readComment2) {
     shared_ptr<lispobj> readobj(read("((1) ;comment\n)"));
-    shared_ptr<syntaxcons> c = std::dynamic_pointer_cast<syntaxcons>(readobj);
+    shared_ptr<cons> c = std::dynamic_pointer_cast<cons>(readobj);
 
     ASSERT_EQ(readobj, c);
-    EXPECT_EQ(nullptr, c->get_parent());
-
-    shared_ptr<lispobj> conscar = c->car();
-    shared_ptr<lispobj> conscdr = c->cdr();
-    shared_ptr<syntaxcons> c2 = std::dynamic_pointer_cast<syntaxcons>(conscar);
-    shared_ptr<syntaxnil> n = std::dynamic_pointer_cast<syntaxnil>(conscdr);
+    EXPECT_EQ(make_nil(), c->cdr());
 
-    ASSERT_EQ(conscar, c2);
-    ASSERT_EQ(conscdr, n);
+    shared_ptr<cons> c2 = std::dynamic_pointer_cast<cons>(c->car());
+    ASSERT_NE(nullptr, c2);
+    EXPECT_EQ(make_nil(), c2->cdr());
 
-    conscar = c2->car();
-    conscdr = c2->cdr();
-    shared_ptr<syntaxnumber> num = std::dynamic_pointer_cast<syntaxnumber>(conscar);
-    n = std::dynamic_pointer_cast<syntaxnil>(conscdr);
-
-    ASSERT_EQ(conscar, num);
-    ASSERT_EQ(conscdr, n);
+    shared_ptr<number> num = std::dynamic_pointer_cast<number>(c2->car());
+    ASSERT_NE(nullptr, num);
     EXPECT_EQ(1, num->value());
 }
 
 TEST(DeviserBase, readString) {
     shared_ptr<lispobj> readobj(read("\"\\a\\s\\d\\f\\nThis is a string.\""));
-    shared_ptr<syntaxstring> str = std::dynamic_pointer_cast<syntaxstring>(readobj);
+    shared_ptr<lispstring> str = std::dynamic_pointer_cast<lispstring>(readobj);
 
     ASSERT_EQ(readobj, str);
     EXPECT_STREQ("asdf\nThis is a string.", str->get_contents().c_str());
-    EXPECT_EQ(nullptr, str->get_parent());
+    sourcelocation location;
+    ASSERT_TRUE(get_source_location(str.get(), location));
+    EXPECT_EQ(1, location.column());
+}
+
+TEST(DeviserBase, readLocationsAcrossLines) {
+    vector< shared_ptr<lispobj> > objs(readall("a\n  \"two\nlines\" ; note\n (b)"));
+    ASSERT_EQ(3u, objs.size());
+
+    sourcelocation location;
+    ASSERT_TRUE(get_source_location(objs[1].get(), location));
+    EXPECT_EQ(2, location.line());
+    EXPECT_EQ(3, location.column());
+    EXPECT_EQ("two\nlines", std::dynamic_pointer_cast<lispstring>(objs[1])->get_contents());
+
+    ASSERT_TRUE(get_source_location(objs[2].get(), location));
+    EXPECT_EQ(4, location.line());
+    EXPECT_EQ(2, location.column());
+}
+
+TEST(DeviserBase, readUnterminatedIsAnError) {
+    EXPECT_THROW(read("(1 (2)"), string);
+    EXPECT_THROW(read("\"abc"), string);
+    EXPECT_THROW(readall("(1))"), string);
+    EXPECT_THROW(read(")"), string);
+    EXPECT_THROW(read("99999999999"), string);
+}
+
+TEST(DeviserBase, replReportsSyntaxErrors) {
+    shared_ptr<lexicalscope> scope(new lexicalscope);
+    scope->add_import(make_builtins_module(scope));
+    shared_ptr<module> user(new module(read("(user)"), scope));
+
+    std::stringstream out;
+    read_eval_print("(import (builtins))", user, out);
+    out.str("");
+    read_eval_print("(+ 1", user, out);
+    EXPECT_EQ("ERROR: INPUT (1, 1): list is never closed\n", out.str());
+
+    out.str("");
+    read_eval_print(" )", user, out);
+    EXPECT_EQ("ERROR: INPUT (1, 2): unexpected )\n", out.str());
+
+    out.str("");
+    read_eval_print("  ", user, out);
+    EXPECT_EQ("", out.str());
+
+    // the repl goes on afterwards
+    out.str("");
+    read_eval_print("(+ 1 2)", user, out);
+    EXPECT_EQ("3\n", out.str());
+}
+
+TEST(DeviserBase, readFromFile) {
+    char filename[] = "/tmp/devisertestXXXXXX";
+    int fd = mkstemp(filename);
+    ASSERT_NE(-1, fd);
+    string contents("(1 2) sym\n\"str\"");
+    ASSERT_EQ((ssize_t)contents.size(), write(fd, contents.data(), contents.size()));
+    close(fd);
+
+    shared_ptr<sourcebuffer> buf = sourcebuffer::open_file(filename);
+    unlink(filename);
+    ASSERT_NE(nullptr, buf);
+    EXPECT_EQ(contents, string(buf->begin(), buf->end()));
+
+    reader r(buf, filename);
+    vector< shared_ptr<lispobj> > objs(r.readall());
+    ASSERT_EQ(3u, objs.size());
+    EXPECT_EQ(intern("sym"), objs[1]);
+
+    EXPECT_EQ(nullptr, sourcebuffer::open_file("/nonexistent/file.dvs"));
+}
+
+// every cons and string must have the same location in both trees
+static void expect_same_locations(const shared_ptr<lispobj>& left, const shared_ptr<lispobj>& right) {
+    sourcelocation leftlocation, rightlocation;
+    ASSERT_EQ(get_source_location(left.get(), leftlocation),
+              get_source_location(right.get(), rightlocation));
+    EXPECT_EQ(leftlocation.line(), rightlocation.line());
+    EXPECT_EQ(leftlocation.column(), rightlocation.column());
+
+    if(is_a<cons>(left)) {
+        expect_same_locations(lisp_cast<cons>(left)->car(), lisp_cast<cons>(right)->car());
+        expect_same_locations(lisp_cast<cons>(left)->cdr(), lisp_cast<cons>(right)->cdr());
+    }
+}
+
+static void expect_indexed_read_matches(const string& text) {
+    reader scalar(std::make_shared<sourcebuffer>(text), "INPUT");
+    reader indexed(std::make_shared<sourcebuffer>(text), "INPUT");
+    vector< shared_ptr<lispobj> > expected(scalar.readall());
+    vector< shared_ptr<lispobj> > actual(indexed.readall_indexed());
+
+    ASSERT_EQ(expected.size(), actual.size()) << text;
+    for(size_t i = 0; i < expected.size(); ++i) {
+        EXPECT_TRUE(equal(expected[i], actual[i])) << text;
+        expect_same_locations(expected[i], actual[i]);
+    }
+}
+
+TEST(DeviserBase, readIndexedMatchesScalar) {
+    expect_indexed_read_matches("");
+    expect_indexed_read_matches("  ; only a comment");
+    expect_indexed_read_matches("(a b) 12 \"str\"\n(c\n  (d \"e;f\" ; \"g\n h))");
+    expect_indexed_read_matches("\"a\\\"b\" \"c\"\"d\" (\"x\")12ab;c\n(e)");
+    expect_indexed_read_matches("x\\y \"tab\\\\\" \t\r\n\f\v end");
+
+    // long enough that strings, comments and escapes cross blocks
+    string text;
+    for(int i = 0; i < 200; ++i) {
+        text += "(defun f" + std::to_string(i) + " (x) ; comment \" with a quote\n";
+        text += "  (cons \"string\\\\ with \\\" escapes" + string(i % 70, ' ') + "\" x))\n";
+    }
+    expect_indexed_read_matches(text);
+}
+
+TEST(DeviserBase, scanStructureFindsTokens) {
+    string text("(a  b)\n ; c\n  \"d e\" f");
+    vector<tokenstart> tokens;
+    ASSERT_TRUE(scan_structure(text.data(), text.data() + text.size(), 1, 1, tokens));
+
+    ASSERT_EQ(4u, tokens.size());
+    EXPECT_EQ(0u, tokens[0].offset);
+    EXPECT_EQ(4u, tokens[1].offset);
+    EXPECT_EQ(14u, tokens[2].offset);
+    EXPECT_EQ(3u, tokens[2].line);
+    EXPECT_EQ(3u, tokens[2].column);
+    EXPECT_EQ(20u, tokens[3].offset);
+
+    // a quote inside a symbol can't be told apart from one starting a string
+    string symbolquote("a\"b\"");
+    EXPECT_FALSE(scan_structure(symbolquote.data(), symbolquote.data() + symbolquote.size(),
+                                1, 1, tokens));
+    expect_indexed_read_matches(symbolquote);
+}
+
+TEST(DeviserBase, sourceLocationsAreForgotten) {
+    size_t before = source_location_count();
+    shared_ptr<lispobj> readobj(read("(1 (2 \"three\"))"));
+    EXPECT_EQ(before + 5, source_location_count());
+
+    readobj.reset();
+    EXPECT_EQ(before, source_location_count());
 }
 
 TEST(DeviserBase, appendString) {
@@ -309,6 +488,64 @@ TEST(DeviserBase, appendString) {
     EXPECT_STREQ("asdfqwer", str1->get_contents().c_str());
 }
 
+TEST(DeviserBase, appendStringIsLinear) {
+    shared_ptr<lispstring> line(new lispstring("a line of a long listing, appended one at a time\n"));
+    shared_ptr<lispstring> listing(new lispstring(""));
+    const size_t lines = 50000;
+    for(size_t i = 0; i < lines; ++i) {
+        listing->append(line);
+    }
+
+    EXPECT_EQ(lines * line->size(), listing->size());
+    const string& contents = listing->get_contents();
+    EXPECT_EQ(lines * line->size(), contents.size());
+    EXPECT_EQ(line->get_contents(), contents.substr(contents.size() - line->size()));
+
+    // the join chain is freed without recursing through it
+    listing.reset(new lispstring(""));
+    for(size_t i = 0; i < lines; ++i) {
+        listing->append(line);
+    }
+    listing.reset();
+}
+
+TEST(DeviserBase, shortStringsAllocateOnce) {
+    size_t before = heap_allocations;
+    shared_ptr<lispstring> str = std::make_shared<lispstring>(string("short"));
+    EXPECT_EQ(before + 1, heap_allocations);
+
+    // short appends and substrings copy rather than making pieces
+    shared_ptr<lispstring> other = std::make_shared<lispstring>(string(" str"));
+    before = heap_allocations;
+    str->append(other);
+    shared_ptr<lispstring> sub = str->substring(1, 4);
+    EXPECT_EQ(before + 1, heap_allocations);
+    EXPECT_EQ("short str", str->get_contents());
+    EXPECT_EQ("hor", sub->get_contents());
+}
+
+TEST(DeviserBase, substringSharesCharacters) {
+    shared_ptr<lispstring> str(new lispstring("0123456789"));
+    shared_ptr<lispstring> tail(new lispstring(std::string(100, 'x')));
+    str->append(tail);
+
+    shared_ptr<lispstring> sub = str->substring(2, 5);
+    EXPECT_EQ("234", sub->get_contents());
+    EXPECT_EQ(3u, sub->size());
+    EXPECT_EQ("", str->substring(110, 110)->get_contents());
+    EXPECT_THROW(str->substring(5, 111), string);
+    EXPECT_THROW(str->substring(6, 5), string);
+
+    // appending to the original doesn't change the substring
+    str->append(tail);
+    EXPECT_EQ("34", sub->substring(1, 3)->get_contents());
+    EXPECT_EQ(210u, str->size());
+
+    shared_ptr<lispstring> longsub = str->substring(5, 105);
+    EXPECT_EQ("56789" + string(95, 'x'), longsub->get_contents());
+    EXPECT_EQ(string(100, 'x'), str->substring(110, 210)->get_contents());
+}
+
 TEST(DeviserBase, printString) {
     shared_ptr<lispobj> str(new lispstring("asdf\n"));
     std::stringstream ss;
@@ -398,7 +635,7 @@ TEST(DeviserEval, StringConstant) {
 TEST(DeviserEval, VariableLookup) {
     shared_ptr<lispobj> val(new number(0));
     shared_ptr<lexicalscope> scope(new lexicalscope);
-    shared_ptr<symbol> varname(new symbol("testval"));
+    shared_ptr<symbol> varname(intern("testval"));
 
     scope->defval("testval", val);
 
@@ -455,27 +692,27 @@ TEST(lexicalscope, getfunFromParent) {
     EXPECT_EQ(zero, child->getfun("testfun"));
 }
 
-shared_ptr<lispobj> find_fun_in_module(shared_ptr<module> mod, string name);
+shared_ptr<lispobj> find_fun_in_module(shared_ptr<module> mod, const shared_ptr<symbol>& name);
 
 TEST(lexicalscope, find_fun_in_moduleFailure) {
     shared_ptr<lexicalscope> scope(new lexicalscope);
-    shared_ptr<module> mod(new module(std::make_shared<symbol>("testmod"), scope));
+    shared_ptr<module> mod(new module(intern("testmod"), scope));
 
-    EXPECT_EQ(nullptr, find_fun_in_module(mod, "undefinedfun"));
+    EXPECT_EQ(nullptr, find_fun_in_module(mod, intern("undefinedfun")));
 }
 
 TEST(lexicalscope, find_fun_in_moduleSuccess) {
     shared_ptr<lexicalscope> scope(new lexicalscope);
-    shared_ptr<module> mod(new module(std::make_shared<symbol>("testmod"), scope));
+    shared_ptr<module> mod(new module(intern("testmod"), scope));
 
-    mod->add_export(std::make_shared<symbol>("testfun"));
+    mod->add_export(intern("testfun"));
 
-    EXPECT_PRED2(eq, std::make_shared<nil>(), find_fun_in_module(mod, "testfun"));
+    EXPECT_PRED2(eq, std::make_shared<nil>(), find_fun_in_module(mod, intern("testfun")));
 }
 
 TEST(lexicalscope, getvalFromModule) {
     shared_ptr<lexicalscope> scope(new lexicalscope);
-    shared_ptr<module> mod(new module(std::make_shared<symbol>("testmod"), scope));
+    shared_ptr<module> mod(new module(intern("testmod"), scope));
     shared_ptr<lispobj> zero(new number(0));
 
     scope->add_import(mod);
@@ -485,9 +722,33 @@ TEST(lexicalscope, getvalFromModule) {
     EXPECT_EQ(zero, scope->getval("testval"));
 }
 
+TEST(lexicalscope, importedNamesFollowImportsAndExports) {
+    shared_ptr<lexicalscope> scope(new lexicalscope);
+    shared_ptr<module> first(new module(intern("first"), scope));
+    shared_ptr<module> second(new module(intern("second"), scope));
+    shared_ptr<lispobj> one = make_number(1);
+    shared_ptr<lispobj> two = make_number(2);
+    shared_ptr<lexicalscope> inner(new lexicalscope(scope));
+
+    scope->add_import(first);
+    second->defun_and_export("shared", two);
+    EXPECT_PRED2(eq, make_nil(), inner->getfun("shared"));
+
+    // found once the scope imports a module exporting it
+    scope->add_import(second);
+    EXPECT_EQ(two, inner->getfun("shared"));
+
+    // the first import exporting a name wins, even when it exports it later
+    first->defun(intern("shared"), one);
+    first->add_export(intern("shared"));
+    EXPECT_EQ(one, inner->getfun("shared"));
+    EXPECT_TRUE(first->exports_symbol(intern("shared")));
+    EXPECT_FALSE(first->exports_symbol(intern("unshared")));
+}
+
 TEST(lexicalscope, getfunFromModule) {
     shared_ptr<lexicalscope> scope(new lexicalscope);
-    shared_ptr<module> mod(new module(std::make_shared<symbol>("testmod"), scope));
+    shared_ptr<module> mod(new module(intern("testmod"), scope));
     shared_ptr<lispobj> zero(new number(0));
 
     scope->add_import(mod);
@@ -496,3 +757,615 @@ TEST(lexicalscope, getfunFromModule) {
 
     EXPECT_EQ(zero, scope->getfun("testfun"));
 }
+
+shared_ptr<lexicalscope> make_vm_test_scope() {
+    shared_ptr<lexicalscope> scope(new lexicalscope);
+    scope->add_import(make_builtins_module(scope));
+    return scope;
+}
+
+shared_ptr<lispobj> eval_string_in_mode(string code, evalmode mode) {
+    shared_ptr<lexicalscope> scope = make_vm_test_scope();
+    shared_ptr<lispobj> ret;
+
+    set_eval_mode(mode);
+    for(auto form : readall(code)) {
+        ret = eval(form, scope);
+    }
+    set_eval_mode(vm_mode);
+
+    return ret;
+}
+
+static string write_temp_file(const string& contents) {
+    char filename[] = "/tmp/devisertestXXXXXX";
+    int fd = mkstemp(filename);
+    EXPECT_NE(-1, fd);
+    EXPECT_EQ((ssize_t)contents.size(), write(fd, contents.data(), contents.size()));
+    close(fd);
+    return filename;
+}
+
+TEST(DeviserModules, LoadedOnFirstImport) {
+    vector<string> files;
+    files.push_back(write_temp_file("; header comment\n(module (lazy-a) (import (builtins))"
+                                    " (import (lazy-b)) (export f) (defun f () (+ (g) 1)))"));
+    files.push_back(write_temp_file("(module (lazy-b) (import (builtins)) (export g) (defun g () 41))"));
+    files.push_back(write_temp_file("(module (lazy-unused) (export h) (defun h () 0))"));
+    files.push_back(write_temp_file("(+ 1 2)"));
+
+    shared_ptr<lexicalscope> scope = make_vm_test_scope();
+    shared_ptr<moduleindex> index(new moduleindex(scope));
+    EXPECT_TRUE(index->add_file(files[0]));
+    EXPECT_TRUE(index->add_file(files[1]));
+    EXPECT_TRUE(index->add_file(files[2]));
+    EXPECT_FALSE(index->add_file(files[3]));
+    EXPECT_EQ(0u, index->loaded_count());
+
+    set_module_index(index);
+    shared_ptr<module> mod = scope->find_module(read("(lazy-a)"));
+    ASSERT_NE(nullptr, mod);
+    EXPECT_EQ(2u, index->loaded_count());
+    EXPECT_EQ(mod, scope->find_module(read("(lazy-a)")));
+    EXPECT_EQ(nullptr, scope->find_module(read("(lazy-missing)")));
+
+    scope->add_import(mod);
+    shared_ptr<number> result = lisp_cast<number>(eval(read("(f)"), scope));
+    ASSERT_NE(nullptr, result);
+    EXPECT_EQ(42, result->value());
+
+    set_module_index(nullptr);
+    for(auto filename : files) {
+        unlink(filename.c_str());
+    }
+}
+
+TEST(DeviserModules, MalformedModuleCanBeFixed) {
+    string filename = write_temp_file("(module (lazy-broken) (export f) (defun f () (+ 1 2)");
+    shared_ptr<lexicalscope> scope = make_vm_test_scope();
+    shared_ptr<moduleindex> index(new moduleindex(scope));
+    EXPECT_TRUE(index->add_file(filename));
+    set_module_index(index);
+
+    // the syntax error is reported, not thrown through the import
+    shared_ptr<module> user(new module(read("(user)"), scope));
+    std::stringstream out;
+    read_eval_print("(import (lazy-broken))", user, out);
+    EXPECT_EQ(nullptr, scope->find_module(read("(lazy-broken)")));
+    EXPECT_EQ(0u, index->loaded_count());
+
+    std::ofstream(filename) << "(module (lazy-broken) (export f) (defun f () 3))";
+    EXPECT_NE(nullptr, scope->find_module(read("(lazy-broken)")));
+    EXPECT_EQ(1u, index->loaded_count());
+
+    set_module_index(nullptr);
+    unlink(filename.c_str());
+}
+
+static shared_ptr<lispobj> load_and_call(const vector<string>& files, const string& cachedir,
+                                         size_t& cached) {
+    shared_ptr<lexicalscope> scope = make_vm_test_scope();
+    shared_ptr<moduleindex> index(new moduleindex(scope));
+    for(auto filename : files) {
+        index->add_file(filename);
+    }
+    index->set_cache_directory(cachedir);
+    set_module_index(index);
+
+    scope->add_import(scope->find_module(read("(cached-a)")));
+    shared_ptr<lispobj> ret = eval(read("(f 2)"), scope);
+    cached = index->cached_count();
+    set_module_index(nullptr);
+    return ret;
+}
+
+TEST(DeviserModules, CacheIsUsedUntilASourceChanges) {
+    char cachedir[] = "/tmp/devisercacheXXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(cachedir));
+
+    vector<string> files;
+    files.push_back(write_temp_file("(module (cached-a) (import (builtins)) (import (cached-b))"
+                                    " (export f) (defun f (x) (twice (+ x \"ignored\" 1))))"));
+    files.push_back(write_temp_file("(module (cached-b) (import (builtins)) (export twice)"
+                                    " (defmacro twice (form) (list (quote +) (car (cdr form)) (car (cdr form)))))"));
+
+    size_t cached = 0;
+    shared_ptr<lispobj> result = load_and_call(files, cachedir, cached);
+    EXPECT_EQ(0u, cached);
+    EXPECT_TRUE(equal(make_number(4), result));
+
+    result = load_and_call(files, cachedir, cached);
+    EXPECT_EQ(2u, cached);
+    EXPECT_TRUE(equal(make_number(4), result));
+
+    // changing the macro's module invalidates the module using it
+    std::ofstream(files[1]) << "(module (cached-b) (import (builtins)) (export twice)"
+                               " (defmacro twice (form) (list (quote +) 10 (car (cdr form)))))";
+    result = load_and_call(files, cachedir, cached);
+    EXPECT_EQ(0u, cached);
+    EXPECT_TRUE(equal(make_number(12), result));
+
+    for(auto filename : files) {
+        unlink(filename.c_str());
+    }
+    string rm = string("rm -rf ") + cachedir;
+    EXPECT_EQ(0, system(rm.c_str()));
+}
+
+TEST(DeviserModules, CacheKeepsNegativeNumbers) {
+    string path = write_temp_file("");
+    vector< shared_ptr<lispobj> > numbers;
+    numbers.push_back(make_number(-7));
+    numbers.push_back(make_number(std::numeric_limits<int>::min()));
+    numbers.push_back(make_number(std::numeric_limits<int>::max()));
+
+    cachedmodule written;
+    written.sourcehash = 1;
+    written.forms.push_back(make_list(numbers.begin(), numbers.end()));
+    ASSERT_TRUE(write_module_cache(path, written));
+
+    cachedmodule restored;
+    ASSERT_TRUE(read_module_cache(path, "negatives", restored));
+    ASSERT_EQ(1u, restored.forms.size());
+    EXPECT_PRED2(equal, written.forms[0], restored.forms[0]);
+    unlink(path.c_str());
+}
+
+TEST(DeviserImages, RestoredWithoutEvaluating) {
+    string imagefile = write_temp_file("");
+
+    {
+        shared_ptr<lexicalscope> scope = make_vm_test_scope();
+        vector< shared_ptr<module> > natives = scope->get_imports();
+        shared_ptr<module> user(new module(read("(user)"), scope));
+        for(auto form : readall("(module (image-m) (import (builtins)) (export twice f)"
+                                "  (defmacro twice (form) (list (quote +) (car (cdr form)) (car (cdr form))))"
+                                "  (defun f (x) (twice (* x 10))))"
+                                "(defun g (x) (list \"g\" (f x)))")) {
+            eval(form, scope);
+        }
+        scope->defval("add5", eval(read("((lambda (n) (lambda (x) (+ x n))) 5)"), scope));
+        shared_ptr<bitvector> bits = std::make_shared<bitvector>(12);
+        bits->set_bit(9, 1);
+        scope->defval("bits", bits);
+        scope->defval("negative", make_number(-12345));
+        // called once, so the expanded body is in the image as well
+        eval(read("(g 1)"), scope);
+
+        save_image(imagefile, scope, natives, user);
+
+        scope->defval("port", std::make_shared<fileinputport>(imagefile));
+        EXPECT_THROW(save_image(imagefile, scope, natives, user), string);
+    }
+
+    shared_ptr<lexicalscope> scope = make_vm_test_scope();
+    vector< shared_ptr<module> > natives = scope->get_imports();
+    shared_ptr<module> user = load_image(imagefile, scope, natives);
+    ASSERT_NE(nullptr, user);
+    EXPECT_PRED2(equal, read("(user)"), user->get_name());
+    ASSERT_EQ(2u, scope->get_imports().size());
+    EXPECT_EQ(natives[0], scope->get_imports()[0]);
+
+    EXPECT_PRED2(equal, read("(\"g\" 4)"), eval(read("(g 2)"), scope));
+    shared_ptr<lispobj> add5 = scope->getval(intern("add5"));
+    ASSERT_TRUE(is_a<lispfunc>(add5));
+    EXPECT_PRED2(equal, make_number(42),
+                 eval(make_pooled<cons>(add5, read("(37)")), scope));
+    shared_ptr<bitvector> bits = lisp_cast<bitvector>(scope->getval(intern("bits")));
+    ASSERT_NE(nullptr, bits);
+    EXPECT_EQ(1, bits->get_bit(9));
+    EXPECT_EQ(0, bits->get_bit(8));
+    EXPECT_PRED2(eqv, make_number(-12345), scope->getval(intern("negative")));
+
+    std::ofstream(imagefile) << "not an image";
+    EXPECT_THROW(load_image(imagefile, make_vm_test_scope(), natives), string);
+    unlink(imagefile.c_str());
+}
+
+void expect_same_in_both_modes(string code) {
+    SCOPED_TRACE(code);
+    shared_ptr<lispobj> stepped = eval_string_in_mode(code, stepper_mode);
+    shared_ptr<lispobj> compiled = eval_string_in_mode(code, vm_mode);
+
+    ASSERT_NE(nullptr, stepped);
+    ASSERT_NE(nullptr, compiled);
+    EXPECT_PRED2(equal, stepped, compiled);
+}
+
+TEST(DeviserVM, Arithmetic) {
+    expect_same_in_both_modes("(+ 1 (* 2 3) (- 10 4))");
+    expect_same_in_both_modes("(/ 20 (+ 2 3))");
+}
+
+TEST(DeviserVM, SpecialForms) {
+    expect_same_in_both_modes("(if (eq 1 2) 1 (quote no))");
+    expect_same_in_both_modes("(if nil 1)");
+    expect_same_in_both_modes("(begin 1 2 3)");
+    expect_same_in_both_modes("(let* ((x 1) (y (+ x 1))) (list x y))");
+    expect_same_in_both_modes("(let* (x) x)");
+}
+
+TEST(DeviserVM, Functions) {
+    expect_same_in_both_modes("(defun fact (n) (if (eqv n 0) 1 (* n (fact (- n 1))))) (fact 10)");
+    expect_same_in_both_modes("(defun f (a &rest r) (cons a r)) (f 1 2 3)");
+    expect_same_in_both_modes("(defun adder (n) (lambda (x) (+ x n))) ((adder 5) 10)");
+}
+
+TEST(DeviserVM, Macros) {
+    expect_same_in_both_modes("(defmacro swap (a b) (list b a)) (swap 1 -)");
+    expect_same_in_both_modes("(defmacro my-if (c a b) (list (quote if) c a b))"
+                              "(defun f (x) (my-if x 1 2)) (list (f t) (f nil))");
+}
+
+TEST(DeviserVM, LexicalAddressing) {
+    expect_same_in_both_modes("(let* ((x 1)) (let* ((x (+ x 1))) x))");
+    expect_same_in_both_modes("(let* ((x 1) (x (+ x 1))) x)");
+    expect_same_in_both_modes("(defun f (x) (let* ((y (+ x 1))) (lambda (z) (list x y z)))) ((f 1) 3)");
+    expect_same_in_both_modes("(defun f (&rest r) r) (f)");
+    expect_same_in_both_modes("(defun f (x x) x) (f 1 2)");
+}
+
+TEST(DeviserVM, TailCallsDoNotGrowStack) {
+    shared_ptr<lispobj> ret = eval_string_in_mode(
+        "(defun count (n acc) (if (eqv n 0) acc (count (- n 1) (+ acc 1))))"
+        "(count 100000 0)", vm_mode);
+
+    ASSERT_NE(nullptr, ret);
+    EXPECT_PRED2(eqv, std::make_shared<number>(100000), ret);
+}
+
+TEST(DeviserVM, CallSitesSeeRedefinitions) {
+    shared_ptr<lexicalscope> scope = make_vm_test_scope();
+    for(auto form : readall("(defun inner () 1) (defun outer () (inner))"
+                            "(defun helper () (quote global))"
+                            "(defun maybe-local (x) (if x (defun helper () (quote local))) (helper))")) {
+        eval(form, scope);
+    }
+
+    EXPECT_PRED2(eqv, make_number(1), eval(read("(outer)"), scope));
+    callcachestats before = get_call_cache_stats();
+    EXPECT_PRED2(eqv, make_number(1), eval(read("(outer)"), scope));
+    EXPECT_EQ(before.hits + 1, get_call_cache_stats().hits);
+
+    eval(read("(defun inner () 2)"), scope);
+    EXPECT_PRED2(eqv, make_number(2), eval(read("(outer)"), scope));
+
+    // a function defined in a call's own scope isn't remembered for later calls
+    EXPECT_PRED2(eq, intern("local"), eval(read("(maybe-local t)"), scope));
+    EXPECT_PRED2(eq, intern("global"), eval(read("(maybe-local nil)"), scope));
+
+    // closures of one lambda share its call sites but not the scope they
+    // closed over
+    eval(read("(defun make-caller (local) (if local (defun helper () (quote local))) (lambda () (helper)))"),
+         scope);
+    EXPECT_PRED2(equal, read("(global local)"),
+                 eval(read("(let* ((c1 (make-caller t)) (c2 (make-caller nil))) (list ((begin c2)) ((begin c1))))"),
+                      scope));
+
+    // a macro body runs in a fresh scope of its own, so its calls are cached
+    eval(read("(defun same (x) x)"), scope);
+    eval(read("(defmacro quoted (x) (same (list (quote quote) x)))"), scope);
+    expand_sexp(read("(quoted a)"), scope);
+    before = get_call_cache_stats();
+    EXPECT_PRED2(equal, read("(quote b)"), expand_sexp(read("(quoted b)"), scope));
+    EXPECT_EQ(before.hits + 2, get_call_cache_stats().hits);
+    EXPECT_EQ(before.misses, get_call_cache_stats().misses);
+}
+
+TEST(DeviserStats, RuntimeStatsCount) {
+    runtimestats before = get_runtime_stats();
+    shared_ptr<lispobj> ret = eval_string_in_mode(
+        "(defun deep (n) (if (eqv n 0) (list n) (cons n (deep (- n 1))))) (deep 10)", stepper_mode);
+    runtimestats after = get_runtime_stats();
+
+    ASSERT_NE(nullptr, ret);
+    EXPECT_LE(before.allocations[CONS_TYPE] + 11, after.allocations[CONS_TYPE]);
+    EXPECT_LT(before.steps[0], after.steps[0]);
+    EXPECT_LT(before.steps[1], after.steps[1]);
+    EXPECT_LT(before.steps[3], after.steps[3]);
+    EXPECT_LT(before.val_lookups, after.val_lookups);
+    EXPECT_LT(before.fun_lookups, after.fun_lookups);
+    // every lookup visits at least the scope it starts in
+    EXPECT_LE(after.val_lookups - before.val_lookups, after.val_scopes - before.val_scopes);
+    EXPECT_LE(11u, after.peak_stack_depth);
+    EXPECT_STREQ("evalspecial", stepper_mark_name(3));
+    EXPECT_STREQ("cons", lisp_type_tag_name(CONS_TYPE));
+}
+
+static shared_ptr<lispobj> sample_cfunc() {
+    take_profile_sample();
+    return make_nil();
+}
+
+TEST(DeviserProfiler, SamplesShowTheLispStack) {
+    evalmode modes[] = { vm_mode, stepper_mode };
+    for(evalmode mode : modes) {
+        shared_ptr<lexicalscope> scope = make_vm_test_scope();
+        scope->defun(intern("sample"), make_cfunc("sample", sample_cfunc));
+        set_eval_mode(mode);
+        for(auto form : readall("(defun leaf () (sample) 1)"
+                                "(defun middle (n) (if (eqv n 0) (leaf) (+ 0 (middle (- n 1)))))")) {
+            eval(form, scope);
+        }
+
+        // the timer never fires, so the only samples are leaf's
+        start_profiler(100000000);
+        EXPECT_PRED2(eqv, make_number(1), eval(read("(middle 2)"), scope));
+        EXPECT_PRED2(eqv, make_number(1), eval(read("(leaf)"), scope));
+        string folded = write_temp_file("");
+        std::stringstream table;
+        stop_profiler(folded, table);
+        set_eval_mode(vm_mode);
+
+        std::ifstream in(folded);
+        string stacks((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        unlink(folded.c_str());
+
+        // (middle 0) tail calls leaf, so two middles are left
+        EXPECT_NE(string::npos, stacks.find("middle INPUT:1;middle INPUT:1;leaf INPUT:1 1\n")) << stacks;
+        EXPECT_EQ(2, std::count(stacks.begin(), stacks.end(), '\n')) << stacks;
+        EXPECT_NE(string::npos, table.str().find("2 samples")) << table.str();
+        EXPECT_NE(string::npos, table.str().find("  100.0%  100.0%  leaf INPUT:1\n")) << table.str();
+        EXPECT_NE(string::npos, table.str().find("    0.0%   50.0%  middle INPUT:1\n")) << table.str();
+        EXPECT_FALSE(profiler_running());
+    }
+}
+
+TEST(DeviserStack, ManyArguments) {
+    expect_same_in_both_modes("(list 1 2 3 4 5 6 7 8 9)");
+    expect_same_in_both_modes("(defun f (a b c d e f) (list f e d c b a)) (f 1 2 3 4 5 6)");
+}
+
+TEST(DeviserStack, DepthLimitIsAnError) {
+    size_t old_depth = get_max_stack_depth();
+    set_max_stack_depth(200);
+    string code = "(defun deep (n) (if (eqv n 0) 0 (+ 1 (deep (- n 1))))) (deep 1000)";
+    EXPECT_EQ(nullptr, eval_string_in_mode(code, stepper_mode));
+    EXPECT_EQ(nullptr, eval_string_in_mode(code, vm_mode));
+    set_max_stack_depth(old_depth);
+
+    EXPECT_PRED2(eqv, make_number(1000), eval_string_in_mode(code, vm_mode));
+}
+
+TEST(DeviserStepper, TailCallsDoNotGrowStack) {
+    size_t old_depth = get_max_stack_depth();
+    set_max_stack_depth(50);
+    shared_ptr<lispobj> ret = eval_string_in_mode(
+        "(defun count (n acc) (if (eqv n 0) acc (begin (let* ((m (- n 1))) (count m (+ acc 1))))))"
+        "(count 10000 0)", stepper_mode);
+    set_max_stack_depth(old_depth);
+
+    ASSERT_NE(nullptr, ret);
+    EXPECT_PRED2(eqv, make_number(10000), ret);
+}
+
+TEST(DeviserStepper, CallHeadIsAFunction) {
+    expect_same_in_both_modes("(let* ((list 1)) (list list))");
+    expect_same_in_both_modes("(defun f (x) (list x)) (f (let* ((f 2)) f))");
+}
+
+TEST(DeviserExpansion, CachesBySourceForm) {
+    shared_ptr<lexicalscope> scope = make_vm_test_scope();
+    eval(readall("(defmacro twice (x) (list (quote +) x x))")[0], scope);
+    shared_ptr<lispobj> form = readall("(list (twice 3))")[0];
+
+    shared_ptr<lispobj> first = expand_sexp(form, scope);
+    expansionstats before = get_expansion_stats();
+    shared_ptr<lispobj> second = expand_sexp(form, scope);
+    expansionstats after = get_expansion_stats();
+
+    EXPECT_EQ(first, second);
+    EXPECT_EQ(before.cache_hits + 1, after.cache_hits);
+    EXPECT_EQ(before.macro_calls, after.macro_calls);
+    EXPECT_PRED2(equal, readall("(list (+ 3 3))")[0], second);
+}
+
+TEST(DeviserExpansion, RedefiningAMacroInvalidates) {
+    shared_ptr<lexicalscope> scope = make_vm_test_scope();
+    eval(readall("(defmacro twice (x) (list (quote +) x x))")[0], scope);
+    shared_ptr<lispobj> form = readall("(twice 3)")[0];
+    expand_sexp(form, scope);
+
+    eval(readall("(defmacro twice (x) (list (quote *) x x))")[0], scope);
+    EXPECT_PRED2(equal, readall("(* 3 3)")[0], expand_sexp(form, scope));
+}
+
+TEST(DeviserTypes, TagsMatchClasses) {
+    EXPECT_EQ(NIL_TYPE, make_nil()->type());
+    EXPECT_EQ(SYMBOL_TYPE, intern("x")->type());
+    EXPECT_EQ(NUMBER_TYPE, make_number(100000)->type());
+    EXPECT_EQ(CONS_TYPE, readall("(1 2)")[0]->type());
+    EXPECT_EQ(STRING_TYPE, readall("\"s\"")[0]->type());
+    EXPECT_NE(nullptr, lisp_cast<cons>(readall("(1)")[0]));
+    EXPECT_EQ(nullptr, lisp_cast<cons>(intern("x")));
+    EXPECT_TRUE(is_a<nil>(readall("()")[0]));
+}
+
+TEST(DeviserTypes, EqualOnLongLists) {
+    vector< shared_ptr<lispobj> > elements(5000, make_number(1));
+    shared_ptr<lispobj> left = make_list(elements.begin(), elements.end());
+    shared_ptr<lispobj> right = make_list(elements.begin(), elements.end());
+    EXPECT_TRUE(equal(left, right));
+
+    elements.back() = make_number(2);
+    right = make_list(elements.begin(), elements.end());
+    EXPECT_FALSE(equal(left, right));
+}
+
+TEST(DeviserGC, CollectsClosureCycles) {
+    shared_ptr<lexicalscope> scope(new lexicalscope());
+    shared_ptr<lispfunc> func(new lispfunc(make_nil(), scope, make_nil()));
+    scope->defun("f", func);
+
+    std::weak_ptr<lexicalscope> weak_scope(scope);
+    scope.reset();
+    func.reset();
+    ASSERT_FALSE(weak_scope.expired());
+
+    collect_cycles();
+    EXPECT_TRUE(weak_scope.expired());
+}
+
+TEST(DeviserGC, KeepsReferencedCycles) {
+    shared_ptr<lexicalscope> scope(new lexicalscope());
+    shared_ptr<lispfunc> func(new lispfunc(make_nil(), scope, make_nil()));
+    scope->defun("f", func);
+    func.reset();
+
+    collect_cycles();
+    EXPECT_NE(nullptr, scope->getfun("f"));
+}
+
+TEST(DeviserPool, ListsComeFromThePool) {
+    vector< shared_ptr<lispobj> > elements(1000, make_number(1));
+    poolstats before = get_pool_stats();
+    shared_ptr<lispobj> list = make_list(elements.begin(), elements.end());
+    poolstats after = get_pool_stats();
+
+    EXPECT_EQ(before.allocations + 1000, after.allocations);
+    EXPECT_LE(before.slabs, after.slabs);
+}
+
+TEST(DeviserPool, CountsOtherThreads) {
+    poolstats before = get_pool_stats();
+    std::thread worker([]() {
+        pool_deallocate(pool_allocate(sizeof(cons)), sizeof(cons));
+        pool_deallocate(pool_allocate(sizeof(cons)), sizeof(cons));
+    });
+    worker.join();
+    poolstats after = get_pool_stats();
+
+    EXPECT_EQ(before.allocations + 2, after.allocations);
+    size_t block_size = (sizeof(cons) + pool_block_align - 1) / pool_block_align * pool_block_align;
+    EXPECT_EQ(before.bytes + 2 * block_size, after.bytes);
+}
+
+TEST(DeviserPool, FreedBlocksAreReused) {
+    void* first = pool_allocate(sizeof(cons));
+    pool_deallocate(first, sizeof(cons));
+    void* second = pool_allocate(sizeof(cons));
+    EXPECT_EQ(first, second);
+    pool_deallocate(second, sizeof(cons));
+}
+
+shared_ptr<lispobj> typed_cfunc_test(const shared_ptr<number>& n, const shared_ptr<lispobj>& obj) {
+    return make_pooled<cons>(make_number(n->value() + 1), obj);
+}
+
+TEST(DeviserCfunc, TypedArguments) {
+    shared_ptr<cfunc> f = make_cfunc("typed", typed_cfunc_test);
+    vector< shared_ptr<lispobj> > args;
+    args.push_back(make_number(1));
+    args.push_back(intern("x"));
+
+    shared_ptr<lispobj> ret = f->func(argspan(args.data(), args.data() + args.size()));
+    EXPECT_PRED2(equal, make_pooled<cons>(make_number(2), intern("x")), ret);
+}
+
+TEST(DeviserCfunc, TypedArgumentErrors) {
+    shared_ptr<cfunc> f = make_cfunc("typed", typed_cfunc_test);
+    vector< shared_ptr<lispobj> > args;
+    args.push_back(intern("x"));
+    args.push_back(intern("x"));
+
+    try {
+        f->func(argspan(args.data(), args.data() + 1));
+        FAIL();
+    } catch(string error) {
+        EXPECT_EQ("ERROR typed wants 2 arguments: number object", error);
+    }
+
+    EXPECT_THROW(f->func(argspan(args.data(), args.data() + 2)), string);
+}
+
+static string port_string(const shared_ptr<lispobj>& obj) {
+    shared_ptr<lispstring> str = lisp_cast<lispstring>(obj);
+    EXPECT_NE(nullptr, str);
+    return str ? str->get_contents() : "";
+}
+
+TEST(DeviserPorts, ReadsReturnExactCounts) {
+    string filename = write_temp_file(string(300, 'a'));
+    fileinputport port(filename);
+    EXPECT_EQ(string(256, 'a'), port_string(port.read()));
+    EXPECT_EQ(string(44, 'a'), port_string(port.read()));
+    EXPECT_EQ("", port_string(port.read()));
+    unlink(filename.c_str());
+
+    EXPECT_EQ("", port_string(fileinputport("/nonexistent/devisertest").read()));
+}
+
+TEST(DeviserPorts, ReadLineAcrossBuffers) {
+    string longline(port_buffer_size + 100, 'x');
+    string filename = write_temp_file("first\n" + longline + "\n\nlast");
+    fileinputport port(filename);
+    EXPECT_EQ("first", port_string(port.read_line()));
+    EXPECT_EQ(longline, port_string(port.read_line()));
+    EXPECT_EQ("", port_string(port.read_line()));
+    EXPECT_EQ("last", port_string(port.read_line()));
+    EXPECT_TRUE(is_a<nil>(port.read_line()));
+    unlink(filename.c_str());
+}
+
+TEST(DeviserPorts, ReadBytesAndReadAll) {
+    string contents;
+    for(int i = 0; i < 3 * int(port_buffer_size); ++i) {
+        contents += char(i % 251);
+    }
+    string filename = write_temp_file(contents);
+    fileinputport port(filename);
+    EXPECT_EQ(contents.substr(0, 1), port_string(port.readchar()));
+    EXPECT_EQ(contents.substr(1, 10), port_string(port.read_bytes(10)));
+    EXPECT_EQ(contents.substr(11, 2 * port_buffer_size), port_string(port.read_bytes(2 * port_buffer_size)));
+    EXPECT_EQ(contents.substr(11 + 2 * port_buffer_size), port_string(port.read_all()));
+    EXPECT_EQ("", port_string(port.read_all()));
+    EXPECT_EQ("", port_string(port.read_bytes(10)));
+    EXPECT_EQ("", port_string(port.read_bytes(0)));
+    EXPECT_EQ("", port_string(port.readchar()));
+    unlink(filename.c_str());
+}
+
+TEST(DeviserPorts, LargeCountsOnShortInput) {
+    string filename = write_temp_file("ten bytes!");
+    fileinputport port(filename);
+    shared_ptr<lispstring> str = lisp_cast<lispstring>(port.read_bytes(200000000));
+    ASSERT_NE(nullptr, str);
+    EXPECT_EQ("ten bytes!", str->get_contents());
+    EXPECT_GT(4096u, str->get_contents().capacity());
+    unlink(filename.c_str());
+
+    // a pipe's size isn't known ahead, so it is read a buffer at a time
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    string contents(5000, 'p');
+    EXPECT_EQ((ssize_t)contents.size(), write(fds[1], contents.data(), contents.size()));
+    close(fds[1]);
+    fileinputport pipeport("/proc/self/fd/" + std::to_string(fds[0]));
+    close(fds[0]);
+    str = lisp_cast<lispstring>(pipeport.read_bytes(200000000));
+    ASSERT_NE(nullptr, str);
+    EXPECT_EQ(contents, str->get_contents());
+    EXPECT_GT(2 * contents.size(), str->get_contents().capacity());
+    EXPECT_EQ("", port_string(pipeport.read_all()));
+}
+
+TEST(DeviserPorts, ReadcharAllocatesOnce) {
+    string filename = write_temp_file("ab");
+    fileinputport port(filename);
+    shared_ptr<lispobj> a = port.readchar();
+    size_t before = heap_allocations;
+    shared_ptr<lispobj> b = port.readchar();
+    EXPECT_EQ(before + 1, heap_allocations);
+    EXPECT_EQ("b", port_string(b));
+    unlink(filename.c_str());
+}
+
+TEST(DeviserPorts, Builtins) {
+    string filename = write_temp_file("one\ntwo\nthree");
+    shared_ptr<lexicalscope> scope = make_vm_test_scope();
+    scope->defval("port", std::make_shared<fileinputport>(filename));
+    EXPECT_PRED2(equal, readall("\"one\"")[0], eval(readall("(read-line port)")[0], scope));
+    EXPECT_PRED2(equal, readall("\"tw\"")[0], eval(readall("(read-bytes port 2)")[0], scope));
+    EXPECT_PRED2(equal, readall("\"o\nthree\"")[0], eval(readall("(read-all port)")[0], scope));
+    unlink(filename.c_str());
+}
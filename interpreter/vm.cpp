@@ -0,0 +1,747 @@
+#include <algorithm>
+#include <sstream>
+
+#include "profiler.hpp"
+#include "vm.hpp"
+
+using std::cout;
+using std::endl;
+using std::dynamic_pointer_cast;
+using std::static_pointer_cast;
+using std::make_shared;
+using std::stringstream;
+
+static evalmode current_eval_mode = vm_mode;
+
+void set_eval_mode(evalmode mode) {
+    current_eval_mode = mode;
+}
+
+evalmode get_eval_mode() {
+    return current_eval_mode;
+}
+
+bytecode::bytecode() :
+    nregs(0),
+    nparams(0),
+    hasrest(false),
+    slotargs(false)
+{
+
+}
+
+// One level of the lexical environment the compiler resolves variables
+// in. Only the first 'visible' names are bound at the point being
+// compiled; the rest are let* variables further down the binding list.
+class compileframe {
+public:
+    compileframe(shared_ptr<slotlayout> n, size_t v) :
+        names(n),
+        visible(v)
+    {}
+
+    shared_ptr<slotlayout> names;
+    size_t visible;
+};
+
+class bytecode_compiler {
+public:
+    bytecode_compiler(const vector<compileframe>& env);
+
+    shared_ptr<bytecode> get_bytecode();
+
+    void compile_expr(shared_ptr<lispobj> sexp, int dst, bool tail);
+    void compile_sequence(shared_ptr<lispobj> body, int dst, bool tail);
+    int alloc_reg();
+
+private:
+    void compile_symbol(shared_ptr<symbol> sym, int dst);
+    void compile_call(shared_ptr<cons> form, int dst, bool tail);
+    void compile_if(shared_ptr<cons> form, int dst, bool tail);
+    void compile_let_star(shared_ptr<cons> form, int dst, bool tail);
+    void compile_fallback(shared_ptr<lispobj> form, int dst, bool tail);
+    bool resolve(shared_ptr<symbol> sym, int& depth, int& slot);
+
+    int emit(opcode op, int a = 0, int b = 0, int c = 0, int d = 0);
+    int add_constant(shared_ptr<lispobj> obj);
+    void free_regs(int first);
+
+    shared_ptr<bytecode> bc;
+    int nextreg;
+    vector<compileframe> env;
+};
+
+shared_ptr<bytecode> compile_function_in(vector<compileframe> env,
+                                         shared_ptr<lispobj> args,
+                                         shared_ptr<lispobj> body);
+
+bytecode_compiler::bytecode_compiler(const vector<compileframe>& env) :
+    bc(new bytecode),
+    nextreg(0),
+    env(env)
+{
+
+}
+
+shared_ptr<bytecode> bytecode_compiler::get_bytecode() {
+    return bc;
+}
+
+int bytecode_compiler::emit(opcode op, int a, int b, int c, int d) {
+    instruction in;
+    in.op = op;
+    in.a = a;
+    in.b = b;
+    in.c = c;
+    in.d = d;
+    bc->code.push_back(in);
+    return bc->code.size() - 1;
+}
+
+int bytecode_compiler::add_constant(shared_ptr<lispobj> obj) {
+    bc->constants.push_back(obj);
+    return bc->constants.size() - 1;
+}
+
+int bytecode_compiler::alloc_reg() {
+    int reg = nextreg++;
+    if(nextreg > bc->nregs) {
+        bc->nregs = nextreg;
+    }
+    return reg;
+}
+
+void bytecode_compiler::free_regs(int first) {
+    nextreg = first;
+}
+
+bool bytecode_compiler::resolve(shared_ptr<symbol> sym, int& depth, int& slot) {
+    for(size_t d = 0; d < env.size(); ++d) {
+        const compileframe& frame = env[env.size() - 1 - d];
+        // search backwards so a repeated argument name means the last one
+        for(size_t i = frame.visible; i > 0; --i) {
+            if((*frame.names)[i - 1] == sym) {
+                depth = d;
+                slot = i - 1;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+bool is_self_evaluating(shared_ptr<symbol> sym) {
+    return sym == t_symbol || sym->is_keyword();
+}
+
+void bytecode_compiler::compile_symbol(shared_ptr<symbol> sym, int dst) {
+    if(sym == nil_symbol) {
+        emit(op_loadnil, dst);
+    } else if(is_self_evaluating(sym)) {
+        emit(op_loadk, dst, add_constant(sym));
+    } else {
+        int depth, slot;
+        if(resolve(sym, depth, slot)) {
+            emit(op_getlocal, dst, depth, slot);
+        } else {
+            // globals, module level and REPL definitions
+            emit(op_getval, dst, add_constant(sym));
+        }
+    }
+}
+
+void bytecode_compiler::compile_expr(shared_ptr<lispobj> sexp, int dst, bool tail) {
+    shared_ptr<cons> c = lisp_cast<cons>(sexp);
+    if(!c) {
+        if(shared_ptr<symbol> sym = lisp_cast<symbol>(sexp)) {
+            compile_symbol(sym, dst);
+        } else {
+            emit(op_loadk, dst, add_constant(sexp));
+        }
+
+        if(tail) {
+            emit(op_return, dst);
+        }
+        return;
+    }
+
+    shared_ptr<symbol> head = lisp_cast<symbol>(c->car());
+    if(!head || !is_special_form(head)) {
+        compile_call(c, dst, tail);
+        return;
+    }
+
+    shared_ptr<cons> args = lisp_cast<cons>(c->cdr());
+
+    if(head == if_symbol) {
+        compile_if(c, dst, tail);
+    } else if(head == begin_symbol) {
+        compile_sequence(c->cdr(), dst, tail);
+    } else if(head == quote_symbol) {
+        if(!args || !is_a<nil>(args->cdr())) {
+            compile_fallback(c, dst, tail);
+            return;
+        }
+        emit(op_loadk, dst, add_constant(args->car()));
+        if(tail) {
+            emit(op_return, dst);
+        }
+    } else if(head == lambda_symbol) {
+        if(!args || !lisp_cast<cons>(args->cdr())) {
+            compile_fallback(c, dst, tail);
+            return;
+        }
+        bc->protos.push_back(compile_function_in(env, args->car(), args->cdr()));
+        emit(op_closure, dst, add_constant(args), bc->protos.size() - 1);
+        if(tail) {
+            emit(op_return, dst);
+        }
+    } else if(head == defun_symbol || head == defmacro_symbol) {
+        emit(head == defun_symbol ? op_defun : op_defmacro, dst, add_constant(c->cdr()));
+        if(tail) {
+            emit(op_return, dst);
+        }
+    } else if(head == let_star_symbol) {
+        compile_let_star(c, dst, tail);
+    } else {
+        // module, import and macro-expand-1 are rare and stateful, so
+        // leave them to the stepper
+        compile_fallback(c, dst, tail);
+    }
+}
+
+void bytecode_compiler::compile_sequence(shared_ptr<lispobj> body, int dst, bool tail) {
+    shared_ptr<cons> c = lisp_cast<cons>(body);
+    if(!c) {
+        emit(op_loadnil, dst);
+        if(tail) {
+            emit(op_return, dst);
+        }
+        return;
+    }
+
+    while(c) {
+        shared_ptr<cons> next = lisp_cast<cons>(c->cdr());
+        compile_expr(c->car(), dst, tail && !next);
+        c = next;
+    }
+}
+
+void bytecode_compiler::compile_call(shared_ptr<cons> form, int dst, bool tail) {
+    int base = alloc_reg();
+    int head_instruction = -1;
+
+    shared_ptr<symbol> head = lisp_cast<symbol>(form->car());
+    if(head && head != nil_symbol && !is_self_evaluating(head)) {
+        bc->callsites.push_back(callsite(head));
+        head_instruction = emit(op_getfun, base, bc->callsites.size() - 1, add_constant(form));
+    } else {
+        compile_expr(form->car(), base, false);
+    }
+
+    int argc = 0;
+    shared_ptr<lispobj> args = form->cdr();
+    shared_ptr<cons> c = lisp_cast<cons>(args);
+    while(c) {
+        compile_expr(c->car(), alloc_reg(), false);
+        ++argc;
+        args = c->cdr();
+        c = lisp_cast<cons>(args);
+    }
+
+    int call_instruction;
+    if(tail) {
+        call_instruction = emit(op_tailcall, dst, base, argc);
+    } else {
+        call_instruction = emit(op_call, dst, base, argc);
+    }
+
+    if(head_instruction >= 0) {
+        bc->code[head_instruction].d = call_instruction;
+    }
+
+    free_regs(base);
+}
+
+void bytecode_compiler::compile_if(shared_ptr<cons> form, int dst, bool tail) {
+    shared_ptr<cons> condition = lisp_cast<cons>(form->cdr());
+    shared_ptr<cons> branches = condition ? lisp_cast<cons>(condition->cdr()) : nullptr;
+    if(!branches) {
+        compile_fallback(form, dst, tail);
+        return;
+    }
+
+    compile_expr(condition->car(), dst, false);
+    int jump_to_else = emit(op_jumpifnot, dst);
+
+    compile_expr(branches->car(), dst, tail);
+    int jump_to_end = -1;
+    if(!tail) {
+        jump_to_end = emit(op_jump);
+    }
+
+    bc->code[jump_to_else].b = bc->code.size();
+    shared_ptr<cons> else_branch = lisp_cast<cons>(branches->cdr());
+    if(else_branch) {
+        compile_expr(else_branch->car(), dst, tail);
+    } else {
+        emit(op_loadnil, dst);
+        if(tail) {
+            emit(op_return, dst);
+        }
+    }
+
+    if(jump_to_end >= 0) {
+        bc->code[jump_to_end].a = bc->code.size();
+    }
+}
+
+void bytecode_compiler::compile_let_star(shared_ptr<cons> form, int dst, bool tail) {
+    shared_ptr<cons> c = lisp_cast<cons>(form->cdr());
+    if(!c) {
+        compile_fallback(form, dst, tail);
+        return;
+    }
+
+    // check the bindings first, so that malformed ones get the stepper's
+    // error messages
+    shared_ptr<cons> binding_list = lisp_cast<cons>(c->car());
+    for(shared_ptr<cons> b = binding_list; b; b = lisp_cast<cons>(b->cdr())) {
+        shared_ptr<cons> cons_binding = lisp_cast<cons>(b->car());
+        if(!lisp_cast<symbol>(b->car()) &&
+           !(cons_binding && lisp_cast<symbol>(cons_binding->car()))) {
+            compile_fallback(form, dst, tail);
+            return;
+        }
+    }
+
+    // every distinct name gets a slot, in order of first binding
+    shared_ptr<slotlayout> layout(new slotlayout);
+    vector<size_t> binding_slots;
+    for(shared_ptr<cons> b = binding_list; b; b = lisp_cast<cons>(b->cdr())) {
+        shared_ptr<cons> cons_binding = lisp_cast<cons>(b->car());
+        shared_ptr<symbol> name = lisp_cast<symbol>(cons_binding ? cons_binding->car() : b->car());
+        size_t slot = std::find(layout->begin(), layout->end(), name) - layout->begin();
+        if(slot == layout->size()) {
+            layout->push_back(name);
+        }
+        binding_slots.push_back(slot);
+    }
+
+    bc->layouts.push_back(layout);
+    emit(op_pushscope, bc->layouts.size() - 1);
+    env.push_back(compileframe(layout, 0));
+
+    int value = alloc_reg();
+    size_t binding_index = 0;
+    for(shared_ptr<cons> b = binding_list; b; b = lisp_cast<cons>(b->cdr())) {
+        shared_ptr<cons> cons_binding = lisp_cast<cons>(b->car());
+        shared_ptr<cons> init = nullptr;
+        if(cons_binding) {
+            init = lisp_cast<cons>(cons_binding->cdr());
+        }
+
+        // the value is evaluated before its own name is bound
+        if(init) {
+            compile_expr(init->car(), value, false);
+        } else {
+            emit(op_loadnil, value);
+        }
+
+        size_t slot = binding_slots[binding_index++];
+        emit(op_setlocal, slot, value);
+        env.back().visible = std::max(env.back().visible, slot + 1);
+    }
+    free_regs(value);
+
+    // in tail position the body returns, or tail calls, from inside the
+    // new scope; both discard the frame's saved scopes
+    compile_sequence(c->cdr(), dst, tail);
+    env.pop_back();
+    if(!tail) {
+        emit(op_popscope);
+    }
+}
+
+void bytecode_compiler::compile_fallback(shared_ptr<lispobj> form, int dst, bool tail) {
+    emit(op_eval, dst, add_constant(form));
+    if(tail) {
+        emit(op_return, dst);
+    }
+}
+
+// Fills in the argument slots for args. Returns false if args is not a
+// proper list of symbols with at most one trailing &rest argument.
+bool parse_params(shared_ptr<lispobj> args, slotlayout& params, int& nparams, bool& hasrest) {
+    nparams = 0;
+    hasrest = false;
+
+    shared_ptr<cons> c = lisp_cast<cons>(args);
+    while(c) {
+        shared_ptr<symbol> name = lisp_cast<symbol>(c->car());
+        if(!name) {
+            return false;
+        }
+
+        if(name == rest_symbol) {
+            shared_ptr<cons> rest = lisp_cast<cons>(c->cdr());
+            if(!rest ||
+               !lisp_cast<symbol>(rest->car()) ||
+               !is_a<nil>(rest->cdr())) {
+                return false;
+            }
+            params.push_back(static_pointer_cast<symbol>(rest->car()));
+            hasrest = true;
+            return true;
+        }
+
+        params.push_back(name);
+        ++nparams;
+        args = c->cdr();
+        c = lisp_cast<cons>(args);
+    }
+
+    return is_a<nil>(args);
+}
+
+shared_ptr<bytecode> compile_function_in(vector<compileframe> env,
+                                         shared_ptr<lispobj> args,
+                                         shared_ptr<lispobj> body) {
+    shared_ptr<slotlayout> params(new slotlayout);
+    int nparams;
+    bool hasrest;
+    bool slotargs = parse_params(args, *params, nparams, hasrest);
+    if(!slotargs) {
+        // the call scope still exists, it just has no slots
+        params->clear();
+    }
+
+    env.push_back(compileframe(params, params->size()));
+    bytecode_compiler compiler(env);
+    compiler.compile_sequence(body, compiler.alloc_reg(), true);
+
+    shared_ptr<bytecode> ret = compiler.get_bytecode();
+    ret->source = body;
+    ret->params = params;
+    ret->nparams = nparams;
+    ret->hasrest = hasrest;
+    ret->slotargs = slotargs;
+    return ret;
+}
+
+shared_ptr<bytecode> compile_function(shared_ptr<lispobj> args, shared_ptr<lispobj> body) {
+    return compile_function_in(vector<compileframe>(), args, body);
+}
+
+shared_ptr<bytecode> compile_body(shared_ptr<lispobj> body) {
+    bytecode_compiler compiler((vector<compileframe>()));
+    compiler.compile_sequence(body, compiler.alloc_reg(), true);
+
+    shared_ptr<bytecode> ret = compiler.get_bytecode();
+    ret->source = body;
+    return ret;
+}
+
+shared_ptr<bytecode> compile_toplevel(shared_ptr<lispobj> code) {
+    bytecode_compiler compiler((vector<compileframe>()));
+    compiler.compile_expr(code, compiler.alloc_reg(), true);
+
+    shared_ptr<bytecode> ret = compiler.get_bytecode();
+    ret->source = code;
+    return ret;
+}
+
+class vmframe {
+public:
+    vmframe(shared_ptr<bytecode> c, shared_ptr<lexicalscope> s, size_t o, size_t b, size_t r) :
+        code(c),
+        scope(s),
+        ownscopes(o),
+        pc(0),
+        base(b),
+        ret(r)
+    {}
+
+    shared_ptr<bytecode> code;
+    shared_ptr<lexicalscope> scope;
+    vector< shared_ptr<lexicalscope> > savedscopes;
+    // how many of the innermost scopes no other call can reach: the
+    // call's own scope and the let* scopes inside it
+    size_t ownscopes;
+    size_t pc;
+    size_t base;
+    // register in the calling frame that receives our return value
+    size_t ret;
+};
+
+void print_vm_stack(const vector<vmframe>& frames, ostream& out) {
+    out << "VM stack size: " << frames.size() << endl;
+
+    for(auto it = frames.rbegin(); it != frames.rend(); ++it) {
+        if(it - frames.rbegin() == max_printed_frames / 2 && frames.size() > max_printed_frames) {
+            size_t skipped = frames.size() - max_printed_frames;
+            out << "... " << skipped << " frames not shown" << endl;
+            it += skipped;
+        }
+        out << "vm frame, pc " << it->pc - 1 << endl;
+        out << "  code: ";
+        it->code->source->print(out);
+        out << endl;
+    }
+}
+
+// Makes the call scope for func, with the arguments in its slots.
+shared_ptr<lexicalscope> bind_call_args(shared_ptr<lispfunc> func,
+                                        const shared_ptr<bytecode>& code,
+                                        const shared_ptr<lispobj>* args,
+                                        const shared_ptr<lispobj>* args_end) {
+    if(!code->slotargs) {
+        return bind_lispfunc_args(func, args, args_end);
+    }
+
+    int nargs = args_end - args;
+    if(nargs < code->nparams || (!code->hasrest && nargs > code->nparams)) {
+        throw string("ERROR: function arity does not match call.");
+    }
+
+    shared_ptr<lexicalscope> scope = make_pooled<lexicalscope>(func->closure, code->params);
+    for(int i = 0; i < code->nparams; ++i) {
+        scope->getslot(0, i) = args[i];
+    }
+    if(code->hasrest) {
+        scope->getslot(0, code->nparams) = make_list(args + code->nparams, args_end);
+    }
+
+    return scope;
+}
+
+static callcachestats call_cache_stats = callcachestats();
+
+callcachestats get_call_cache_stats() {
+    return call_cache_stats;
+}
+
+static size_t peak_vm_depth = 0;
+
+size_t get_peak_vm_depth() {
+    return peak_vm_depth;
+}
+
+static void collect_vm_frames(const void* stack, vector<profileframe>& out) {
+    const vector<vmframe>& frames = *static_cast<const vector<vmframe>*>(stack);
+    for(const vmframe& frame : frames) {
+        profileframe f;
+        f.code = frame.code;
+        out.push_back(f);
+    }
+}
+
+shared_ptr<lispobj> vm_run(shared_ptr<bytecode> code, shared_ptr<lexicalscope> scope,
+                           size_t ownscopes) {
+    evaluatorguard guard;
+    vector< shared_ptr<lispobj> > regs(code->nregs);
+    vector<vmframe> frames;
+    frames.push_back(vmframe(code, scope, ownscopes, 0, 0));
+    profiledstack profiled(collect_vm_frames, &frames);
+
+    shared_ptr<lispobj> result;
+
+    try {
+        while(true) {
+            vmframe& frame = frames.back();
+            const instruction& in = frame.code->code[frame.pc++];
+            const vector< shared_ptr<lispobj> >& k = frame.code->constants;
+            shared_ptr<lispobj>* r = &regs[frame.base];
+            bool returning = false;
+
+            switch(in.op) {
+            case op_loadk:
+                r[in.a] = k[in.b];
+                break;
+            case op_loadnil:
+                r[in.a] = make_nil();
+                break;
+            case op_getval:
+                r[in.a] = frame.scope->getval(static_pointer_cast<symbol>(k[in.b]));
+                break;
+            case op_getlocal:
+                r[in.a] = frame.scope->getslot(in.b, in.c);
+                break;
+            case op_setlocal:
+                frame.scope->getslot(0, in.a) = r[in.b];
+                break;
+            case op_getfun: {
+                callsite& site = frame.code->callsites[in.b];
+                if(site.epoch == definition_epoch) {
+                    ++call_cache_stats.hits;
+                    r[in.a] = *site.binding;
+                } else {
+                    ++call_cache_stats.misses;
+                    bool cacheable;
+                    const shared_ptr<lispobj>* binding =
+                        frame.scope->find_fun_binding(site.name, frame.ownscopes, cacheable);
+                    //XXX: should be undefined so eval loop can error
+                    r[in.a] = binding ? *binding : make_nil();
+                    if(cacheable) {
+                        site.binding = binding;
+                        site.epoch = definition_epoch;
+                    }
+                }
+
+                if(lisp_cast<macro>(r[in.a])) {
+                    // a macro that was not expanded ahead of time, so
+                    // let the stepper expand and evaluate the whole call
+                    const instruction& call = frame.code->code[in.d];
+                    result = run_stepper(k[in.c], frame.scope);
+                    if(call.op == op_tailcall) {
+                        returning = true;
+                    } else {
+                        r[call.a] = result;
+                        frame.pc = in.d + 1;
+                    }
+                }
+                break;
+            }
+            case op_call:
+            case op_tailcall: {
+                if(profile_sample_due) {
+                    take_profile_sample();
+                }
+                shared_ptr<lispobj> f = r[in.b];
+                shared_ptr<lispobj>* args = r + in.b + 1;
+
+                if(shared_ptr<lispfunc> func = lisp_cast<lispfunc>(f)) {
+                    shared_ptr<bytecode> newcode = func->get_compiled_code();
+                    shared_ptr<lexicalscope> newscope = bind_call_args(func, newcode, args, args + in.c);
+
+                    for(int i = 0; i <= in.c; ++i) {
+                        r[in.b + i].reset();
+                    }
+
+                    if(in.op == op_tailcall) {
+                        for(int i = 0; i < frame.code->nregs; ++i) {
+                            r[i].reset();
+                        }
+                        frame.code = newcode;
+                        frame.scope = newscope;
+                        frame.savedscopes.clear();
+                        frame.ownscopes = 1;
+                        frame.pc = 0;
+                        if(regs.size() < frame.base + newcode->nregs) {
+                            regs.resize(frame.base + newcode->nregs);
+                        }
+                    } else {
+                        if(frames.size() >= get_max_stack_depth()) {
+                            throw_stack_depth_error();
+                        }
+                        size_t newbase = frame.base + frame.code->nregs;
+                        size_t ret = frame.base + in.a;
+                        if(regs.size() < newbase + newcode->nregs) {
+                            regs.resize(newbase + newcode->nregs);
+                        }
+                        frames.push_back(vmframe(newcode, newscope, 1, newbase, ret));
+                        if(frames.size() > peak_vm_depth) {
+                            peak_vm_depth = frames.size();
+                        }
+                    }
+                } else if(shared_ptr<cfunc> cf = lisp_cast<cfunc>(f)) {
+                    result = cf->func(argspan(args, args + in.c));
+                    if(!result) {
+                        throw string("error in cfunc");
+                    }
+
+                    if(in.op == op_tailcall) {
+                        returning = true;
+                    } else {
+                        r[in.a] = result;
+                    }
+                } else {
+                    throw string("trying to apply a non-function");
+                }
+                break;
+            }
+            case op_jump:
+                frame.pc = in.a;
+                break;
+            case op_jumpifnot:
+                if(!istrue(r[in.a])) {
+                    frame.pc = in.b;
+                }
+                break;
+            case op_return:
+                result = r[in.a];
+                returning = true;
+                break;
+            case op_closure: {
+                shared_ptr<cons> lambda_args = static_pointer_cast<cons>(k[in.b]);
+                shared_ptr<lispfunc> func(new lispfunc(lambda_args->car(),
+                                                       frame.scope,
+                                                       lambda_args->cdr()));
+                // every closure made from the same lambda shares one
+                // compiled body
+                func->set_compiled_code(frame.code->protos[in.c]);
+                r[in.a] = func;
+                break;
+            }
+            case op_defun:
+                r[in.a] = eval_defun(k[in.b], frame.scope);
+                break;
+            case op_defmacro:
+                r[in.a] = eval_defmacro(k[in.b], frame.scope);
+                break;
+            case op_pushscope:
+                frame.savedscopes.push_back(frame.scope);
+                frame.scope = make_pooled<lexicalscope>(frame.scope, frame.code->layouts[in.a]);
+                ++frame.ownscopes;
+                break;
+            case op_popscope:
+                frame.scope = frame.savedscopes.back();
+                frame.savedscopes.pop_back();
+                --frame.ownscopes;
+                break;
+            case op_eval:
+                r[in.a] = run_stepper(k[in.b], frame.scope);
+                break;
+            }
+
+            if(returning) {
+                size_t ret = frame.ret;
+                for(int i = 0; i < frame.code->nregs; ++i) {
+                    r[i].reset();
+                }
+                frames.pop_back();
+
+                if(frames.empty()) {
+                    return result;
+                }
+
+                regs[ret] = result;
+            }
+        }
+    } catch(string error) {
+        stringstream trace;
+        trace << error;
+        if(error.empty() || *error.rbegin() != '\n') {
+            trace << endl;
+        }
+        print_vm_stack(frames, trace);
+        throw trace.str();
+    }
+}
+
+shared_ptr<lispobj> vm_apply(shared_ptr<lispfunc> func,
+                             const shared_ptr<lispobj>* args,
+                             const shared_ptr<lispobj>* args_end) {
+    shared_ptr<bytecode> code = func->get_compiled_code();
+    return vm_run(code, bind_call_args(func, code, args, args_end), 1);
+}
+
+shared_ptr<lispobj> vm_eval(shared_ptr<lispobj> code, shared_ptr<lexicalscope> tls) {
+    try {
+        return vm_run(compile_toplevel(code), tls);
+    } catch(string error) {
+        cout << error;
+        return NULL;
+    }
+}
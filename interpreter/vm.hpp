@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <vector>
+
+#include "deviser.hpp"
+
+// The vm runs lisp code that has been compiled to a small register
+// based bytecode. Function bodies are compiled once, from the macro
+// expanded code, and then cached on the lispfunc. Anything the compiler
+// does not understand is handed back to the stepper with op_eval, so the
+// two evaluators always agree on semantics.
+
+enum opcode : uint8_t {
+    op_loadk,     // r[a] = k[b]
+    op_loadnil,   // r[a] = nil
+    op_getval,    // r[a] = value of symbol k[b]
+    op_getlocal,  // r[a] = slot c of the scope b levels up
+    op_setlocal,  // slot a of the current scope = r[b]
+    op_getfun,    // r[a] = function named by callsites[b]; if it is a macro,
+                  //        eval form k[c] with the stepper and resume after
+                  //        the call at d
+    op_call,      // r[a] = r[b](r[b+1] ... r[b+c])
+    op_tailcall,  // return r[b](r[b+1] ... r[b+c])
+    op_jump,      // pc = a
+    op_jumpifnot, // if r[a] is nil, pc = b
+    op_return,    // return r[a]
+    op_closure,   // r[a] = lambda k[b], body compiled into protos[c]
+    op_defun,     // r[a] = name, after defining the function described by k[b]
+    op_defmacro,  // r[a] = name, after defining the macro described by k[b]
+    op_pushscope, // scope = new lexicalscope(scope) with slots layouts[a]
+    op_popscope,  // scope = saved scope
+    op_eval       // r[a] = stepper eval of k[b]
+};
+
+struct instruction {
+    opcode op;
+    int a;
+    int b;
+    int c;
+    int d;
+};
+
+// Each call to a named function remembers where the name was bound the
+// last time, for as long as definition_epoch stays what it was then.
+class callsite {
+public:
+    callsite(shared_ptr<symbol> n) :
+        name(n),
+        binding(nullptr),
+        epoch(0)
+    {}
+
+    shared_ptr<symbol> name;
+    const shared_ptr<lispobj>* binding;
+    uint64_t epoch;
+};
+
+class bytecode {
+public:
+    bytecode();
+
+    vector<instruction> code;
+    vector< shared_ptr<lispobj> > constants;
+    vector< shared_ptr<bytecode> > protos;
+    vector< shared_ptr<const slotlayout> > layouts;
+    vector<callsite> callsites;
+    int nregs;
+    shared_ptr<lispobj> source;
+    // the function's name, for the profiler, when it came from a defun
+    shared_ptr<symbol> name;
+
+    // Arguments go into the slots of the call scope, in params order,
+    // unless the argument list could not be parsed (slotargs is false),
+    // in which case bind_lispfunc_args reports the error at call time.
+    shared_ptr<const slotlayout> params;
+    int nparams;
+    bool hasrest;
+    bool slotargs;
+};
+
+enum evalmode {
+    vm_mode,
+    stepper_mode
+};
+
+void set_eval_mode(evalmode mode);
+evalmode get_eval_mode();
+
+// body is a list of statements, as returned by get_expanded_code()
+shared_ptr<bytecode> compile_function(shared_ptr<lispobj> args, shared_ptr<lispobj> body);
+shared_ptr<bytecode> compile_body(shared_ptr<lispobj> body);
+shared_ptr<bytecode> compile_toplevel(shared_ptr<lispobj> code);
+
+// ownscopes is 1 when scope was made for this run alone, like the
+// scope of a function call, and 0 when other code can see it too
+shared_ptr<lispobj> vm_run(shared_ptr<bytecode> code, shared_ptr<lexicalscope> scope,
+                           size_t ownscopes = 0);
+shared_ptr<lispobj> vm_apply(shared_ptr<lispfunc> func,
+                             const shared_ptr<lispobj>* args,
+                             const shared_ptr<lispobj>* args_end);
+shared_ptr<lispobj> vm_eval(shared_ptr<lispobj> code, shared_ptr<lexicalscope> tls);
+
+class callcachestats {
+public:
+    size_t hits;
+    size_t misses;
+};
+
+// totals since startup
+callcachestats get_call_cache_stats();
+
+// the most frames one vm_run has had at once
+size_t get_peak_vm_depth();